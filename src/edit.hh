@@ -77,6 +77,98 @@ public:
     util::event<const std::shared_ptr<res::project> &> on_project_change;
 };
 
+/*
+ * edit::task_window
+ *
+ * A small window showing the progress of a task running on a background
+ * thread, with a button to cancel it. The task is given a `util::progress' to
+ * report through and to check for cancellation.
+ *
+ * Once the task finishes, the window calls its `finish' function on the UI
+ * thread and hides itself. If the task or `finish' fails, the error is shown
+ * in the window until the user closes it. If the task is cancelled, the window
+ * simply hides itself and `finish' is not called.
+ */
+class task_window : private gui::window {
+public:
+    // (typedef) work_fn
+    // The function run on the background thread.
+    using work_fn = std::function<void(util::progress &)>;
+
+    // (typedef) finish_fn
+    // The function run on the UI thread after the task succeeds.
+    using finish_fn = std::function<void()>;
+
+private:
+    // (inner class) view
+    // The contents of the window. Each frame, this checks whether the task
+    // has finished and draws its progress or result.
+    class view : private gui::widget_im {
+    private:
+        task_window &m_wnd;
+
+        // (func) frame
+        // Implements `widget_im::frame'.
+        void frame() final override;
+
+    public:
+        // (explicit ctor)
+        // Constructs the view filling the given task window.
+        explicit view(task_window &wnd);
+
+        using widget_im::show;
+    };
+
+    // (var) m_text
+    // The description of the task shown above its progress.
+    std::string m_text;
+
+    // (var) m_progress
+    // The progress of the task, shared with the background thread.
+    util::progress m_progress;
+
+    // (var) m_finish
+    // The function to call once the task has succeeded.
+    finish_fn m_finish;
+
+    // (var) m_result
+    // The future for the task running on the background thread, or an
+    // invalid future once its result has been handled.
+    std::future<void> m_result;
+
+    // (var) m_error
+    // The message of the error which ended the task, if any.
+    std::string m_error;
+
+    // (var) m_view
+    // The widget drawing the window's contents.
+    view m_view{*this};
+
+    // (func) on_close_request
+    // Cancels the task, or hides the window if the task has already ended.
+    void on_close_request() override;
+
+public:
+    // (explicit ctor)
+    // Shows the window and starts running `work' on a new background thread.
+    explicit task_window(
+        const std::string &title,
+        std::string text,
+        work_fn work,
+        finish_fn finish);
+
+    // (dtor)
+    // Cancels the task if it is still running, and waits for it to stop.
+    ~task_window();
+
+    // (func) is_running
+    // Returns true if the task has not yet ended and been handled.
+    bool is_running() const
+    {
+        return m_result.valid();
+    }
+};
+
 namespace menus {
 
 /*
@@ -88,11 +180,47 @@ namespace menus {
 class mni_open : private gui::menu::item {
 private:
     context &m_ctx;
+
+    // (var) m_task
+    // The window for the most recent import, which runs in the background.
+    // This is kept until the next import starts so that the window is never
+    // destroyed from within its own frame.
+    std::unique_ptr<task_window> m_task;
+
+    // (var) m_cache_writer
+    // Writes the results of imports to the import cache in the background, in
+    // the order they finished. Destroying it waits for any pending writes.
+    util::thread_pool m_cache_writer;
+
     void on_activate() final override;
 
 public:
     explicit mni_open(gui::menu &menu, context &ctx) :
         item(menu, "Open"),
+        m_ctx(ctx),
+        m_cache_writer(1) {}
+};
+
+/*
+ * edit::menus::mni_open_folder
+ *
+ * File -> Open Folder
+ * Opens every NSF file in a folder, such as every level of a game, into the
+ * same project. Entries which are identical between the files are shared.
+ */
+class mni_open_folder : private gui::menu::item {
+private:
+    context &m_ctx;
+
+    // (var) m_task
+    // The window for the most recent import, as with `mni_open::m_task'.
+    std::unique_ptr<task_window> m_task;
+
+    void on_activate() final override;
+
+public:
+    explicit mni_open_folder(gui::menu &menu, context &ctx) :
+        item(menu, "Open Folder"),
         m_ctx(ctx) {}
 };
 
@@ -105,6 +233,12 @@ public:
 class mni_save_as : private gui::menu::item {
 private:
     context &m_ctx;
+
+    // (var) m_task
+    // The window for the most recent save, which runs in the background. This
+    // is kept until the next save starts, as with `mni_open::m_task'.
+    std::unique_ptr<task_window> m_task;
+
     void on_activate() final override;
 
 public:
@@ -113,6 +247,42 @@ public:
         m_ctx(ctx) {}
 };
 
+/*
+ * edit::menus::mni_open_project
+ *
+ * File -> Open Project
+ * Opens a project file saved by `mni_save_project' as a new project. The
+ * assets' properties are loaded from the file as they are used.
+ */
+class mni_open_project : private gui::menu::item {
+private:
+    context &m_ctx;
+    void on_activate() final override;
+
+public:
+    explicit mni_open_project(gui::menu &menu, context &ctx) :
+        item(menu, "Open Project"),
+        m_ctx(ctx) {}
+};
+
+/*
+ * edit::menus::mni_save_project
+ *
+ * File -> Save Project
+ * Saves the currently open project, with all of its assets, to a project
+ * file.
+ */
+class mni_save_project : private gui::menu::item {
+private:
+    context &m_ctx;
+    void on_activate() final override;
+
+public:
+    explicit mni_save_project(gui::menu &menu, context &ctx) :
+        item(menu, "Save Project"),
+        m_ctx(ctx) {}
+};
+
 /*
  * edit::menus::mni_exit
  *
@@ -137,7 +307,10 @@ class mnu_file : private gui::menubar::item {
 private:
     context &m_ctx;
     mni_open m_open{*this, m_ctx};
+    mni_open_folder m_open_folder{*this, m_ctx};
     mni_save_as m_save_as{*this, m_ctx};
+    mni_open_project m_open_project{*this, m_ctx};
+    mni_save_project m_save_project{*this, m_ctx};
     mni_exit m_exit{*this};
 
 public:
@@ -182,6 +355,25 @@ public:
     explicit mni_redo(gui::menu &menu, context &ctx);
 };
 
+/*
+ * edit::menus::mni_pack_pages
+ *
+ * Edit -> Pack Pages
+ * Redistributes the entries of the open NSF file so that it uses as few pages
+ * as possible (see `nsf::archive::plan_packing'). If any entries move, the
+ * user is asked where to save the new lookup table for the level's NSD file.
+ */
+class mni_pack_pages : private gui::menu::item {
+private:
+    context &m_ctx;
+    void on_activate() final override;
+
+public:
+    explicit mni_pack_pages(gui::menu &menu, context &ctx) :
+        item(menu, "Pack Pages"),
+        m_ctx(ctx) {}
+};
+
 /*
  * edit::menus::mnu_edit
  *
@@ -192,6 +384,7 @@ private:
     context &m_ctx;
     mni_undo m_undo{*this, m_ctx};
     mni_redo m_redo{*this, m_ctx};
+    mni_pack_pages m_pack_pages{*this, m_ctx};
 
 public:
     explicit mnu_edit(gui::menubar &menubar, context &ctx) :
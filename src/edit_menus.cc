@@ -21,8 +21,12 @@
 #include "common.hh"
 #include "edit.hh"
 #include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
 #include "nsf.hh"
 #include "misc.hh"
+#include "fs.hh"
 
 // FIXME temporary hack for gtk_main_quit
 #if USE_GTK3
@@ -33,74 +37,326 @@ namespace drnsf {
 namespace edit {
 namespace menus {
 
+// (s-const) import_cache_version
+// Bump this whenever a change to importing or processing NSF files changes the
+// assets produced, so that results cached by older builds are not used.
+constexpr int import_cache_version = 1;
+
+// (s-const) use_import_cache
+// Whether the results of opening NSF files are cached. Development builds all
+// share the same version, so nothing in the cache key could tell apart the
+// files cached by different builds, and a build could load assets produced by
+// an older importer. The cache is therefore only used by release builds.
+#if APP_IS_DEV_VERSION
+constexpr bool use_import_cache = false;
+#else
+constexpr bool use_import_cache = true;
+#endif
+
+// (s-const) import_cache_size
+// The total size of the files kept in the import cache.
+constexpr uint64_t import_cache_size = 1024 * 1024 * 1024;
+
+// (s-func) get_import_cache
+// Gets the cache of processed NSF files, which holds the assets created by
+// opening each file as a project file (see `res::save_assets').
+static util::disk_cache &get_import_cache()
+{
+    static util::disk_cache s_cache(
+        (fs::u8path(util::disk_cache::get_default_dir()) / "import")
+            .u8string(),
+        import_cache_size
+    );
+    return s_cache;
+}
+
+// (s-func) get_import_cache_key
+// Gets the key for the given NSF file data in the import cache. This is a hash
+// of the data, seeded by the DRNSF version and `import_cache_version'.
+static std::string get_import_cache_key(
+    const util::slice &data,
+    nsf::game_ver ver)
+{
+    std::string version = APP_VERSION;
+    version += " $ $"_fmt(import_cache_version, int(ver));
+
+    auto seed = util::hash64(
+        reinterpret_cast<const util::byte *>(version.data()),
+        version.size()
+    );
+    auto hash = util::hash64(data.data(), data.size(), seed);
+
+    char key[32];
+    std::snprintf(
+        key,
+        sizeof(key),
+        "%016llx.drpj",
+        static_cast<unsigned long long>(hash)
+    );
+    return key;
+}
+
+// (s-func) save_lookup_table
+// Asks the user where to save the lookup table of the given archive, for the
+// level's NSD file, and writes it there. The game finds the page of each entry
+// through this table, so it must be saved again whenever entries move between
+// pages. Nothing is written if the user cancels.
+static void save_lookup_table(const nsf::archive::ref &nsf_asset)
+{
+    std::string path;
+    if (!gui::show_save_dialog(path)) return;
+
+    auto table = nsf_asset->build_lookup_table().export_file();
+    util::replace_file(path, [&](std::ostream &out) {
+        out.write(reinterpret_cast<const char *>(table.data()), table.size());
+    });
+}
+
 // declared in edit.hh
 void mni_open::on_activate()
 {
+    // Only one import may run at a time.
+    if (m_task && m_task->is_running())
+        return;
+
     // Get the file to open from the user.
     std::string path;
     if (!gui::show_open_dialog(path)) return;
 
-    // Create the new project to import into.
-    auto proj_p = m_ctx.get_proj(); //FIXME
-    auto &proj = *proj_p;
+    // Map the NSF file into memory. The file's contents are only read from
+    // disk as the import accesses them, and the imported pages, pagelets, and
+    // items all point into this mapping.
+    util::slice nsf_data(std::make_shared<util::mapped_file>(path));
+
+    // The state shared between the background task, which fills it in, and
+    // the finish function, which imports it once the task is done.
+    struct open_state {
+        // (var) cache_key
+        // The file's key in the import cache, if the cache is used.
+        std::string cache_key;
+
+        // (var) cached
+        // The file's processed assets from the import cache, or empty if
+        // the file was not found in the cache or could not be loaded.
+        util::slice cached;
+
+        // (var) pages
+        // The decoded pages of the file if it was not found in the cache.
+        std::vector<nsf::archive::decoded_page> pages;
+    };
+    auto state = std::make_shared<open_state>();
+
+    // Look for the file in the import cache, and otherwise parse the pages
+    // and their entries, in the background so that the UI stays free.
+    auto work = [nsf_data, state](util::progress &progress) {
+        auto ver = nsf::detect_game_ver(nsf_data);
+
+        // A cache which cannot be read is the same as a cache miss. The cached
+        // file is loaded into a scratch project here, so that a damaged or
+        // outdated file is found before `finish' relies on it; such a file is
+        // removed from the cache and the NSF file is decoded instead.
+        if (use_import_cache) {
+            state->cache_key = get_import_cache_key(nsf_data, ver);
+            try {
+                auto cached_path = get_import_cache().find(state->cache_key);
+                if (!cached_path.empty()) {
+                    state->cached = util::slice(
+                        std::make_shared<util::mapped_file>(cached_path)
+                    );
+                    res::project scratch_proj;
+                    scratch_proj.get_transact().run([&](TRANSACT) {
+                        res::load_project(TS, scratch_proj, state->cached);
+                    });
+                    return;
+                }
+            } catch (res::import_error &) {
+                state->cached = {};
+                get_import_cache().remove(state->cache_key);
+            } catch (std::exception &) {
+                state->cached = {};
+            }
+        }
+
+        util::thread_pool pool;
+        state->pages = nsf::archive::decode_pages(
+            nsf_data,
+            ver,
+            pool,
+            false,
+            &progress
+        );
+    };
+
+    // Create the assets in a single transaction on the UI thread, either from
+    // the cache or from the decoded pages. In the second case, the new assets
+    // are then stored in the cache for the next time this file is opened.
+    auto finish = [this, state] {
+        auto proj_p = m_ctx.get_proj(); //FIXME
+        auto &proj = *proj_p;
+
+        if (!state->cached.empty()) {
+            proj.get_transact().run([&](TRANSACT) {
+                TS.describe("Import NSF");
+                res::load_project(TS, proj, state->cached);
+            });
+            return;
+        }
+
+        std::vector<res::asset *> new_assets;
+        decltype(res::project::on_asset_appear)::watch h_asset_appear;
+        h_asset_appear <<= [&](res::asset &asset) {
+            new_assets.push_back(&asset);
+        };
+        h_asset_appear.bind(proj.on_asset_appear);
+
+        proj.get_transact().run([&](TRANSACT) {
+            TS.describe("Import NSF");
+
+            nsf::archive::ref nsf_asset = proj.get_asset_root() / "nsfile";
+            nsf_asset.create(TS, proj);
+            nsf_asset->import_decoded(TS, std::move(state->pages));
+        });
+        h_asset_appear.unbind();
+
+        // The cache is only an optimization, so failing to store the assets
+        // in it does not fail the import. The assets are encoded here, as they
+        // may only be used on this thread, but the file is written and synced
+        // to disk in the background.
+        if (use_import_cache) {
+            try {
+                std::ostringstream out;
+                res::save_assets(new_assets, out);
+                auto data = std::make_shared<std::string>(out.str());
+                m_cache_writer.post([key = state->cache_key, data] {
+                    try {
+                        get_import_cache().store(key, [&](std::ostream &file) {
+                            file.write(data->data(), data->size());
+                        });
+                    } catch (std::exception &) {}
+                });
+            } catch (std::exception &) {}
+        }
 
-    proj.get_transact().run([&](TRANSACT) {
-        TS.describe("Import NSF");
+        // Point the context to the newly opened project.
+        // TODO
+    };
 
-        // Open the NSF file and read the data into memory.
-        auto nsf_file = util::fstream_open_bin(path, std::fstream::in);
-        nsf_file.exceptions(std::fstream::failbit | std::fstream::eofbit);
+    m_task = nullptr;
+    m_task = std::make_unique<task_window>(
+        "Open",
+        "Reading $"_fmt(path),
+        std::move(work),
+        std::move(finish)
+    );
+}
 
-        nsf_file.seekg(0, std::fstream::end);
-        auto nsf_size = nsf_file.tellg();
-        nsf_file.seekg(0, std::fstream::beg);
+// declared in edit.hh
+void mni_open_folder::on_activate()
+{
+    // Only one import may run at a time.
+    if (m_task && m_task->is_running())
+        return;
 
-        util::blob nsf_data(nsf_size);
-        nsf_file.read(
-            reinterpret_cast<char *>(nsf_data.data()),
-            nsf_size
+    // Get the folder to open from the user.
+    std::string path;
+    if (!gui::show_dir_dialog(path)) return;
+
+    // Find the NSF files in the folder. These are sorted so that the files
+    // are always imported in the same order, and so share the same entries.
+    std::vector<fs::path> paths;
+    for (auto &&de : fs::directory_iterator(fs::u8path(path))) {
+        auto ext = de.path().extension().u8string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) {
+            return std::tolower(static_cast<unsigned char>(c));
+        });
+        if (ext == ".nsf" && fs::is_regular_file(de.path())) {
+            paths.push_back(de.path());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty()) return;
+
+    // Map each of the files into memory, as in `mni_open'.
+    std::vector<util::slice> files;
+    for (auto &&file_path : paths) {
+        files.emplace_back(
+            std::make_shared<util::mapped_file>(file_path.u8string())
         );
-        nsf_file.close();
-
-        // Import the data into an NSF asset.
-        nsf::archive::ref nsf_asset = proj.get_asset_root() / "nsfile";
-        nsf_asset.create(TS, proj);
-        nsf_asset->import_file(TS, std::move(nsf_data));
-
-        // Process all of the pages in the new NSF asset.
-        for (misc::raw_data::ref page : nsf_asset->get_pages()) {
-
-            // Pages with type 1 cannot be processed as normal pages.
-            if (page->get_data()[2] == 1)
-                continue;
-
-            nsf::spage::ref spage = page;
-            page->rename(TS, page / "_PROCESSING");
-            page /= "_PROCESSING";
-            spage.create(TS, proj);
-            spage->import_file(TS, page->get_data());
-            page->destroy(TS);
-
-            // Process all of the entries inside each standard page.
-            for (misc::raw_data::ref pagelet : spage->get_pagelets()) {
-                nsf::raw_entry::ref entry = pagelet;
-                pagelet->rename(TS, pagelet / "_PROCESSING");
-                pagelet /= "_PROCESSING";
-                entry.create(TS, proj);
-                entry->import_file(TS, pagelet->get_data());
-                pagelet->destroy(TS);
-                entry->process_by_type(TS, nsf::game_ver::crash2);
+    }
+
+    // Parse the pages and entries of all of the files in the background,
+    // finding the entries which are shared between them.
+    using decoded_files = std::vector<std::vector<nsf::archive::decoded_page>>;
+    auto decoded = std::make_shared<decoded_files>();
+    auto work = [files, decoded](util::progress &progress) {
+        // The files are all taken to be from the same game, which is Crash 1
+        // if any of them is.
+        auto ver = nsf::game_ver::crash2;
+        for (auto &&file : files) {
+            if (nsf::detect_game_ver(file) == nsf::game_ver::crash1) {
+                ver = nsf::game_ver::crash1;
+                break;
             }
         }
-    });
 
-    // Point the context to the newly opened project.
-    // TODO
+        util::thread_pool pool;
+        *decoded = nsf::archive::decode_files(
+            files,
+            ver,
+            pool,
+            false,
+            &progress
+        );
+    };
+
+    // Create the assets for all of the files in a single transaction. Each
+    // file is imported under "nsf" by its name without the extension.
+    auto finish = [this, paths, decoded] {
+        auto proj_p = m_ctx.get_proj(); //FIXME
+        auto &proj = *proj_p;
+
+        proj.get_transact().run([&](TRANSACT) {
+            TS.describe("Import NSF Folder");
+
+            auto nsf_dir = proj.get_asset_root() / "nsf";
+            std::vector<res::atom> names;
+            for (auto &&file_path : paths) {
+                auto stem = file_path.stem().u8string();
+                nsf::archive::ref nsf_asset = nsf_dir / stem;
+                for (int n = 2; nsf_asset.get(); n++) {
+                    nsf_asset = nsf_dir / "$-$"_fmt(stem, n);
+                }
+                nsf_asset.create(TS, proj);
+                names.push_back(nsf_asset);
+            }
+
+            for (auto &&i : util::range_of(names)) {
+                nsf::archive::ref nsf_asset = names[i];
+                nsf_asset->import_decoded(
+                    TS,
+                    std::move((*decoded)[i]),
+                    names
+                );
+            }
+        });
+    };
+
+    m_task = nullptr;
+    m_task = std::make_unique<task_window>(
+        "Open Folder",
+        "Reading $ files in $"_fmt(paths.size(), path),
+        std::move(work),
+        std::move(finish)
+    );
 }
 
 // declared in edit.hh
 void mni_save_as::on_activate()
 {
+    // Only one save may run at a time.
+    if (m_task && m_task->is_running())
+        return;
+
     // Verify that there is an open project.
     auto proj = m_ctx.get_proj();
     if (!proj) {
@@ -119,28 +375,105 @@ void mni_save_as::on_activate()
     std::string path;
     if (!gui::show_save_dialog(path)) return;
 
-    // TODO - make the remaining code asynchronous to not block the UI
-
-    // Deserialize all of the assets referenced (directly or indirectly) into
-    // one large blob of NSF file data.
-    util::blob nsf_data;
-    /*try*/ {
-        nsf_data = nsf_asset->export_file();
-    } /*catch (?) {
-        TODO - handle errors
-    }*/
-
-    // Write the NSF data into the file specified by the user.
-    /*try*/ {
-        auto nsf_file = util::fstream_open_bin(path, std::fstream::out);
-        nsf_file.exceptions(std::fstream::failbit);
-        nsf_file.write(
-            reinterpret_cast<char *>(nsf_data.data()),
-            nsf_data.size()
-        );
-    } /*catch (?) {
-        TODO - handle errors
-    }*/
+    // Redistribute the entries across the pages first if any page has grown
+    // over 64K, since the file could not be saved otherwise. This is its own
+    // transaction so that it can be undone like any other edit. Packing into
+    // fewer pages is left to `mni_pack_pages', so that saving an unchanged
+    // file does not move its entries.
+    auto plan = nsf_asset->plan_packing();
+    if (plan.overflow) {
+        proj->get_transact().run([&](TRANSACT) {
+            TS.describe("Pack Pages");
+            nsf_asset->apply_packing(TS, plan);
+        });
+
+        if (plan.pagelets_moved > 0) {
+            save_lookup_table(nsf_asset);
+        }
+    }
+
+    // Capture the pages and their entries here on the UI thread, so that the
+    // saved file reflects the project exactly as it is now even if it is
+    // edited while the save runs. Pages which are already in the export cache
+    // are captured as-is. Capturing the other pages exports their entries,
+    // so encoding entries (such as wgeo_v2 geometry), like measuring them
+    // for packing above, still blocks the UI; only assembling the pages,
+    // calculating their checksums, and writing the file happen in the
+    // background.
+    auto snap = std::make_shared<nsf::archive::snapshot>(
+        nsf_asset->take_snapshot()
+    );
+
+    // Assemble the remaining pages and write them out in the background. The
+    // file is written beside the target and then moved over it, so a failed
+    // or cancelled save leaves any existing file untouched. This also keeps
+    // the file intact while it may still be mapped by the open project,
+    // though on Windows saving over that file fails for as long as it is
+    // mapped (see `util::replace_file').
+    auto work = [path, snap](util::progress &progress) {
+        util::replace_file(path, [&](std::ostream &out) {
+            snap->export_to([&out](const util::byte *data, size_t size) {
+                out.write(reinterpret_cast<const char *>(data), size);
+            }, &progress);
+        });
+    };
+
+    // Keep the assembled pages for the next save, unless the project has
+    // changed since the snapshot was taken.
+    auto finish = [nsf_asset, snap] {
+        if (nsf_asset.ok()) {
+            nsf_asset->cache_snapshot(*snap);
+        }
+    };
+
+    m_task = nullptr;
+    m_task = std::make_unique<task_window>(
+        "Save As",
+        "Writing $"_fmt(path),
+        std::move(work),
+        std::move(finish)
+    );
+}
+
+// declared in edit.hh
+void mni_open_project::on_activate()
+{
+    // Get the file to open from the user.
+    std::string path;
+    if (!gui::show_open_dialog(path)) return;
+
+    // Map the project file into memory. Only the file's asset tables are read
+    // here; the property data is read from the mapping as it is used.
+    util::slice data(std::make_shared<util::mapped_file>(path));
+
+    auto proj = std::make_shared<res::project>();
+    proj->get_transact().run([&](TRANSACT) {
+        TS.describe("Open Project");
+        res::load_project(TS, *proj, data);
+    });
+
+    m_ctx.set_proj(std::move(proj));
+}
+
+// declared in edit.hh
+void mni_save_project::on_activate()
+{
+    // Verify that there is an open project.
+    auto proj = m_ctx.get_proj();
+    if (!proj) {
+        // TODO - error message box?
+        return;
+    }
+
+    // Get the file to save to from the user.
+    std::string path;
+    if (!gui::show_save_dialog(path)) return;
+
+    // The file may be the one the project was opened from, which is still
+    // mapped, so it is replaced only once the new file is complete.
+    util::replace_file(path, [&](std::ostream &out) {
+        res::save_project(*proj, out);
+    });
 }
 
 // declared in edit.hh
@@ -153,6 +486,37 @@ void mni_exit::on_activate()
     gui::end();
 }
 
+// declared in edit.hh
+void mni_pack_pages::on_activate()
+{
+    // Verify that there is an open project.
+    auto proj = m_ctx.get_proj();
+    if (!proj) {
+        // TODO - error message box?
+        return;
+    }
+
+    // Verify that there is an appropriate NSF asset to be packed.
+    nsf::archive::ref nsf_asset = proj->get_asset_root() / "nsfile";
+    if (!nsf_asset.ok()) {
+        // TODO - error message box
+        return;
+    }
+
+    auto plan = nsf_asset->plan_packing();
+    if (plan.changes_nothing())
+        return;
+
+    proj->get_transact().run([&](TRANSACT) {
+        TS.describe("Pack Pages");
+        nsf_asset->apply_packing(TS, plan);
+    });
+
+    if (plan.pagelets_moved > 0) {
+        save_lookup_table(nsf_asset);
+    }
+}
+
 // (s-func) get_undo_str
 // Gets the description of the specified context's undo transaction if it can be
 // undone, or null if there is some reason this cannot be done. Used by
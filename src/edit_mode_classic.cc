@@ -104,6 +104,16 @@ public:
         return changed;
     }
 
+    bool field(util::slice &value, std::string label)
+    {
+        gui::im::label(label);
+        gui::im::NextColumn();
+        gui::im::AlignFirstTextHeightToWidgets();
+        gui::im::label("[ $ bytes ]"_fmt(value.size()));
+        gui::im::NextColumn();
+        return false;
+    }
+
     bool field(gfx::vertex &value, std::string label)
     {
         gui::im::label(label);
@@ -229,12 +239,34 @@ void asset_pane::show()
         gfx::anim,
         gfx::mesh,
         gfx::model,
+        gfx::world,
         misc::raw_data,
         nsf::archive,
         nsf::spage,
+        nsf::tpage,
         nsf::raw_entry,
         nsf::wgeo_v2,
         nsf::entry> (*this, *g_selected_asset.get());
+
+    // Show how full a standard page is. This is calculated from the sizes of
+    // its pagelets without exporting them, so it is cheap enough to keep up
+    // to date as the page and its entries are edited.
+    if (auto page = dynamic_cast<nsf::spage *>(g_selected_asset.get())) {
+        gui::im::label("Page Fill");
+        im::NextColumn();
+        im::AlignFirstTextHeightToWidgets();
+        try {
+            auto size = page->export_size();
+            gui::im::label("$ / $ bytes ($%)"_fmt(
+                size,
+                nsf::page_size,
+                size * 100 / nsf::page_size
+            ));
+        } catch (res::export_error &ex) {
+            gui::im::label(ex.what());
+        }
+        im::NextColumn();
+    }
     im::Columns(1);
 }
 
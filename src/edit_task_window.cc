@@ -0,0 +1,117 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "common.hh"
+#include "edit.hh"
+
+namespace drnsf {
+namespace edit {
+
+// declared in edit.hh
+task_window::view::view(task_window &wnd) :
+    widget_im(wnd, gui::layout::fill()),
+    m_wnd(wnd)
+{
+}
+
+// declared in edit.hh
+void task_window::view::frame()
+{
+    ImGui::TextUnformatted(m_wnd.m_text.c_str());
+
+    // Handle the result of the task once it has ended.
+    if (m_wnd.m_result.valid() &&
+        m_wnd.m_result.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready) {
+        try {
+            m_wnd.m_result.get();
+            m_wnd.m_finish();
+            m_wnd.hide();
+        } catch (util::cancelled_error &) {
+            m_wnd.hide();
+        } catch (std::exception &ex) {
+            m_wnd.m_error = ex.what();
+        }
+        return;
+    }
+
+    // Show the error which ended the task, until the user closes it.
+    if (!m_wnd.m_result.valid()) {
+        if (!m_wnd.m_error.empty()) {
+            ImGui::TextWrapped("Failed: %s", m_wnd.m_error.c_str());
+            if (ImGui::Button("Close")) {
+                m_wnd.hide();
+            }
+        }
+        return;
+    }
+
+    long done = m_wnd.m_progress.get_done();
+    long total = m_wnd.m_progress.get_total();
+    float fraction = total > 0 ? float(done) / total : 0.0f;
+    auto overlay = "$ / $"_fmt(done, total);
+    ImGui::ProgressBar(fraction, ImVec2(-1, 0), overlay.c_str());
+
+    if (m_wnd.m_progress.is_cancelled()) {
+        ImGui::Text("Cancelling...");
+    } else if (ImGui::Button("Cancel")) {
+        m_wnd.m_progress.cancel();
+    }
+}
+
+// declared in edit.hh
+void task_window::on_close_request()
+{
+    if (m_result.valid()) {
+        m_progress.cancel();
+    } else {
+        hide();
+    }
+}
+
+// declared in edit.hh
+task_window::task_window(
+    const std::string &title,
+    std::string text,
+    work_fn work,
+    finish_fn finish) :
+    window(title, 320, 100),
+    m_text(std::move(text)),
+    m_finish(std::move(finish))
+{
+    m_result = std::async(std::launch::async, [this, work]{
+        work(m_progress);
+    });
+    m_view.show();
+    show();
+}
+
+// declared in edit.hh
+task_window::~task_window()
+{
+    m_progress.cancel();
+    if (m_result.valid()) {
+        m_result.wait();
+    }
+}
+
+}
+}
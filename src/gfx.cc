@@ -0,0 +1,201 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "gfx.hh"
+
+namespace drnsf {
+namespace gfx {
+
+namespace {
+
+// (internal funcs) encode_polygon, decode_polygon
+// Write and read the fields shared by triangles and quads.
+template <typename Polygon>
+void encode_polygon(res::file_encoder &enc, const Polygon &value)
+{
+    for (auto &&corner : value.v) {
+        encode(enc, corner);
+    }
+    encode(enc, value.unk0);
+    encode(enc, value.unk1);
+}
+template <typename Polygon>
+void decode_polygon(res::file_decoder &dec, Polygon &value)
+{
+    for (auto &&corner : value.v) {
+        decode(dec, corner);
+    }
+    decode(dec, value.unk0);
+    decode(dec, value.unk1);
+}
+
+}
+
+// declared in gfx.hh
+void encode(res::file_encoder &enc, const vertex &value)
+{
+    encode(enc, value.x);
+    encode(enc, value.y);
+    encode(enc, value.z);
+    encode(enc, value.fx);
+    encode(enc, value.color_index);
+}
+void decode(res::file_decoder &dec, vertex &value)
+{
+    decode(dec, value.x);
+    decode(dec, value.y);
+    decode(dec, value.z);
+    decode(dec, value.fx);
+    decode(dec, value.color_index);
+}
+
+// declared in gfx.hh
+void encode(res::file_encoder &enc, const color &value)
+{
+    enc.put_bytes(value.v, 3);
+}
+void decode(res::file_decoder &dec, color &value)
+{
+    for (auto &&c : value.v) {
+        c = dec.get_uint(1);
+    }
+}
+
+// declared in gfx.hh
+void encode(res::file_encoder &enc, const corner &value)
+{
+    encode(enc, value.vertex_index);
+    encode(enc, value.color_index);
+}
+void decode(res::file_decoder &dec, corner &value)
+{
+    decode(dec, value.vertex_index);
+    decode(dec, value.color_index);
+}
+
+// declared in gfx.hh
+void encode(res::file_encoder &enc, const triangle &value)
+{
+    encode_polygon(enc, value);
+}
+void decode(res::file_decoder &dec, triangle &value)
+{
+    decode_polygon(dec, value);
+}
+
+// declared in gfx.hh
+void encode(res::file_encoder &enc, const quad &value)
+{
+    encode_polygon(enc, value);
+}
+void decode(res::file_decoder &dec, quad &value)
+{
+    decode_polygon(dec, value);
+}
+
+// (s-vars) g_*_file_type
+// Allow the gfx asset types to be stored in project files.
+static res::file_type_of<frame> g_frame_file_type;
+static res::file_type_of<anim> g_anim_file_type;
+static res::file_type_of<mesh> g_mesh_file_type;
+static res::file_type_of<model> g_model_file_type;
+static res::file_type_of<world> g_world_file_type;
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(gfx_file, RoundTrip)
+{
+    res::project proj;
+    auto root = proj.get_asset_root();
+    gfx::frame::ref frame = root / "frame";
+    gfx::mesh::ref mesh = root / "mesh";
+    gfx::model::ref model = root / "model";
+    gfx::world::ref world = root / "world";
+    proj.get_transact().run([&](TRANSACT) {
+        frame.create(TS, proj);
+        gfx::vertex v = {};
+        v.x = 1.5f;
+        v.z = -2.0f;
+        v.color_index = 7;
+        frame->set_vertices(TS, { v });
+
+        mesh.create(TS, proj);
+        gfx::triangle t = {};
+        t.v[2].vertex_index = 5;
+        t.unk1 = 9;
+        mesh->set_triangles(TS, { t });
+        gfx::color c;
+        c.r = 10;
+        c.g = 20;
+        c.b = 30;
+        mesh->set_colors(TS, { c });
+
+        model.create(TS, proj);
+        model->set_mesh(TS, mesh);
+
+        world.create(TS, proj);
+        world->set_x(TS, 0.25);
+    });
+
+    std::ostringstream out;
+    res::save_project(proj, out);
+    auto str = out.str();
+    util::slice data = util::blob(str.begin(), str.end());
+
+    res::project proj2;
+    auto root2 = proj2.get_asset_root();
+    proj2.get_transact().run([&](TRANSACT) {
+        res::load_project(TS, proj2, data);
+    });
+    EXPECT_EQ(proj2.get_asset_list().size(), 4u);
+
+    gfx::frame::ref frame2 = root2 / "frame";
+    ASSERT_TRUE(frame2.ok());
+    ASSERT_EQ(frame2->get_vertices().size(), 1u);
+    EXPECT_EQ(frame2->get_vertices()[0].x, 1.5f);
+    EXPECT_EQ(frame2->get_vertices()[0].z, -2.0f);
+    EXPECT_EQ(frame2->get_vertices()[0].color_index, 7);
+
+    gfx::mesh::ref mesh2 = root2 / "mesh";
+    ASSERT_TRUE(mesh2.ok());
+    ASSERT_EQ(mesh2->get_triangles().size(), 1u);
+    EXPECT_EQ(mesh2->get_triangles()[0].v[2].vertex_index, 5);
+    EXPECT_EQ(mesh2->get_triangles()[0].unk1, 9u);
+    ASSERT_EQ(mesh2->get_colors().size(), 1u);
+    EXPECT_EQ(mesh2->get_colors()[0].g, 20);
+
+    gfx::model::ref model2 = root2 / "model";
+    ASSERT_TRUE(model2.ok());
+    EXPECT_EQ(model2->get_mesh(), mesh2);
+    EXPECT_FALSE(model2->get_anim());
+
+    gfx::world::ref world2 = root2 / "world";
+    ASSERT_TRUE(world2.ok());
+    EXPECT_EQ(world2->get_x(), 0.25);
+    EXPECT_FALSE(world2->get_model());
+}
+
+}
+#endif
+
+}
+}
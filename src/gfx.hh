@@ -194,6 +194,23 @@ struct quad {
     unsigned int unk1;
 };
 
+/*
+ * gfx::encode, gfx::decode
+ *
+ * These write and read the value types above in a project file. See
+ * `res::file_encoder'.
+ */
+void encode(res::file_encoder &enc, const vertex &value);
+void decode(res::file_decoder &dec, vertex &value);
+void encode(res::file_encoder &enc, const color &value);
+void decode(res::file_decoder &dec, color &value);
+void encode(res::file_encoder &enc, const corner &value);
+void decode(res::file_decoder &dec, corner &value);
+void encode(res::file_encoder &enc, const triangle &value);
+void decode(res::file_decoder &dec, triangle &value);
+void encode(res::file_encoder &enc, const quad &value);
+void decode(res::file_decoder &dec, quad &value);
+
 /*
  * gfx::mesh
  *
@@ -343,6 +360,17 @@ public:
     DEFINE_APROP(x, double, 0.0);
     DEFINE_APROP(y, double, 0.0);
     DEFINE_APROP(z, double, 0.0);
+
+    // FIXME obsolete
+    template <typename Reflector>
+    void reflect(Reflector &rfl)
+    {
+        asset::reflect(rfl);
+        rfl.field(p_model, "Model");
+        rfl.field(p_x, "X");
+        rfl.field(p_y, "Y");
+        rfl.field(p_z, "Z");
+    }
 };
 
 }
@@ -612,6 +612,10 @@ public:
     // FIXME explain
     void show();
 
+    // (func) hide
+    // Hides the window. It may be shown again later with `show'.
+    void hide();
+
     // (func) show_dialog
     // FIXME explain
     void show_dialog();
@@ -1228,6 +1232,13 @@ public:
 bool show_open_dialog(std::string &path);
 bool show_save_dialog(std::string &path);
 
+/*
+ * gui::show_dir_dialog
+ *
+ * Like `show_open_dialog', but chooses a directory instead of a file.
+ */
+bool show_dir_dialog(std::string &path);
+
 #ifdef DRNSF_FRONTEND_IMPLEMENTATION
 #if USE_X11
 // (var) g_display
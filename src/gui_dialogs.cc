@@ -31,6 +31,7 @@ namespace {
 class file_dialog : private window, private widget_im {
 private:
     bool m_ok;
+    bool m_choose_dir;
     fs::path m_cdir;
     std::string m_filename;
 
@@ -51,7 +52,9 @@ private:
         }
 
         // "OK" confirmation button. Return successful if the path entered is
-        // a non-directory, or just browse to that directory if it is one.
+        // a non-directory, or just browse to that directory if it is one. When
+        // choosing a directory, return successful if it is a directory, where
+        // an empty filename chooses the current directory.
         if (ImGui::Button("OK")) {
             auto new_path = fs::path(m_filename);
             if (new_path.is_absolute()) {
@@ -66,7 +69,8 @@ private:
             }
             m_cdir = fs::absolute(m_cdir);
             m_filename = "";
-            if (!fs::exists(m_cdir) || !fs::is_directory(m_cdir)) {
+            bool is_dir = fs::exists(m_cdir) && fs::is_directory(m_cdir);
+            if (is_dir == m_choose_dir) {
                 m_ok = true;
                 end();
                 return;
@@ -138,7 +142,8 @@ private:
 public:
     file_dialog() :
         window("File Browser", 400, 300),
-        widget_im(*this, layout::fill())
+        widget_im(*this, layout::fill()),
+        m_choose_dir(false)
     {
         widget_im::show();
     }
@@ -166,6 +171,12 @@ public:
     {
         return show_open(path);
     }
+
+    bool show_dir(std::string &path)
+    {
+        m_choose_dir = true;
+        return show_open(path);
+    }
 };
 
 }
@@ -182,5 +193,11 @@ bool show_save_dialog(std::string &path)
     return file_dialog{}.show_save(path);
 }
 
+// declared in gui.hh
+bool show_dir_dialog(std::string &path)
+{
+    return file_dialog{}.show_dir(path);
+}
+
 }
 }
@@ -158,6 +158,18 @@ void window::show()
 #endif
 }
 
+// declared in gui.hh
+void window::hide()
+{
+#if USE_X11
+    XUnmapWindow(g_display, m_handle);
+#elif USE_WINAPI
+    ShowWindow(HWND(m_handle), SW_HIDE);
+#else
+#error Unimplemented UI frontend code.
+#endif
+}
+
 // declared in gui.hh
 void window::show_dialog()
 {
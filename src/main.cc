@@ -21,12 +21,21 @@
 #include "common.hh"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <deque>
+#include <chrono>
+#include <iomanip>
 #include "edit.hh"
 #include "gui.hh"
 #include "gl.hh"
 #include "nsf.hh"
 #include "misc.hh"
+#include "fs.hh"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 namespace drnsf {
 namespace {
@@ -54,6 +63,30 @@ Available subcommands:
   version             Display version and license information
   internal-test       Runs internal unit tests
   resave-test-crash2  Runs resave consistency tests against C2 NSF files
+                      [--jobs=N] [--timings] [--json] FILE...
+                      FILE may be `-' or a pipe, which is read one page at
+                      a time
+  verify-checksums    Checks the page checksums in the given NSF files
+  pack-pages          Redistributes entries so every page fits in 64K, using
+                      as few pages as possible, and optionally reorders them
+                      to keep entries which are loaded together in the same
+                      pages
+                      [--dry-run] [--locality] [--lookup=FILE]
+                      [--compress] [--verify-checksums]
+                      [--game=crash1|crash2|crash3] INPUT [OUTPUT]
+                      --lookup writes the EID lookup table of the packed
+                      pages, in the layout used by the NSD file
+                      --compress writes the pages compressed; only Crash 1
+                      reads compressed pages, so it is rejected for other
+                      games
+                      --verify-checksums rejects an INPUT with any page
+                      whose checksum is bad
+                      --game gives the game INPUT is from; by default it
+                      is Crash 1 if any page is compressed, else Crash 2
+  scan                Summarizes the pages and entries in the given NSF files
+                      by reading only their headers, without importing them
+                      [--entries] [--json] FILE...
+                      FILE may be `-' or a pipe, as for resave-test-crash2
 
 The default subcommand is `gui', which will be used if no subcommand was
 specified.
@@ -147,9 +180,92 @@ static int cmd_internal_test(argv_t argv)
 #endif
 }
 
+// (internal func) is_streamed
+// Returns true if the given input file must be read as a stream instead of
+// being mapped into memory. This is the case for "-", meaning the standard
+// input, and for anything other than a regular file, such as a pipe.
+static bool is_streamed(const std::string &filename)
+{
+    if (filename == "-")
+        return true;
+
+    auto path = fs::u8path(filename);
+    return fs::exists(path) && !fs::is_regular_file(path);
+}
+
+// (internal func) with_input_stream
+// Opens the given input file as a binary stream and passes it to `f'. The
+// filename "-" gives the standard input.
+static void with_input_stream(
+    const std::string &filename,
+    const std::function<void(std::istream &)> &f)
+{
+    if (filename == "-") {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        f(std::cin);
+        return;
+    }
+
+    auto file = util::fstream_open_bin(filename, std::fstream::in);
+    if (!file)
+        throw std::runtime_error("failed to open file");
+    f(file);
+}
+
 namespace resave_test {
 
-static bool do_entry(TRANSACT, std::string filename, nsf::raw_entry::ref src)
+using clock = std::chrono::steady_clock;
+
+// (internal struct) file_state
+// The results of testing one file, collected while the test runs so that files
+// may be tested concurrently and reported afterwards in order.
+struct file_state {
+    // (var) filename
+    // The name of the file being tested.
+    std::string filename;
+
+    // (var) err
+    // The mismatch and error messages for the file.
+    std::ostringstream err;
+
+    // (var) size
+    // The size of the file in bytes.
+    size_t size = 0;
+
+    // (var) ok
+    // False if any mismatch or error was found.
+    bool ok = true;
+
+    // (var) t_import, t_process, t_export, t_compare, t_total
+    // The time spent in each stage of the test, and in the test as a whole.
+    clock::duration t_import{};
+    clock::duration t_process{};
+    clock::duration t_export{};
+    clock::duration t_compare{};
+    clock::duration t_total{};
+};
+
+// (internal class) stage_timer
+// Adds the time from its construction to its destruction to the given total.
+class stage_timer : private util::nocopy {
+private:
+    clock::duration &m_total;
+    clock::time_point m_start;
+
+public:
+    explicit stage_timer(clock::duration &total) :
+        m_total(total),
+        m_start(clock::now()) {}
+
+    ~stage_timer()
+    {
+        m_total += clock::now() - m_start;
+    }
+};
+
+static bool do_entry(TRANSACT, file_state &fs, nsf::raw_entry::ref src)
 {
     bool ok = true;
 
@@ -157,15 +273,24 @@ static bool do_entry(TRANSACT, std::string filename, nsf::raw_entry::ref src)
     auto in_items = src->get_items();
 
     nsf::entry::ref entry = src;
-    src->process_by_type(TS, nsf::game_ver::crash2);
+    {
+        stage_timer t(fs.t_process);
+        src->process_by_type(TS, nsf::game_ver::crash2);
+    }
 
     uint32_t out_type;
-    auto out_items = entry->export_entry(out_type);
+    std::vector<util::slice> out_items;
+    {
+        stage_timer t(fs.t_export);
+        out_items = entry->export_entry(out_type);
+    }
+
+    stage_timer t(fs.t_compare);
 
     if (in_type != out_type) {
         ok = false;
-        std::cerr
-            << filename
+        fs.err
+            << fs.filename
             << ": \033[46;30m  entry  \033[0m "
             << "resave \033[31mtype\033[0m mismatch on `"
             << entry.full_path()
@@ -175,8 +300,8 @@ static bool do_entry(TRANSACT, std::string filename, nsf::raw_entry::ref src)
 
     if (in_items != out_items) {
         ok = false;
-        std::cerr
-            << filename
+        fs.err
+            << fs.filename
             << ": \033[46;30m  entry  \033[0m "
             << "resave item mismatch on `"
             << entry.full_path()
@@ -187,25 +312,38 @@ static bool do_entry(TRANSACT, std::string filename, nsf::raw_entry::ref src)
     return ok;
 }
 
-static bool do_pagelet(TRANSACT, std::string filename, misc::raw_data::ref src)
+static bool do_pagelet(TRANSACT, file_state &fs, misc::raw_data::ref src)
 {
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::slice in_data = src->get_data();
 
     nsf::raw_entry::ref raw_entry = src;
-    src->rename(TS, src / "_PROCESSING");
-    src /= "_PROCESSING";
-    raw_entry.create(TS, src->get_proj());
-    raw_entry->import_file(TS, src->get_data());
-    src->destroy(TS);
+    {
+        stage_timer t(fs.t_process);
+        src->rename(TS, src / "_PROCESSING");
+        src /= "_PROCESSING";
+        raw_entry.create(TS, src->get_proj());
+        raw_entry->import_file(TS, src->get_data());
+        src->destroy(TS);
+    }
 
-    util::blob out_data = raw_entry->export_file();
+    util::slice out_data;
+    {
+        stage_timer t(fs.t_export);
+        out_data = raw_entry->export_file();
+    }
+
+    bool match;
+    {
+        stage_timer t(fs.t_compare);
+        match = (in_data == out_data);
+    }
 
-    if (in_data != out_data) {
+    if (!match) {
         ok = false;
-        std::cerr
-            << filename
+        fs.err
+            << fs.filename
             << ": \033[45;30m pagelet \033[0m "
             << "resave data mismatch on `"
             << raw_entry.full_path()
@@ -213,35 +351,79 @@ static bool do_pagelet(TRANSACT, std::string filename, misc::raw_data::ref src)
             << std::endl;
     }
 
-    ok &= do_entry(TS, filename, raw_entry);
+    ok &= do_entry(TS, fs, raw_entry);
 
     return ok;
 }
 
-static bool do_page(TRANSACT, std::string filename, misc::raw_data::ref src)
+static bool do_page(TRANSACT, file_state &fs, misc::raw_data::ref src)
 {
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::slice in_data = src->get_data();
 
     if (src->get_data()[2] == 1) {
         // This is a texture page if the type is 1.
-        // TODO
+        nsf::tpage::ref tpage = src;
+        {
+            stage_timer t(fs.t_process);
+            src->rename(TS, src / "_PROCESSING");
+            src /= "_PROCESSING";
+            tpage.create(TS, src->get_proj());
+            tpage->import_file(TS, src->get_data());
+            src->destroy(TS);
+        }
+
+        util::slice out_data;
+        {
+            stage_timer t(fs.t_export);
+            out_data = tpage->export_file();
+        }
+
+        bool match;
+        {
+            stage_timer t(fs.t_compare);
+            match = (in_data == out_data);
+        }
+
+        if (!match) {
+            ok = false;
+            fs.err
+                << fs.filename
+                << ": \033[43;30m  tpage  \033[0m "
+                << "resave data mismatch on `"
+                << tpage.full_path()
+                << "'."
+                << std::endl;
+        }
     } else {
         // For all other types, this is a standard page.
         nsf::spage::ref spage = src;
-        src->rename(TS, src / "_PROCESSING");
-        src /= "_PROCESSING";
-        spage.create(TS, src->get_proj());
-        spage->import_file(TS, src->get_data());
-        src->destroy(TS);
+        {
+            stage_timer t(fs.t_process);
+            src->rename(TS, src / "_PROCESSING");
+            src /= "_PROCESSING";
+            spage.create(TS, src->get_proj());
+            spage->import_file(TS, src->get_data());
+            src->destroy(TS);
+        }
+
+        util::slice out_data;
+        {
+            stage_timer t(fs.t_export);
+            out_data = spage->export_file();
+        }
 
-        util::blob out_data = spage->export_file();
+        bool match;
+        {
+            stage_timer t(fs.t_compare);
+            match = (in_data == out_data);
+        }
 
-        if (in_data != out_data) {
+        if (!match) {
             ok = false;
-            std::cerr
-                << filename
+            fs.err
+                << fs.filename
                 << ": \033[43;30m  spage  \033[0m "
                 << "resave data mismatch on `"
                 << spage.full_path()
@@ -250,32 +432,45 @@ static bool do_page(TRANSACT, std::string filename, misc::raw_data::ref src)
         }
 
         for (misc::raw_data::ref pagelet : spage->get_pagelets()) {
-            ok &= do_pagelet(TS, filename, pagelet);
+            ok &= do_pagelet(TS, fs, pagelet);
         }
     }
 
     return ok;
 }
 
-static bool do_nsf(TRANSACT, std::string filename, misc::raw_data::ref src)
+static bool do_nsf(TRANSACT, file_state &fs, misc::raw_data::ref src)
 {
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::slice in_data = src->get_data();
 
     nsf::archive::ref archive = src;
-    src->rename(TS, src / "_PROCESSING");
-    src /= "_PROCESSING";
-    archive.create(TS, src->get_proj());
-    archive->import_file(TS, src->get_data());
-    src->destroy(TS);
+    {
+        stage_timer t(fs.t_import);
+        src->rename(TS, src / "_PROCESSING");
+        src /= "_PROCESSING";
+        archive.create(TS, src->get_proj());
+        archive->import_file(TS, src->get_data());
+        src->destroy(TS);
+    }
 
-    util::blob out_data = archive->export_file();
+    util::slice out_data;
+    {
+        stage_timer t(fs.t_export);
+        out_data = archive->export_file();
+    }
+
+    bool match;
+    {
+        stage_timer t(fs.t_compare);
+        match = (in_data == out_data);
+    }
 
-    if (in_data != out_data) {
+    if (!match) {
         ok = false;
-        std::cerr
-            << filename
+        fs.err
+            << fs.filename
             << ": \033[41;30m archive \033[0m "
             << "resave data mismatch on `"
             << archive.full_path()
@@ -284,41 +479,335 @@ static bool do_nsf(TRANSACT, std::string filename, misc::raw_data::ref src)
     }
 
     for (misc::raw_data::ref page : archive->get_pages()) {
-        ok &= do_page(TS, filename, page);
+        ok &= do_page(TS, fs, page);
     }
 
     return ok;
 }
 
+// (internal func) do_stream
+// Runs the resave test on a file which is read one page at a time, such as one
+// piped from another program. Each page is tested in a project of its own,
+// which is released before the next page is read, so that only a few pages
+// are held in memory at once. The archive as a whole is not resaved, but its
+// export is only the concatenation of its pages, which are each checked.
+static void do_stream(file_state &fs, std::istream &in)
+{
+    nsf::page_reader reader(in);
+    util::slice page_data;
+    for (;;) {
+        {
+            stage_timer t(fs.t_import);
+            if (!reader.next(page_data))
+                break;
+        }
+        fs.size += page_data.size();
+
+        res::project proj;
+        proj.get_transact().run([&](TRANSACT) {
+            misc::raw_data::ref page = proj.get_asset_root()
+                / "nsfile"
+                / "page-$"_fmt(reader.get_index());
+            page.create(TS, proj);
+            page->set_data(TS, std::move(page_data));
+            fs.ok &= do_page(TS, fs, page);
+        });
+    }
+}
+
+// (internal func) do_file
+// Runs the resave test on one file in a project of its own. This does not
+// share any state with tests of other files, so files may be tested on
+// several threads at once.
+static void do_file(file_state &fs)
+{
+    stage_timer t_total(fs.t_total);
+
+    try {
+        if (is_streamed(fs.filename)) {
+            with_input_stream(fs.filename, [&](std::istream &in) {
+                do_stream(fs, in);
+            });
+            return;
+        }
+
+        util::slice nsf_data;
+        {
+            stage_timer t(fs.t_import);
+            nsf_data = util::slice(
+                std::make_shared<util::mapped_file>(fs.filename)
+            );
+        }
+        fs.size = nsf_data.size();
+
+        res::project proj;
+        proj.get_transact().run([&](TRANSACT) {
+            misc::raw_data::ref nsfile = proj.get_asset_root() / "nsfile";
+            nsfile.create(TS, proj);
+            nsfile->set_data(TS, nsf_data);
+            fs.ok &= do_nsf(TS, fs, nsfile);
+        });
+    } catch (std::exception &ex) {
+        fs.err
+            << fs.filename
+            << ": "
+            << ex.what()
+            << std::endl;
+        fs.ok = false;
+    }
+}
+
+// (internal func) to_ms
+// Converts a duration to milliseconds.
+static double to_ms(clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// (internal func) to_mb_per_s
+// Returns the rate of processing the given number of bytes in the given time,
+// in megabytes (2^20 bytes) per second.
+static double to_mb_per_s(size_t size, clock::duration d)
+{
+    double seconds = std::chrono::duration<double>(d).count();
+    if (seconds <= 0)
+        return 0;
+
+    return size / 1048576.0 / seconds;
+}
+
+// (internal func) json_string
+// Quotes and escapes a string for JSON output.
+static std::string json_string(const std::string &s)
+{
+    std::string result = "\"";
+    for (char c : s) {
+        switch (c) {
+        case '"':
+            result += "\\\"";
+            break;
+        case '\\':
+            result += "\\\\";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                result += "\\u00";
+                result += "0123456789abcdef"[(c >> 4) & 0xF];
+                result += "0123456789abcdef"[c & 0xF];
+            } else {
+                result += c;
+            }
+            break;
+        }
+    }
+    result += "\"";
+    return result;
+}
+
+// (internal func) print_timings
+// Writes one line of timings in human-readable form.
+static void print_timings(
+    std::ostream &out,
+    const std::string &label,
+    const file_state &fs)
+{
+    out
+        << label
+        << ": import "
+        << to_ms(fs.t_import)
+        << " ms, process "
+        << to_ms(fs.t_process)
+        << " ms, export "
+        << to_ms(fs.t_export)
+        << " ms, compare "
+        << to_ms(fs.t_compare)
+        << " ms, total "
+        << to_ms(fs.t_total)
+        << " ms ("
+        << to_mb_per_s(fs.size, fs.t_total)
+        << " MB/s)"
+        << std::endl;
+}
+
+// (internal func) print_json
+// Writes the timings of one file, or of the whole run, as a JSON object.
+static void print_json(std::ostream &out, const file_state &fs)
+{
+    out
+        << "{\"file\": "
+        << json_string(fs.filename)
+        << ", \"ok\": "
+        << (fs.ok ? "true" : "false")
+        << ", \"bytes\": "
+        << fs.size
+        << ", \"import_ms\": "
+        << to_ms(fs.t_import)
+        << ", \"process_ms\": "
+        << to_ms(fs.t_process)
+        << ", \"export_ms\": "
+        << to_ms(fs.t_export)
+        << ", \"compare_ms\": "
+        << to_ms(fs.t_compare)
+        << ", \"total_ms\": "
+        << to_ms(fs.t_total)
+        << ", \"mb_per_s\": "
+        << to_mb_per_s(fs.size, fs.t_total)
+        << "}";
+}
+
 }
 
 static int cmd_resave_test_crash2(argv_t argv)
+{
+    using namespace resave_test;
+
+    bool ok = true;
+    int jobs = 0;
+    bool show_timings = false;
+    bool json = false;
+
+    // Parse the options, which come before the filenames.
+    while (!argv.empty() && argv[0].size() >= 2 && argv[0][0] == '-') {
+        auto opt = argv[0];
+        argv.pop_front();
+
+        if (opt == "--") {
+            break;
+        } else if (opt == "--timings") {
+            show_timings = true;
+        } else if (opt == "--json") {
+            json = true;
+        } else if (opt.compare(0, 7, "--jobs=") == 0) {
+            try {
+                jobs = std::stoi(opt.substr(7));
+            } catch (std::logic_error &) {
+                jobs = -1;
+            }
+            if (jobs < 1) {
+                std::cerr
+                    << "drnsf: Bad job count: `"
+                    << opt
+                    << "'."
+                    << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else {
+            std::cerr
+                << "drnsf: Unrecognized option: `"
+                << opt
+                << "'."
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Test each file in its own project on the thread pool, then report the
+    // results in the order the files were given.
+    std::vector<file_state> files(argv.size());
+    auto start_time = clock::now();
+    {
+        util::thread_pool pool(jobs);
+        std::vector<std::future<void>> futures(files.size());
+        for (auto &&i : util::range_of(files)) {
+            files[i].filename = argv[i];
+            futures[i] = pool.post([&fs = files[i]]{
+                do_file(fs);
+            });
+        }
+
+        for (auto &&i : util::range_of(files)) {
+            futures[i].get();
+
+            auto &&fs = files[i];
+            std::cerr << fs.err.str() << std::flush;
+            ok &= fs.ok;
+
+            if (show_timings && !json) {
+                print_timings(std::cout, fs.filename, fs);
+            }
+        }
+    }
+
+    // Sum up the timings. The stage times are the total CPU time spent in
+    // each stage across all files, while the total time is the wall time of
+    // the whole run, so that the throughput includes the gain from testing
+    // files concurrently.
+    file_state total;
+    total.filename = "(total)";
+    for (auto &&fs : files) {
+        total.ok &= fs.ok;
+        total.size += fs.size;
+        total.t_import += fs.t_import;
+        total.t_process += fs.t_process;
+        total.t_export += fs.t_export;
+        total.t_compare += fs.t_compare;
+    }
+    total.t_total = clock::now() - start_time;
+
+    if (json) {
+        std::cout << "{\"files\": [";
+        for (auto &&i : util::range_of(files)) {
+            std::cout << (i ? ",\n    " : "\n    ");
+            print_json(std::cout, files[i]);
+        }
+        std::cout << "\n], \"total\": ";
+        print_json(std::cout, total);
+        std::cout << "}" << std::endl;
+    } else if (show_timings) {
+        print_timings(std::cout, total.filename, total);
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int cmd_verify_checksums(argv_t argv)
 {
     bool ok = true;
 
+    // The pages of every file are checked in parallel.
+    util::thread_pool pool;
+
     for (auto &arg : argv) {
         try {
-            auto nsf_file = util::fstream_open_bin(arg, std::fstream::in);
-            nsf_file.exceptions(std::fstream::failbit | std::fstream::eofbit);
+            util::slice nsf_data(std::make_shared<util::mapped_file>(arg));
+            auto pages = nsf::archive::split_pages(nsf_data);
 
-            nsf_file.seekg(0, std::fstream::end);
-            auto nsf_size = nsf_file.tellg();
-            nsf_file.seekg(0, std::fstream::beg);
+            int page_count = pages.size();
 
-            util::blob nsf_data(nsf_size);
-            nsf_file.read(
-                reinterpret_cast<char *>(nsf_data.data()),
-                nsf_size
-            );
-            nsf_file.close();
+            std::vector<std::future<bool>> results(page_count);
+            for (auto &&i : util::range_of(results)) {
+                auto page_data = pages[i];
+                results[i] = pool.post([page_data]{
+                    return nsf::verify_page_checksum(page_data);
+                });
+            }
 
-            res::project proj;
-            proj.get_transact().run([&](TRANSACT) {
-                misc::raw_data::ref nsfile = proj.get_asset_root() / "nsfile";
-                nsfile.create(TS, proj);
-                nsfile->set_data(TS, nsf_data);
-                ok &= resave_test::do_nsf(TS, arg, nsfile);
-            });
+            int bad_count = 0;
+            for (auto &&i : util::range_of(results)) {
+                if (results[i].get())
+                    continue;
+
+                bad_count++;
+                std::cerr
+                    << arg
+                    << ": page "
+                    << i
+                    << ": bad checksum"
+                    << std::endl;
+            }
+
+            if (bad_count > 0) {
+                ok = false;
+            }
+
+            std::cout
+                << arg
+                << ": "
+                << page_count
+                << " pages, "
+                << bad_count
+                << " bad"
+                << std::endl;
         } catch (std::exception &ex) {
             std::cerr
                 << arg
@@ -332,12 +821,520 @@ static int cmd_resave_test_crash2(argv_t argv)
     return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+namespace scan {
+
+// (internal struct) entry_info
+// The header of one entry, or of one texture page, as found by the scan.
+struct entry_info {
+    // (var) page, pagelet
+    // The index of the page holding the entry, and of the entry in the page.
+    // The pagelet index is -1 for texture pages.
+    int page;
+    int pagelet;
+
+    // (var) eid, type
+    // The entry's EID and type. Texture pages have the type 5.
+    uint32_t eid;
+    uint32_t type;
+
+    // (var) size
+    // The size of the entry in bytes.
+    size_t size;
+
+    // (var) item_sizes
+    // The size of each of the entry's items in bytes. Empty for texture pages.
+    std::vector<size_t> item_sizes;
+};
+
+// (internal struct) file_state
+// The results of scanning one file, collected while the scan runs so that files
+// may be scanned concurrently and reported afterwards in order.
+struct file_state {
+    // (var) filename
+    // The name of the file being scanned.
+    std::string filename;
+
+    // (var) err
+    // The error messages for the file.
+    std::ostringstream err;
+
+    // (var) ok
+    // False if the file or any of its pages could not be scanned.
+    bool ok = true;
+
+    // (var) spage_count, tpage_count
+    // The number of standard and texture pages in the file.
+    int spage_count = 0;
+    int tpage_count = 0;
+
+    // (var) entries
+    // The headers of the entries in the file, in file order.
+    std::vector<entry_info> entries;
+};
+
+// (internal struct) type_info
+// The totals for one entry type across a file.
+struct type_info {
+    int count = 0;
+    size_t items = 0;
+    size_t size = 0;
+};
+
+// (internal func) do_page
+// Scans the headers of one page and of the entries in it. A page which fails
+// to parse is reported and skipped.
+static void do_page(file_state &fs, int i, const util::slice &page_data)
+{
+    try {
+        // Pages with type 1 are texture pages, with their EID where a
+        // standard page has its CID.
+        if (page_data[2] == 1) {
+            fs.tpage_count++;
+            uint32_t eid = page_data[4] | page_data[5] << 8 |
+                page_data[6] << 16 | uint32_t(page_data[7]) << 24;
+            fs.entries.push_back({ i, -1, eid, 5, nsf::page_size, {} });
+            return;
+        }
+
+        auto page = nsf::spage::parse(page_data);
+        fs.spage_count++;
+        for (auto &&j : util::range_of(page.pagelets)) {
+            auto entry = nsf::raw_entry::parse(page.pagelets[j]);
+            entry_info info{
+                i,
+                int(j),
+                entry.eid,
+                entry.type,
+                page.pagelets[j].size(),
+                {}
+            };
+            info.item_sizes.reserve(entry.items.size());
+            for (auto &&item : entry.items) {
+                info.item_sizes.push_back(item.size());
+            }
+            fs.entries.push_back(std::move(info));
+        }
+    } catch (std::exception &ex) {
+        fs.err
+            << fs.filename
+            << ": page "
+            << i
+            << ": "
+            << ex.what()
+            << std::endl;
+        fs.ok = false;
+    }
+}
+
+// (internal func) do_file
+// Scans the headers of the pages and entries in the given file. Only the
+// headers are read, and the file is mapped so that the rest of the data is
+// never loaded from disk. Files which cannot be mapped, such as the standard
+// input or a pipe, are read one page at a time instead.
+static void do_file(file_state &fs)
+{
+    try {
+        if (is_streamed(fs.filename)) {
+            with_input_stream(fs.filename, [&](std::istream &in) {
+                nsf::page_reader reader(in);
+                util::slice page_data;
+                while (reader.next(page_data)) {
+                    do_page(fs, reader.get_index(), page_data);
+                }
+            });
+            return;
+        }
+
+        util::slice nsf_data(std::make_shared<util::mapped_file>(fs.filename));
+        auto pages = nsf::archive::split_pages(nsf_data);
+        for (auto &&i : util::range_of(pages)) {
+            do_page(fs, i, pages[i]);
+        }
+    } catch (std::exception &ex) {
+        fs.err
+            << fs.filename
+            << ": "
+            << ex.what()
+            << std::endl;
+        fs.ok = false;
+    }
+}
+
+// (internal func) sum_types
+// Totals the entries of a file by type.
+static std::map<uint32_t, type_info> sum_types(const file_state &fs)
+{
+    std::map<uint32_t, type_info> types;
+    for (auto &&entry : fs.entries) {
+        auto &&info = types[entry.type];
+        info.count++;
+        info.items += entry.item_sizes.size();
+        info.size += entry.size;
+    }
+    return types;
+}
+
+// (internal func) print_table
+// Writes the summary of one file as a table, listing each entry if asked.
+static void print_table(std::ostream &out, const file_state &fs, bool entries)
+{
+    out
+        << fs.filename
+        << ": "
+        << (fs.spage_count + fs.tpage_count)
+        << " pages ("
+        << fs.spage_count
+        << " standard, "
+        << fs.tpage_count
+        << " texture), "
+        << fs.entries.size()
+        << " entries\n";
+
+    out << "    type  entries     items       bytes\n";
+    for (auto &&type : sum_types(fs)) {
+        out
+            << std::setw(8) << type.first
+            << std::setw(9) << type.second.count
+            << std::setw(10) << type.second.items
+            << std::setw(12) << type.second.size
+            << "\n";
+    }
+
+    if (entries) {
+        out << "    page  pagelet  eid    type  size   item sizes\n";
+        for (auto &&entry : fs.entries) {
+            out
+                << std::setw(8) << entry.page
+                << std::setw(9) << entry.pagelet
+                << "  "
+                << to_string(nsf::eid(entry.eid))
+                << std::setw(6) << entry.type
+                << std::setw(7) << entry.size
+                << "  ";
+            for (auto &&item_size : entry.item_sizes) {
+                out << " " << item_size;
+            }
+            out << "\n";
+        }
+    }
+
+    out << std::flush;
+}
+
+// (internal func) print_json
+// Writes the summary of one file as a JSON object, listing each entry if asked.
+static void print_json(std::ostream &out, const file_state &fs, bool entries)
+{
+    out
+        << "{\"file\": "
+        << resave_test::json_string(fs.filename)
+        << ", \"ok\": "
+        << (fs.ok ? "true" : "false")
+        << ", \"spages\": "
+        << fs.spage_count
+        << ", \"tpages\": "
+        << fs.tpage_count
+        << ", \"types\": [";
+
+    bool first = true;
+    for (auto &&type : sum_types(fs)) {
+        out
+            << (first ? "" : ", ")
+            << "{\"type\": "
+            << type.first
+            << ", \"entries\": "
+            << type.second.count
+            << ", \"items\": "
+            << type.second.items
+            << ", \"bytes\": "
+            << type.second.size
+            << "}";
+        first = false;
+    }
+    out << "]";
+
+    if (entries) {
+        out << ", \"entries\": [";
+        for (auto &&i : util::range_of(fs.entries)) {
+            auto &&entry = fs.entries[i];
+            out
+                << (i ? ",\n        " : "\n        ")
+                << "{\"page\": "
+                << entry.page
+                << ", \"pagelet\": "
+                << entry.pagelet
+                << ", \"eid\": \""
+                << to_string(nsf::eid(entry.eid))
+                << "\", \"type\": "
+                << entry.type
+                << ", \"bytes\": "
+                << entry.size
+                << ", \"items\": [";
+            for (auto &&j : util::range_of(entry.item_sizes)) {
+                out << (j ? ", " : "") << entry.item_sizes[j];
+            }
+            out << "]}";
+        }
+        out << "]";
+    }
+
+    out << "}";
+}
+
+}
+
+static int cmd_scan(argv_t argv)
+{
+    using namespace scan;
+
+    bool ok = true;
+    bool entries = false;
+    bool json = false;
+
+    // Parse the options, which come before the filenames.
+    while (!argv.empty() && argv[0].size() >= 2 && argv[0][0] == '-') {
+        auto opt = argv[0];
+        argv.pop_front();
+
+        if (opt == "--") {
+            break;
+        } else if (opt == "--entries") {
+            entries = true;
+        } else if (opt == "--json") {
+            json = true;
+        } else {
+            std::cerr
+                << "drnsf: Unrecognized option: `"
+                << opt
+                << "'."
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Scan each file on the thread pool, then report the results in the order
+    // the files were given.
+    std::vector<file_state> files(argv.size());
+    util::thread_pool pool;
+    std::vector<std::future<void>> futures(files.size());
+    for (auto &&i : util::range_of(files)) {
+        files[i].filename = argv[i];
+        futures[i] = pool.post([&fs = files[i]]{
+            do_file(fs);
+        });
+    }
+
+    if (json) {
+        std::cout << "{\"files\": [";
+    }
+    for (auto &&i : util::range_of(files)) {
+        futures[i].get();
+
+        auto &&fs = files[i];
+        std::cerr << fs.err.str() << std::flush;
+        ok &= fs.ok;
+
+        if (json) {
+            std::cout << (i ? ",\n    " : "\n    ");
+            print_json(std::cout, fs, entries);
+        } else if (fs.ok || fs.spage_count + fs.tpage_count > 0) {
+            print_table(std::cout, fs, entries);
+        }
+
+        // Release the entry list of a file once it has been reported.
+        fs.entries = {};
+    }
+    if (json) {
+        std::cout << "\n]}" << std::endl;
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int cmd_pack_pages(argv_t argv)
+{
+    bool dry_run = false;
+    bool locality = false;
+    bool compress = false;
+    bool verify_checksums = false;
+    bool ver_given = false;
+    nsf::game_ver ver = nsf::game_ver::crash2;
+    std::string lookup_filename;
+
+    // Parse the options, which come before the filenames.
+    while (!argv.empty() && argv[0].size() >= 2 && argv[0][0] == '-') {
+        auto opt = argv[0];
+        argv.pop_front();
+
+        if (opt == "--") {
+            break;
+        } else if (opt == "--dry-run") {
+            dry_run = true;
+        } else if (opt == "--locality") {
+            locality = true;
+        } else if (opt == "--compress") {
+            compress = true;
+        } else if (opt == "--verify-checksums") {
+            verify_checksums = true;
+        } else if (opt.compare(0, 7, "--game=") == 0) {
+            auto game = opt.substr(7);
+            if (game == "crash1") {
+                ver = nsf::game_ver::crash1;
+            } else if (game == "crash2") {
+                ver = nsf::game_ver::crash2;
+            } else if (game == "crash3") {
+                ver = nsf::game_ver::crash3;
+            } else {
+                std::cerr
+                    << "drnsf: Unrecognized game: `"
+                    << opt
+                    << "'."
+                    << std::endl;
+                return EXIT_FAILURE;
+            }
+            ver_given = true;
+        } else if (opt.compare(0, 9, "--lookup=") == 0) {
+            lookup_filename = opt.substr(9);
+        } else {
+            std::cerr
+                << "drnsf: Unrecognized option: `"
+                << opt
+                << "'."
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argv.size() != (dry_run ? 1 : 2)) {
+        std::cerr
+            << "drnsf: pack-pages: expected "
+            << (dry_run ? "an input file" : "an input and output file")
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        util::slice nsf_data(std::make_shared<util::mapped_file>(argv[0]));
+        if (!ver_given) {
+            ver = nsf::detect_game_ver(nsf_data);
+        }
+
+        // Only Crash 1 can read compressed pages.
+        if (compress && ver != nsf::game_ver::crash1) {
+            std::cerr
+                << "drnsf: pack-pages: --compress is only supported for "
+                << "Crash 1 files"
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        res::project proj;
+        nsf::archive::ref nsf_asset = proj.get_asset_root() / "nsfile";
+        proj.get_transact().run([&](TRANSACT) {
+            nsf_asset.create(TS, proj);
+            nsf_asset->import_and_process(
+                TS,
+                nsf_data,
+                ver,
+                verify_checksums
+            );
+        });
+
+        int pages_before = nsf_asset->get_pages().size();
+        int loads_before = nsf_asset->estimate_page_loads();
+        int moved = 0;
+
+        // Pack the pages to fit, then reorder them for locality if asked.
+        // The plans are applied to the imported project even for a dry run,
+        // so that the locality plan starts from the packed pages.
+        auto plan = nsf_asset->plan_packing();
+        moved += plan.pagelets_moved;
+        proj.get_transact().run([&](TRANSACT) {
+            nsf_asset->apply_packing(TS, plan);
+        });
+        if (locality) {
+            plan = nsf_asset->plan_locality();
+            moved += plan.pagelets_moved;
+            proj.get_transact().run([&](TRANSACT) {
+                nsf_asset->apply_packing(TS, plan);
+            });
+        }
+
+        std::cout
+            << argv[0]
+            << ": "
+            << pages_before
+            << " pages -> "
+            << nsf_asset->get_pages().size()
+            << " pages, "
+            << moved
+            << " entries moved, est. page loads "
+            << loads_before
+            << " -> "
+            << nsf_asset->estimate_page_loads()
+            << std::endl;
+
+        if (dry_run)
+            return EXIT_SUCCESS;
+
+        // The output may be the input file, which is still mapped and which
+        // the unchanged pages are exported from, so it is only replaced once
+        // the new file has been written in full.
+        util::thread_pool pool;
+        util::replace_file(argv[1], [&](std::ostream &nsf_file) {
+            if (compress) {
+                // Pages which do not get smaller are written uncompressed.
+                nsf_asset->export_to([&](const util::byte *data, size_t size) {
+                    auto compressed = nsf::compress_page(data);
+                    if (compressed.size() < size) {
+                        nsf_file.write(
+                            reinterpret_cast<const char *>(compressed.data()),
+                            compressed.size()
+                        );
+                    } else {
+                        nsf_file.write(
+                            reinterpret_cast<const char *>(data),
+                            size
+                        );
+                    }
+                }, pool);
+            } else {
+                nsf_asset->export_to(nsf_file, pool);
+            }
+        });
+
+        // Write the lookup table for the packed pages, for the level's NSD
+        // file, if asked.
+        if (!lookup_filename.empty()) {
+            auto table = nsf_asset->build_lookup_table().export_file();
+            util::replace_file(lookup_filename, [&](std::ostream &out) {
+                out.write(
+                    reinterpret_cast<const char *>(table.data()),
+                    table.size()
+                );
+            });
+        }
+    } catch (std::exception &ex) {
+        std::cerr
+            << argv[0]
+            << ": "
+            << ex.what()
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
 const static std::map<std::string, int (*)(argv_t)> s_cmds = {
     { "help", cmd_help },
     { "version", cmd_version },
     { "gui", cmd_gui },
     { "internal-test", cmd_internal_test },
-    { "resave-test-crash2", cmd_resave_test_crash2 }
+    { "resave-test-crash2", cmd_resave_test_crash2 },
+    { "verify-checksums", cmd_verify_checksums },
+    { "pack-pages", cmd_pack_pages },
+    { "scan", cmd_scan }
 };
 
 int main(argv_t argv)
@@ -65,8 +65,10 @@ public:
     using ref = res::ref<raw_data>;
 
     // (prop) data
-    // FIXME explain
-    DEFINE_APROP(data, util::blob);
+    // The bytes held by this asset. This is a slice, so it may point into a
+    // larger buffer (such as a memory-mapped NSF file) rather than holding its
+    // own copy of the data.
+    DEFINE_APROP(data, util::slice);
 
     // FIXME obsolete
     template <typename Reflector>
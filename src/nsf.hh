@@ -27,6 +27,13 @@
  */
 
 #include <vector>
+#include <map>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <tuple>
+#include <memory>
+#include <istream>
 #include "res.hh"
 #include "gfx.hh"
 
@@ -92,6 +99,17 @@ public:
 
         return std::string(result, 5);
     }
+
+    // (ext-func) encode, decode
+    // Writes and reads an EID in a project file. See `res::file_encoder'.
+    friend void encode(res::file_encoder &enc, eid value)
+    {
+        enc.put_uint(value, 4);
+    }
+    friend void decode(res::file_decoder &dec, eid &value)
+    {
+        value = dec.get_uint(4);
+    }
 };
 
 /*
@@ -101,6 +119,238 @@ public:
  */
 constexpr size_t page_size = 65536;
 
+/*
+ * nsf::default_export_cache_limit
+ *
+ * The most exported page data each archive keeps cached by default, as 64
+ * full pages. See `archive::set_export_cache_limit'.
+ */
+constexpr size_t default_export_cache_limit = 64 * page_size;
+
+/*
+ * nsf::calculate_page_checksum
+ *
+ * Calculates the checksum of a 64K page, as stored in bytes 12 to 15 of the
+ * page header. Those four bytes are themselves excluded from the checksum.
+ */
+uint32_t calculate_page_checksum(const util::byte *data);
+
+/*
+ * nsf::verify_page_checksum
+ *
+ * Returns true if the given page is 64K and the checksum stored in its header
+ * matches the calculated checksum.
+ */
+bool verify_page_checksum(const util::slice &data);
+
+/*
+ * nsf::is_compressed_page
+ *
+ * Returns true if the given data begins with a compressed page, as found in
+ * Crash 1 NSF files. These begin with the magic number 0x1235 instead of the
+ * 0x1234 of a standard page.
+ */
+bool is_compressed_page(const util::slice &data);
+
+/*
+ * nsf::detect_game_ver
+ *
+ * Guesses which game the given NSF data is from. Only Crash 1 compresses its
+ * pages, so data with any compressed page is taken to be from Crash 1, and
+ * anything else from Crash 2. The pages are not decompressed or parsed, so
+ * this is cheap, but an uncompressed Crash 1 or any Crash 3 file is not
+ * recognized; callers which know better should say which game it is.
+ */
+game_ver detect_game_ver(const util::slice &data);
+
+/*
+ * nsf::decompress_page
+ *
+ * Decompresses the compressed page at the start of the given data, which may
+ * be followed by more pages, and returns the 64K page. `out_size' is set to
+ * the number of bytes of `data' which the compressed page occupies.
+ *
+ * A compressed page has a 12-byte header holding the magic number, the number
+ * of bytes `length' produced by the compressed stream which follows it, and a
+ * number of bytes `skip' to skip after the stream. The rest of the page, from
+ * `length' to 64K, follows uncompressed.
+ *
+ * Each step of the stream begins with a prefix byte. If its top bit is clear,
+ * the prefix is a count of literal bytes which follow it. Otherwise, it and
+ * the next byte hold a 12-bit distance back into the output and a 3-bit span;
+ * spans 0 to 6 copy 3 to 9 bytes, and 7 copies 64 bytes.
+ *
+ * Throws `res::import_error' if the page is not compressed or is malformed.
+ */
+util::blob decompress_page(const util::slice &data, size_t &out_size);
+
+/*
+ * nsf::compress_page
+ *
+ * Compresses the given 64K page into the format read by `decompress_page'.
+ * The part of the page after the last repeated sequence found is stored
+ * uncompressed, and no bytes are skipped. The result may be larger than the
+ * page if it does not compress, in which case it should not be used.
+ */
+util::blob compress_page(const util::byte *data);
+
+/*
+ * nsf::page_reader
+ *
+ * Reads the pages of an NSF file from a stream one at a time, for files which
+ * cannot be mapped into memory, such as those piped from another program.
+ * Each page is read into its own buffer, so the memory used is bounded by the
+ * pages which the caller keeps rather than by the size of the file.
+ *
+ * Compressed pages are decompressed as they are read. As their size is not
+ * known until then, up to two pages are read ahead for them, and a compressed
+ * page which is larger than that is rejected.
+ */
+class page_reader : private util::nocopy {
+private:
+    std::istream &m_in;
+    int m_index;
+
+    // (var) m_pending
+    // The bytes read ahead of the end of the last page.
+    util::blob m_pending;
+
+    // (func) read_up_to
+    // Reads from the stream until `data' holds `size' bytes or the stream
+    // ends.
+    void read_up_to(util::blob &data, size_t size);
+
+public:
+    // (explicit ctor)
+    // Constructs a reader for the given stream, which should be in binary
+    // mode. The stream must outlive the reader.
+    explicit page_reader(std::istream &in) :
+        m_in(in),
+        m_index(-1) {}
+
+    // (func) next
+    // Reads the next page into `out' and returns true, or returns false if
+    // the stream has ended. Throws `res::import_error' if the stream ends
+    // partway through a page or cannot be read.
+    bool next(util::slice &out);
+
+    // (func) get_index
+    // Returns the index of the page most recently read, or -1 if no page has
+    // been read yet.
+    int get_index() const
+    {
+        return m_index;
+    }
+};
+
+/*
+ * nsf::lookup_table
+ *
+ * The table which the game uses to find the page holding an entry, as stored
+ * in a level's NSD file. Each entry is linked to the CID of its page, and the
+ * links are grouped into 256 buckets by a hash of their EID so that finding
+ * an entry only searches the links in its bucket.
+ */
+class lookup_table {
+public:
+    // (inner struct) link
+    // An entry's EID and the CID of the page which holds it.
+    struct link {
+        uint32_t cid;
+        nsf::eid eid;
+    };
+
+    // (s-const) bucket_count
+    // The number of buckets in the table.
+    static constexpr int bucket_count = 256;
+
+    // (s-func) get_bucket
+    // Returns the bucket which the game looks in for the given EID.
+    static int get_bucket(eid id)
+    {
+        return (uint32_t(id) >> 15) & 0xFF;
+    }
+
+private:
+    // (var) m_bucket_starts
+    // The index in `m_links' of the first link in each bucket. The links in
+    // a bucket run up to the start of the next one, or to the end.
+    uint32_t m_bucket_starts[bucket_count];
+
+    // (var) m_links
+    // The links, sorted by bucket. Links within a bucket are in the order
+    // they were given.
+    std::vector<link> m_links;
+
+public:
+    // (explicit ctor)
+    // Builds the table from the given links, in time linear in their number.
+    explicit lookup_table(const std::vector<link> &links);
+
+    // (func) find
+    // Returns the link for the given EID, or null if there is none. Only the
+    // EID's bucket is searched.
+    const link *find(eid id) const;
+
+    // (func) get_links
+    // Returns the links in table order.
+    const std::vector<link> &get_links() const
+    {
+        return m_links;
+    }
+
+    // (func) get_bucket_start
+    // Returns the index of the first link in the given bucket.
+    uint32_t get_bucket_start(int bucket) const
+    {
+        return m_bucket_starts[bucket];
+    }
+
+    // (func) export_file
+    // Returns the table in the layout used by the NSD file: the index of the
+    // first link of each bucket, followed by the links as CID/EID pairs. All
+    // values are 32-bit little-endian.
+    util::blob export_file() const;
+};
+
+// Forward declaration for use in nsf::archive.
+class entry;
+
+/*
+ * nsf::page_export_error
+ *
+ * The error thrown when exporting an archive in parallel fails. Every page
+ * which could not be exported is listed along with the reason, rather than
+ * only the first.
+ */
+class page_export_error : public res::export_error {
+public:
+    // (inner struct) page_error
+    // The index of a page which failed to export, and the message from the
+    // export error it threw.
+    struct page_error {
+        int page_index;
+        std::string message;
+    };
+
+private:
+    // (var) m_errors
+    // The failed pages, in page order.
+    std::vector<page_error> m_errors;
+
+public:
+    // (explicit ctor)
+    // Constructs the error from the list of failed pages.
+    explicit page_export_error(std::vector<page_error> errors);
+
+    // (func) get_errors
+    // Returns the failed pages, in page order.
+    const std::vector<page_error> &get_errors() const
+    {
+        return m_errors;
+    }
+};
+
 /*
  * nsf::archive
  *
@@ -110,10 +360,112 @@ class archive : public res::asset {
     friend class res::asset;
 
 private:
+    // (inner struct) cached_page
+    // The exported data of a standard page, the assets which were read to
+    // produce it, and its position in `m_page_lru'.
+    struct cached_page {
+        util::slice data;
+        std::vector<const res::asset *> deps;
+        std::list<const res::asset *>::iterator lru_pos;
+    };
+
+    // (var) m_page_cache
+    // The exported data of standard pages which have been exported and have
+    // not since been affected by any change, keyed by the page asset.
+    // Exporting the archive copies these pages verbatim instead of encoding
+    // them again.
+    mutable std::map<const res::asset *, cached_page> m_page_cache;
+
+    // (var) m_page_lru
+    // The pages in `m_page_cache', most recently used first.
+    mutable std::list<const res::asset *> m_page_lru;
+
+    // (var) m_page_cache_bytes
+    // The total size of the page data in `m_page_cache'.
+    mutable size_t m_page_cache_bytes = 0;
+
+    // (var) m_page_cache_limit
+    // The most page data `m_page_cache' may hold. See `set_export_cache_limit'.
+    size_t m_page_cache_limit = default_export_cache_limit;
+
+    // (var) m_page_dependents
+    // For each asset which some cached page depends on, the pages in
+    // `m_page_cache' which depend on it.
+    mutable std::map<const res::asset *, std::set<const res::asset *>>
+        m_page_dependents;
+
+    // (var) m_eid_index
+    // The entries named under this archive, keyed by their EID. More than
+    // one entry may briefly share an EID, such as while a raw entry is being
+    // processed into its final type.
+    std::unordered_multimap<uint32_t, entry *> m_eid_index;
+
+    // (var) m_indexed_eids
+    // The EID each entry in `m_eid_index' is currently indexed under, used to
+    // find its old index entry when the entry's EID changes or it disappears.
+    std::unordered_map<const entry *, uint32_t> m_indexed_eids;
+
+    // (var) m_page_indices
+    // The index in `p_pages' of each page, keyed by the page's name.
+    std::map<res::atom, int> m_page_indices;
+
+    // (var) m_revision
+    // Counts the changes to or removals of assets in the project, so that a
+    // snapshot can tell whether the project has changed since it was taken.
+    unsigned long m_revision = 0;
+
+    // (handler) h_asset_appear, h_asset_change, h_asset_disappear
+    // Invalidates any cached pages which depend on an asset when it changes,
+    // is destroyed, or is renamed, and keeps the EID and page indices up to
+    // date as entries appear, disappear, or change EID.
+    decltype(res::project::on_asset_appear)::watch h_asset_appear;
+    decltype(res::project::on_asset_change)::watch h_asset_change;
+    decltype(res::project::on_asset_disappear)::watch h_asset_disappear;
+
     // (explicit ctor)
     // FIXME explain
-    explicit archive(res::project &proj) :
-        asset(proj) {}
+    explicit archive(res::project &proj);
+
+    // (func) cache_page
+    // Stores the exported data of a page in `m_page_cache', then discards the
+    // least recently used pages until the cache is within its limit.
+    void cache_page(
+        const res::asset *page,
+        util::slice data,
+        std::vector<const res::asset *> deps) const;
+
+    // (func) find_cached_page
+    // Returns the cached data of a page, or an empty slice if it is not in
+    // `m_page_cache'. A page which is found becomes the most recently used.
+    util::slice find_cached_page(const res::asset *page) const;
+
+    // (func) uncache_page
+    // Removes a page from `m_page_cache' and from the dependents of every
+    // asset it depends on.
+    void uncache_page(
+        std::map<const res::asset *, cached_page>::iterator iter) const;
+
+    // (func) invalidate_dependents
+    // Removes any cached pages which depend on the given asset.
+    void invalidate_dependents(const res::asset *dep) const;
+
+    // (func) index_entry
+    // Adds the entry to the EID index under its current EID, or moves it to
+    // its current EID if it is already indexed.
+    void index_entry(entry *ent);
+
+    // (func) unindex_entry
+    // Removes the entry from the EID index, if it is present.
+    void unindex_entry(const entry *ent);
+
+    // (func) rebuild_indices
+    // Discards and rebuilds the EID and page indices from the assets in the
+    // project, for when the archive itself appears or is renamed.
+    void rebuild_indices();
+
+    // (func) rebuild_page_indices
+    // Rebuilds `m_page_indices' from `p_pages'.
+    void rebuild_page_indices();
 
 public:
     // (typedef) ref
@@ -124,14 +476,320 @@ public:
     // FIXME explain
     DEFINE_APROP(pages, std::vector<res::anyref>);
 
+    // (inner struct) decoded_page
+    // The result of parsing one page with `decode_pages'. Defined below,
+    // after `spage' and `raw_entry'.
+    struct decoded_page;
+
+    // (s-func) split_pages
+    // Splits NSF data into its 64K pages. Compressed pages are decompressed
+    // (see `decompress_page'); the other pages are slices of `data' and do not
+    // copy it.
+    static std::vector<util::slice> split_pages(const util::slice &data);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Creates a raw page asset for each 64K page in the given data. The pages
+    // are slices of `data' and do not copy it, so importing directly from a
+    // slice of a memory-mapped NSF file avoids reading the file up front.
+    // Compressed pages are decompressed as they are found.
+    void import_file(TRANSACT, const util::slice &data);
+
+    // (s-func) decode_pages
+    // Parses every page in the given NSF data, along with the entries in each
+    // standard page and the type-specific contents of each entry which can be
+    // processed for the given game version. This is the CPU-bound half of
+    // `import_and_process'.
+    //
+    // If `verify_checksums' is true, any page whose stored checksum does not
+    // match its contents is rejected.
+    //
+    // The pages are parsed in parallel on the given thread pool. This does
+    // not access any project, and may itself be called from any thread. The
+    // results are returned in page order. If any page fails to parse, the
+    // error for the lowest-numbered failing page is thrown.
+    //
+    // If `progress' is not null, its total is set to the number of pages and
+    // each page is counted as it is finished. Cancelling it stops the decode
+    // between entries and throws `util::cancelled_error'.
+    static std::vector<decoded_page> decode_pages(
+        const util::slice &data,
+        game_ver ver,
+        util::thread_pool &pool,
+        bool verify_checksums = false,
+        util::progress *progress = nullptr);
+
+    // (inner struct) pagelet_loc
+    // The location of a pagelet among a batch of NSF files. See
+    // `decode_files'.
+    struct pagelet_loc {
+        int file;
+        int page;
+        int pagelet;
+    };
+
+    // (s-func) decode_files
+    // Like `decode_pages', but for a batch of NSF files which will be imported
+    // into the same project, such as every level of a game. The pages of all
+    // of the files are parsed in parallel on the given thread pool, and the
+    // results are returned in file order.
+    //
+    // A pagelet which is byte-for-byte identical to one earlier in the batch
+    // is not parsed or processed. Instead, its entry in `originals' gives the
+    // location of the earlier pagelet, and importing it shares the earlier
+    // entry's data and assets (see `entry::share_to').
+    //
+    // `verify_checksums' and `progress' are as for `decode_pages', except
+    // that the progress total is the number of pages in all of the files.
+    static std::vector<std::vector<decoded_page>> decode_files(
+        const std::vector<util::slice> &files,
+        game_ver ver,
+        util::thread_pool &pool,
+        bool verify_checksums = false,
+        util::progress *progress = nullptr);
+
+    // (func) import_decoded
+    // Creates the page, entry, and processed assets for the pages decoded by
+    // `decode_pages', in page order. Standard pages become `spage' assets with
+    // their pagelets imported as entries and processed by type; texture pages
+    // become `tpage' assets.
+    //
+    // For pages decoded by `decode_files', `batch' gives the names of the
+    // archives for all of the files, in the same order, so that shared
+    // pagelets can find their originals. The files must be imported in order.
+    void import_decoded(
+        TRANSACT,
+        std::vector<decoded_page> pages,
+        const std::vector<res::atom> &batch = {});
+
+    // (func) import_and_process
+    // Equivalent to importing the file, processing each standard page, and
+    // processing each of their entries by type, but with the parsing spread
+    // across a pool of worker threads. See `decode_pages'.
+    void import_and_process(
+        TRANSACT,
+        const util::slice &data,
+        game_ver ver,
+        bool verify_checksums = false);
+
+    // (typedef) sink
+    // A function which receives the exported NSF data in order, one page at a
+    // time. The data pointer is only valid for the duration of the call.
+    using sink = std::function<void(const util::byte *data, size_t size)>;
+
+    // (func) export_to
+    // Exports the archive page by page, passing each page to `out' as soon as
+    // it is produced. Standard pages are built in a single 64K buffer which is
+    // reused for every page, and raw pages are passed directly from their
+    // data, so memory use does not grow with the size of the archive.
+    void export_to(const sink &out) const;
+
+    // (func) export_to
+    // Exports the archive page by page directly into the given stream.
+    void export_to(std::ostream &out) const;
+
+    // (func) export_to
+    // Like `export_to' above, but assembles the standard pages concurrently on
+    // the given thread pool. Each page's entries are exported on the calling
+    // thread with `spage::gather', as the pool may not read the project, and
+    // only assembling the pages and calculating their checksums is spread
+    // across the pool. The pages are still passed to `out' one at a time, in
+    // page order, from the calling thread. Only a small window of pages ahead
+    // of the next one to be written is held at once, each in its own reused
+    // 64K buffer.
+    //
+    // The project must not be modified while this is running. If any pages
+    // fail to export, the remaining pages are still exported to find their
+    // errors, but nothing after the first failed page is written, and a
+    // `page_export_error' listing every failed page is thrown.
+    void export_to(const sink &out, util::thread_pool &pool) const;
+
+    // (func) export_to
+    // Exports the archive in parallel directly into the given stream.
+    void export_to(std::ostream &out, util::thread_pool &pool) const;
 
     // (func) export_file
-    // FIXME explain
+    // Exports the entire archive into one blob. See `export_to'.
     util::blob export_file() const;
 
+    // (inner class) snapshot
+    // The archive's pages as captured by `take_snapshot'. Defined below, after
+    // `spage'.
+    class snapshot;
+
+    // (func) take_snapshot
+    // Captures everything needed to export the archive at this moment, so
+    // that it can then be written out on another thread while the project
+    // goes on changing. Raw, texture, and cached pages are captured as they
+    // are. Other standard pages are gathered with `spage::gather', which
+    // exports their entries; only assembling those pages into their final
+    // form is left for `snapshot::export_to'.
+    //
+    // If any pages cannot be gathered, a `page_export_error' listing every
+    // such page is thrown.
+    snapshot take_snapshot() const;
+
+    // (func) cache_snapshot
+    // Adds the pages assembled by exporting the given snapshot to the export
+    // cache, so that a later export need not encode them again. Nothing is
+    // cached if any asset has changed or been removed since the snapshot was
+    // taken.
+    void cache_snapshot(const snapshot &snap) const;
+
+    // (inner struct) pack_plan
+    // A redistribution of the archive's pagelets across its standard pages,
+    // as computed by `plan_packing'.
+    struct pack_plan {
+        // (inner struct) page
+        // One page of the archive after packing. `ref' is the existing page
+        // which takes this position, or null for a new standard page. Only
+        // standard pages have a type and pagelets.
+        struct page {
+            res::anyref ref;
+            bool is_spage = false;
+            uint16_t type = 0;
+            std::vector<res::anyref> pagelets;
+        };
+
+        // (var) pages
+        // Every page of the archive after packing, in order.
+        std::vector<page> pages;
+
+        // (var) removed_pages
+        // The standard pages which are left empty by packing and removed.
+        std::vector<res::anyref> removed_pages;
+
+        // (var) pages_before
+        // The number of pages in the archive before packing.
+        int pages_before = 0;
+
+        // (var) pagelets_moved
+        // The number of pagelets which change page or position.
+        int pagelets_moved = 0;
+
+        // (var) overflow
+        // True if any standard page was over 64K before packing. Packing
+        // only needs to be applied before an export when this is set; an
+        // export otherwise succeeds as the pages are.
+        bool overflow = false;
+
+        // (func) changes_nothing
+        // Returns true if applying the plan would leave the archive as it is.
+        bool changes_nothing() const
+        {
+            return pagelets_moved == 0 && removed_pages.empty();
+        }
+    };
+
+    // (func) plan_packing
+    // Works out how to redistribute the pagelets of the standard pages so
+    // that every page fits in 64K, using as few pages as possible. Each run
+    // of consecutive standard pages of the same type is packed on its own, so
+    // pagelets never move past a texture page or a page of another type. A
+    // run is left alone unless one of its pages is over 64K or packing would
+    // leave it with fewer pages.
+    //
+    // The pagelets in a run are placed largest first into the first page
+    // with room for them ("first fit decreasing"). Afterwards, the pagelets
+    // in each page are put back in their original relative order, and the
+    // pages in order of their earliest pagelet, so a packed run still reads
+    // roughly in the order it did before.
+    //
+    // Every pagelet in the archive's standard pages is measured with
+    // `spage::measure_pagelet', which calculates the size of each entry from
+    // its contents without exporting it. An export error is thrown if a
+    // pagelet cannot be measured, such as for a broken reference (see
+    // `entry::export_size'), or is too large to fit in any page.
+    pack_plan plan_packing() const;
+
+    // (func) apply_packing
+    // Rearranges the archive's pages and pagelets as described by a plan
+    // made by `plan_packing' while the project was in its current state.
+    // Moved pagelets are renamed under their new page, new standard pages are
+    // created, and empty ones are destroyed. Standard pages whose CID was
+    // derived from their page index have it updated to their new index.
+    void apply_packing(TRANSACT, const pack_plan &plan);
+
+    // (func) plan_locality
+    // Works out how to reorder the pagelets of the standard pages so that
+    // entries which the game loads together (see `estimate_page_loads') share
+    // as few pages as possible. Within each run of standard pages, as in
+    // `plan_packing', the members of each load group are gathered at the
+    // position of the group's first member, and the pages are then filled in
+    // order, starting a group on a new page instead of splitting it when it
+    // would fit in one. Other pagelets keep their relative order.
+    //
+    // This may use more pages than `plan_packing' would. If the result would
+    // not reduce the estimated page loads, the plan changes nothing.
+    pack_plan plan_locality() const;
+
+    // (func) estimate_page_loads
+    // Estimates how many pages the game must load to use the archive's
+    // entries. Entries and texture pages are put into load groups by the
+    // references returned by `entry::get_related_eids': an entry is grouped
+    // with everything it refers to, and groups which share a member are
+    // merged. The estimate is the total number of distinct pages holding the
+    // members of each group. Entries which are in no group are not counted.
+    int estimate_page_loads() const;
+
+    // (func) estimate_page_loads
+    // Like `estimate_page_loads' above, but for the archive as it would be
+    // after applying the given plan.
+    int estimate_page_loads(const pack_plan &plan) const;
+
+    // (func) get_cached_page_count
+    // Returns the number of standard pages whose exported data is currently
+    // cached. Every export adds the pages it encodes to the cache, and any
+    // change to an asset which a cached page depends on removes that page from
+    // it.
+    //
+    // Each cached page is a full 64K copy which is not shared with the
+    // imported file, so the cache is kept within the limit given to
+    // `set_export_cache_limit' by discarding the least recently used pages.
+    int get_cached_page_count() const
+    {
+        return m_page_cache.size();
+    }
+
+    // (func) get_export_cache_size
+    // Returns the total size in bytes of the cached page data.
+    size_t get_export_cache_size() const
+    {
+        return m_page_cache_bytes;
+    }
+
+    // (func) set_export_cache_limit
+    // Sets the most page data the export cache may hold, in bytes, discarding
+    // pages as needed to stay within it. A limit of zero disables the cache.
+    // The default is `default_export_cache_limit'.
+    void set_export_cache_limit(size_t limit);
+
+    // (func) clear_export_cache
+    // Discards all cached page data, so that the next export encodes every
+    // page again. This frees the memory held by the cache, up to its limit.
+    void clear_export_cache();
+
+    // (func) find_entry
+    // Returns the entry with the given EID, or null if there is none. Only
+    // entries named under this archive (such as those created by
+    // `import_decoded') are found. This does not scan the pages; the archive
+    // keeps an index which is updated as entries appear, disappear, or change
+    // their EID.
+    res::ref<entry> find_entry(eid id) const;
+
+    // (func) find_page_index
+    // Returns the index in `p_pages' of the page containing the entry with
+    // the given EID, or -1 if there is no such entry or it is not named under
+    // one of the archive's pages.
+    int find_page_index(eid id) const;
+
+    // (func) build_lookup_table
+    // Builds the game's lookup table for the archive as it would be exported
+    // now, linking the EID of every entry and texture page to the CID of the
+    // page at its position in the file. Pages which have not been processed
+    // are parsed for their EIDs. An export error is thrown for any page or
+    // pagelet of a type which cannot be exported.
+    lookup_table build_lookup_table() const;
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
@@ -173,15 +831,102 @@ public:
     DEFINE_APROP(cid, uint32_t);
 
     // (prop) checksum
-    // FIXME explain
+    // The checksum which was stored in the page header when it was imported.
+    // This is not written back on export; exported pages always have their
+    // checksum recalculated from the exported data.
     DEFINE_APROP(checksum, uint32_t);
 
+    // (inner struct) parsed
+    // The contents of a standard page, as parsed by `parse'.
+    struct parsed {
+        uint16_t type;
+        uint32_t cid;
+        uint32_t checksum;
+        std::vector<util::slice> pagelets;
+    };
+
+    // (s-func) parse
+    // Parses the header and pagelet offsets of the given page data. The
+    // pagelets are slices of `data' and do not copy it. This does not access
+    // any project, so it may be called from any thread.
+    static parsed parse(const util::slice &data);
+
+    // (func) import_parsed
+    // Sets the page's properties from the parse result, creating a raw data
+    // asset for each pagelet.
+    void import_parsed(TRANSACT, const parsed &p);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Parses the page and creates a raw data asset for each pagelet. The
+    // pagelets are slices of `data' and do not copy it.
+    void import_file(TRANSACT, const util::slice &data);
+
+    // (s-func) measure_pagelet
+    // Returns the number of bytes the given pagelet occupies when exported
+    // into a page, not counting its entry in the page's offset table. Entries
+    // are measured by `entry::export_size'.
+    static size_t measure_pagelet(const res::anyref &pagelet);
+
+    // (func) export_size
+    // Returns the number of bytes of the page which its header and pagelets
+    // would occupy if it were exported now, without exporting it. Unlike an
+    // export, this does not fail if the result is over 64K, so that callers
+    // can show how far over the page is. This is cheap enough to call after
+    // every edit, for example to show how full each page is.
+    size_t export_size() const;
+
+    // (inner struct) contents
+    // Everything needed to write the page, as gathered by `gather'. The
+    // pagelets are held as raw data or as exported entry items, so this does
+    // not refer to any asset and may be used on any thread.
+    struct contents {
+        // (inner struct) pagelet
+        // A raw pagelet, or an entry's header fields and exported items.
+        // `size' is the number of bytes the pagelet occupies in the page.
+        struct pagelet {
+            util::slice raw;
+            bool is_entry = false;
+            uint32_t eid = 0;
+            uint32_t type = 0;
+            std::vector<util::slice> items;
+            size_t size = 0;
+        };
+
+        uint16_t type;
+        uint32_t cid;
+        uint32_t checksum;
+        std::vector<pagelet> pagelets;
+    };
+
+    // (func) gather
+    // Reads the page's properties and exports each of its entries, ready for
+    // `assemble'. An export error is thrown if a pagelet cannot be exported or
+    // the page would be over 64K.
+    //
+    // If `deps' is not null, every asset read to produce the page, including
+    // the page itself, is appended to it.
+    contents gather(std::vector<const res::asset *> *deps = nullptr) const;
+
+    // (s-func) assemble
+    // Writes the gathered contents of a page into `buf', which is resized to
+    // 64K, and calculates its checksum. This does not access any project, so
+    // it may be called from any thread.
+    static void assemble(const contents &c, util::blob &buf);
+
+    // (func) export_page
+    // Exports the page into `buf', which is resized to 64K. Entries are
+    // written directly into the buffer rather than being exported to blobs of
+    // their own, and the buffer's storage is reused if it is large enough, so
+    // the same buffer may be used to export many pages in turn.
+    //
+    // If `deps' is not null, every asset read to produce the page, including
+    // the page itself, is appended to it.
+    void export_page(
+        util::blob &buf,
+        std::vector<const res::asset *> *deps = nullptr) const;
 
     // (func) export_file
-    // FIXME explain
+    // Exports the page into a new 64K blob. See `export_page'.
     util::blob export_file() const;
 
     // FIXME obsolete
@@ -191,10 +936,138 @@ public:
         asset::reflect(rfl);
         rfl.field(p_cid, "CID");
         rfl.field(p_type, "Type");
+        rfl.field(p_checksum, "Checksum");
         rfl.field(p_pagelets, "Pagelets");
     }
 };
 
+/*
+ * nsf::tpage
+ *
+ * A texture page. The 64K of page data is a 512x128 byte area of the
+ * PlayStation's VRAM, holding textures in 4-bit, 8-bit, and 16-bit formats
+ * along with the color lookup tables (CLUTs) used by the 4-bit and 8-bit ones.
+ * The first 16 bytes overlap the page header.
+ *
+ * The page data is kept exactly as imported. Regions of the page are only
+ * decoded into RGBA when requested with `get_texture', and the results are
+ * cached on the asset until its data changes, so every view of the same
+ * texture shares one decoded copy.
+ */
+class tpage : public res::asset {
+    friend class res::asset;
+
+public:
+    // (inner struct) region
+    // A texture within the page, and the format needed to decode it.
+    struct region {
+        // (var) bpp
+        // The bits per texel: 4 or 8 for CLUT textures, or 16 for direct
+        // color textures.
+        int bpp;
+
+        // (var) x, y, width, height
+        // The texture's position and size in texels. Each row of the page
+        // is 1024, 512, or 256 texels wide for 4, 8, or 16 bpp respectively.
+        // There are 128 rows.
+        int x;
+        int y;
+        int width;
+        int height;
+
+        // (var) clut_x, clut_y
+        // The position of the CLUT in 16-bit colors, for 4-bit and 8-bit
+        // textures. The CLUT has 16 or 256 colors along one row. These are
+        // ignored for 16-bit textures.
+        int clut_x;
+        int clut_y;
+
+        // (lesser operator)
+        // Orders regions so they may be used as map keys.
+        bool operator <(const region &rhs) const
+        {
+            return std::tie(bpp, x, y, width, height, clut_x, clut_y) <
+                std::tie(
+                    rhs.bpp,
+                    rhs.x,
+                    rhs.y,
+                    rhs.width,
+                    rhs.height,
+                    rhs.clut_x,
+                    rhs.clut_y
+                );
+        }
+    };
+
+private:
+    // (var) m_texture_cache
+    // The textures decoded so far by `get_texture'. This is cleared when the
+    // page data changes.
+    mutable std::map<region, std::shared_ptr<const util::blob>>
+        m_texture_cache;
+
+    // (explicit ctor)
+    // FIXME explain
+    explicit tpage(res::project &proj) :
+        asset(proj) {}
+
+protected:
+    // (func) on_prop_change
+    // Reacts to property changes to discard any decoded textures.
+    void on_prop_change(void *prop) noexcept override
+    {
+        if (prop == &p_data) {
+            m_texture_cache.clear();
+        }
+    }
+
+public:
+    // (typedef) ref
+    // FIXME explain
+    using ref = res::ref<tpage>;
+
+    // (prop) data
+    // The 64K of page data. This is a slice of the imported data, not a copy.
+    DEFINE_APROP(data, util::slice);
+
+    // (func) get_eid
+    // Returns the page's EID, which is stored in the page header. Texture
+    // page references in entries, such as the tpag refs in `wgeo_v2', refer
+    // to texture pages by this EID.
+    eid get_eid() const;
+
+    // (func) import_file
+    // Checks the page header and sets the page data. The data is not copied.
+    void import_file(TRANSACT, const util::slice &data);
+
+    // (func) export_file
+    // Returns the page data as-is.
+    util::slice export_file() const;
+
+    // (func) get_texture
+    // Returns the given region of the page decoded to 8-bit RGBA, row by row.
+    // The region is decoded the first time it is requested, and the same
+    // decoded data is returned for any later request for the same region.
+    std::shared_ptr<const util::blob> get_texture(const region &rgn) const;
+
+    // (s-func) decode_texture
+    // Decodes the given region of the page data to 8-bit RGBA, writing
+    // `width * height * 4' bytes to `out'. This is the uncached form of
+    // `get_texture'. The region must be within the page; see `get_texture'.
+    static void decode_texture(
+        const util::slice &data,
+        const region &rgn,
+        util::byte *out);
+
+    // FIXME obsolete
+    template <typename Reflector>
+    void reflect(Reflector &rfl)
+    {
+        asset::reflect(rfl);
+        rfl.field(p_data, "Data");
+    }
+};
+
 /*
  * nsf::entry
  *
@@ -220,11 +1093,59 @@ public:
     // FIXME explain
     util::blob export_file() const;
 
+    // (s-func) calculate_size
+    // Returns the size of an exported entry with the given number of items
+    // whose sizes add up to `item_bytes', including the entry header and the
+    // item offset table.
+    static size_t calculate_size(size_t item_count, size_t item_bytes)
+    {
+        return 20 + item_count * 4 + item_bytes;
+    }
+
+    // (func) export_size
+    // Returns the number of bytes `export_file' would produce, without
+    // producing them. This throws `res::export_error' for the same missing or
+    // broken references as `export_entry', but does not otherwise check that
+    // the contents can be exported.
+    //
+    // The default implementation exports the items to measure them. Entry
+    // types override it to calculate the size from their contents instead.
+    virtual size_t export_size() const;
+
     // (pure func) export_entry
     // FIXME explain
-    virtual std::vector<util::blob> export_entry(
+    virtual std::vector<util::slice> export_entry(
         uint32_t &out_type) const = 0;
 
+    // (func) get_export_deps
+    // Appends the assets other than the entry itself which `export_entry'
+    // reads from, so that an exported copy of the entry can be discarded when
+    // any of them change.
+    //
+    // The default implementation appends nothing, which is correct for entry
+    // types whose properties hold all of their data.
+    virtual void get_export_deps(std::vector<const res::asset *> &deps) const
+    {
+    }
+
+    // (func) get_related_eids
+    // Appends the EIDs of the other entries and texture pages which the game
+    // needs loaded whenever this entry is used. This is used to keep related
+    // data in the same or nearby pages; see `archive::plan_locality'.
+    //
+    // The default implementation appends nothing.
+    virtual void get_related_eids(std::vector<eid> &eids) const
+    {
+    }
+
+    // (pure func) share_to
+    // Creates an entry of the same type under the given name with the same
+    // contents as this one, for an identical entry in another NSF file of a
+    // batch (see `archive::decode_files'). Byte data is shared rather than
+    // copied, and the new entry refers to the same assets as this one, such
+    // as its scenery, rather than to copies of them.
+    virtual void share_to(TRANSACT, res::atom name) const = 0;
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
@@ -255,21 +1176,53 @@ public:
 
     // (prop) items
     // FIXME explain
-    DEFINE_APROP(items, std::vector<util::blob>);
+    DEFINE_APROP(items, std::vector<util::slice>);
 
     // (prop) type
     // FIXME explain
     DEFINE_APROP(type, uint32_t);
 
+    // (inner struct) parsed
+    // The contents of an entry, as parsed by `parse'.
+    struct parsed {
+        nsf::eid eid;
+        uint32_t type;
+        std::vector<util::slice> items;
+    };
+
+    // (typedef) processor
+    // A function which replaces a raw entry with its processed form, using
+    // data already decoded by `prepare_by_type'.
+    using processor = std::function<void(TRANSACT, raw_entry &)>;
+
+    // (s-func) parse
+    // Parses the header and item offsets of the given entry data. The items
+    // are slices of `data' and do not copy it. This does not access any
+    // project, so it may be called from any thread.
+    static parsed parse(const util::slice &data);
+
+    // (func) import_parsed
+    // Sets the entry's properties from the parse result.
+    void import_parsed(TRANSACT, parsed p);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Parses the entry and splits it into its items. The items are slices of
+    // `data' and do not copy it.
+    void import_file(TRANSACT, const util::slice &data);
 
     // (func) export_entry
     // FIXME explain
-    std::vector<util::blob> export_entry(
+    std::vector<util::slice> export_entry(
         uint32_t &out_type) const final override;
 
+    // (func) share_to
+    // Creates a raw entry with the same EID, type, and items.
+    void share_to(TRANSACT, res::atom name) const final override;
+
+    // (func) export_size
+    // Calculates the size from the sizes of the items.
+    size_t export_size() const final override;
+
     // (func) process_as<T>
     // FIXME explain
     template <typename T>
@@ -290,6 +1243,35 @@ public:
         destroy(TS);
     }
 
+    // (func) process_as<T>
+    // Like `process_as<T>' above, but imports contents which have already
+    // been decoded from the entry's items using `T::decode'.
+    template <typename T>
+    void process_as(TRANSACT, typename T::decoded decoded)
+    {
+        assert_alive();
+
+        res::ref<T> result = get_name();
+        rename(TS, result / "_RAW");
+        result.create(TS, get_proj());
+
+        result->set_eid(TS, get_eid());
+        result->import_decoded(TS, std::move(decoded));
+
+        destroy(TS);
+    }
+
+    // (s-func) prepare_by_type
+    // Performs the parsing half of `process_by_type' for an entry with the
+    // given type and items. This does not access any project, so it may be
+    // called from any thread. Returns a processor which completes the
+    // processing on a raw entry, or null if this type of entry is not
+    // processed for the given game version.
+    static processor prepare_by_type(
+        game_ver ver,
+        uint32_t type,
+        const std::vector<util::slice> &items);
+
     // (func) process_by_type
     // FIXME explain
     bool process_by_type(TRANSACT, game_ver ver);
@@ -340,34 +1322,232 @@ public:
 
     // (prop) item4
     // FIXME explain
-    DEFINE_APROP(item4, util::blob);
+    DEFINE_APROP(item4, util::slice);
 
     // (prop) item6
     // FIXME explain
-    DEFINE_APROP(item6, util::blob);
+    DEFINE_APROP(item6, util::slice);
 
     // (prop) world
     // FIXME explain
     DEFINE_APROP(world, gfx::world::ref);
 
+    // (inner struct) decoded
+    // The contents of a wgeo_v2 entry, as decoded by `decode'.
+    struct decoded {
+        int32_t world_x;
+        int32_t world_y;
+        int32_t world_z;
+        uint32_t info_unk0;
+        uint32_t tpag_ref_count;
+        uint32_t tpag_refs[8];
+        std::vector<gfx::vertex> vertices;
+        std::vector<gfx::triangle> triangles;
+        std::vector<gfx::quad> quads;
+        std::vector<gfx::color> colors;
+        util::slice item4;
+        util::slice item6;
+    };
+
+    // (s-func) decode
+    // Parses the given entry items into vertices, polygons, and colors. This
+    // does not access any project, so it may be called from any thread.
+    static decoded decode(const std::vector<util::slice> &items);
+
+    // (func) import_decoded
+    // Creates the scenery assets for the decoded contents and sets this
+    // entry's properties to refer to them.
+    void import_decoded(TRANSACT, decoded d);
+
     // (func) import_entry
     // FIXME explain
-    void import_entry(TRANSACT, const std::vector<util::blob> &items);
+    void import_entry(TRANSACT, const std::vector<util::slice> &items);
 
     // (func) export_entry
     // FIXME explain
-    std::vector<util::blob> export_entry(
+    std::vector<util::slice> export_entry(
         uint32_t &out_type) const final override;
 
+    // (func) get_export_deps
+    // Appends the world, model, mesh, anim, and frame assets holding this
+    // entry's scenery.
+    void get_export_deps(
+        std::vector<const res::asset *> &deps) const final override;
+
+    // (func) get_related_eids
+    // Appends the EIDs of the texture pages used by this scenery, from the
+    // first `tpag_ref_count' tpag refs.
+    void get_related_eids(std::vector<eid> &eids) const final override;
+
+    // (func) share_to
+    // Creates a wgeo_v2 entry with the same properties, referring to the
+    // same world.
+    void share_to(TRANSACT, res::atom name) const final override;
+
+    // (func) export_size
+    // Calculates the size from the number of vertices, polygons, and colors
+    // in the world's model, without encoding them.
+    size_t export_size() const final override;
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
     {
         entry::reflect(rfl);
+        rfl.field(p_info_unk0, "Info Unk0");
+        rfl.field(p_tpag_ref_count, "Tpag Ref Count");
+        rfl.field(p_tpag_ref0, "Tpag Ref 0");
+        rfl.field(p_tpag_ref1, "Tpag Ref 1");
+        rfl.field(p_tpag_ref2, "Tpag Ref 2");
+        rfl.field(p_tpag_ref3, "Tpag Ref 3");
+        rfl.field(p_tpag_ref4, "Tpag Ref 4");
+        rfl.field(p_tpag_ref5, "Tpag Ref 5");
+        rfl.field(p_tpag_ref6, "Tpag Ref 6");
+        rfl.field(p_tpag_ref7, "Tpag Ref 7");
         rfl.field(p_item4, "Item 4");
         rfl.field(p_item6, "Item 6");
+        rfl.field(p_world, "World");
     }
 };
 
+/*
+ * nsf::archive::decoded_page
+ *
+ * The result of parsing one page of an NSF file with `archive::decode_pages',
+ * ready to be turned into assets by `archive::import_decoded'.
+ */
+struct archive::decoded_page {
+    // (var) data
+    // The page's raw data.
+    util::slice data;
+
+    // (var) is_spage
+    // True if this is a standard page. Other pages (texture pages) are not
+    // parsed here, and only `data' is set.
+    bool is_spage;
+
+    // (var) header
+    // The parsed page header and pagelets.
+    spage::parsed header;
+
+    // (var) entries
+    // The parsed entry for each pagelet.
+    std::vector<raw_entry::parsed> entries;
+
+    // (var) processors
+    // The processor for each entry, as returned by `prepare_by_type'. These
+    // may be null for entry types which are not processed.
+    std::vector<raw_entry::processor> processors;
+
+    // (var) originals
+    // For pages decoded by `decode_files', the location of the identical
+    // earlier pagelet for each pagelet which has one, or a location with a
+    // `file' of -1 for the others. The entries and processors of the shared
+    // pagelets are left empty. This is empty for pages from `decode_pages'.
+    std::vector<pagelet_loc> originals;
+};
+
+/*
+ * nsf::archive::snapshot
+ *
+ * The pages of an archive captured at one point in time by
+ * `archive::take_snapshot'. This holds no references to the project's assets,
+ * so it may be exported on any thread, but only one thread may use it at a
+ * time.
+ */
+class archive::snapshot {
+    friend class archive;
+
+private:
+    // (inner struct) page
+    // One captured page. If `ready' is true, `data' holds the whole page.
+    // Otherwise, `contents' holds the gathered standard page, and `data' is
+    // set once it has been assembled.
+    struct page {
+        bool ready = false;
+        util::slice data;
+        spage::contents contents;
+        const res::asset *asset = nullptr;
+        std::vector<const res::asset *> deps;
+    };
+
+    // (var) m_pages
+    // The captured pages, in order.
+    std::vector<page> m_pages;
+
+    // (var) m_revision
+    // The archive's `m_revision' when the snapshot was taken.
+    unsigned long m_revision = 0;
+
+public:
+    // (func) get_page_count
+    // Returns the number of pages in the snapshot.
+    int get_page_count() const
+    {
+        return m_pages.size();
+    }
+
+    // (func) export_to
+    // Writes the pages to `out' in order, assembling each gathered page as it
+    // is reached.
+    //
+    // If `progress' is not null, its total is set to the number of pages and
+    // each page is counted once it has been written. Cancelling it stops the
+    // export between pages and throws `util::cancelled_error'.
+    void export_to(const sink &out, util::progress *progress = nullptr);
+};
+
+}
+
+namespace reflect {
+
+// reflection info for nsf::archive
+template <>
+struct asset_type_info<nsf::archive> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::archive";
+};
+
+// reflection info for nsf::spage
+template <>
+struct asset_type_info<nsf::spage> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::spage";
+};
+
+// reflection info for nsf::tpage
+template <>
+struct asset_type_info<nsf::tpage> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::tpage";
+};
+
+// reflection info for nsf::entry
+template <>
+struct asset_type_info<nsf::entry> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::entry";
+};
+
+// reflection info for nsf::raw_entry
+template <>
+struct asset_type_info<nsf::raw_entry> {
+    using base_type = nsf::entry;
+
+    static constexpr const char *name = "nsf::raw_entry";
+};
+
+// reflection info for nsf::wgeo_v2
+template <>
+struct asset_type_info<nsf::wgeo_v2> {
+    using base_type = nsf::entry;
+
+    static constexpr const char *name = "nsf::wgeo_v2";
+};
+
 }
 }
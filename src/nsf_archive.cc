@@ -19,26 +19,666 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 #include "misc.hh"
 
 namespace drnsf {
 namespace nsf {
 
+namespace {
+
+// (internal func) get_verbatim_page
+// If the page is a raw data or texture page, which are exported exactly as
+// they are stored, sets `out' to its data and returns true. Otherwise returns
+// false.
+bool get_verbatim_page(const res::anyref &ref, util::slice &out)
+{
+    misc::raw_data::ref raw_ref = ref;
+    if (raw_ref.ok()) {
+        out = raw_ref->get_data();
+        return true;
+    }
+
+    tpage::ref tpage_ref = ref;
+    if (tpage_ref.ok()) {
+        out = tpage_ref->export_file();
+        return true;
+    }
+
+    return false;
+}
+
+// (internal const) pack_capacity
+// The space in a standard page for pagelets and their offsets, after the
+// header and the final offset.
+constexpr size_t pack_capacity = page_size - 20;
+
+// (internal struct) run_item
+// A pagelet in a run of standard pages being packed. `weight' includes the
+// pagelet's entry in the page's offset table.
+struct run_item {
+    res::anyref ref;
+    size_t page;
+    size_t index;
+    size_t weight;
+};
+
+// (internal typedef) run_packer
+// A function which packs the measured pagelets of one run of `run_size'
+// standard pages, returning the pagelets of each resulting page as indices
+// into `items', or nothing to leave the run as it is. `overflow' is true if
+// any page in the run is currently over 64K.
+using run_packer = std::function<std::vector<std::vector<size_t>>(
+    const std::vector<run_item> &items,
+    size_t run_size,
+    bool overflow)>;
+
+// (internal func) plan_runs
+// Builds a packing plan for the given pages. Each run of consecutive standard
+// pages of the same type is measured and passed to `pack', and the pages it
+// returns replace the run, reusing the run's pages in order. Other pages are
+// kept as they are.
+archive::pack_plan plan_runs(
+    const std::vector<res::anyref> &pages,
+    const run_packer &pack)
+{
+    archive::pack_plan plan;
+    plan.pages_before = pages.size();
+
+    size_t run_begin = 0;
+    while (run_begin < pages.size()) {
+        spage::ref first = pages[run_begin];
+        if (!first.ok()) {
+            archive::pack_plan::page out;
+            out.ref = pages[run_begin];
+            plan.pages.push_back(std::move(out));
+            run_begin++;
+            continue;
+        }
+
+        // Find the end of this run of standard pages of the same type.
+        auto type = first->get_type();
+        size_t run_end = run_begin + 1;
+        while (run_end < pages.size()) {
+            spage::ref next = pages[run_end];
+            if (!next.ok() || next->get_type() != type)
+                break;
+            run_end++;
+        }
+        size_t run_size = run_end - run_begin;
+
+        // Measure every pagelet in the run.
+        std::vector<run_item> items;
+        bool overflow = false;
+        for (size_t i = run_begin; i < run_end; i++) {
+            spage::ref page = pages[i];
+            auto &&pagelets = page->get_pagelets();
+            size_t load = 0;
+            for (auto &&j : util::range_of(pagelets)) {
+                size_t weight = spage::measure_pagelet(pagelets[j]) + 4;
+                if (weight > pack_capacity) {
+                    throw res::export_error(
+                        "nsf::archive: pagelet too large for any page"
+                    );
+                }
+                load += weight;
+                items.push_back({ pagelets[j], i, j, weight });
+            }
+            if (load > pack_capacity) {
+                overflow = true;
+            }
+        }
+        plan.overflow |= overflow;
+
+        auto bins = pack(items, run_size, overflow);
+        if (bins.empty()) {
+            for (size_t i = run_begin; i < run_end; i++) {
+                spage::ref page = pages[i];
+                archive::pack_plan::page out;
+                out.ref = pages[i];
+                out.is_spage = true;
+                out.type = type;
+                out.pagelets = page->get_pagelets();
+                plan.pages.push_back(std::move(out));
+            }
+            run_begin = run_end;
+            continue;
+        }
+
+        // Reuse the run's pages in order for the packed pages, adding new
+        // pages or removing left over ones as needed.
+        for (auto &&i : util::range_of(bins)) {
+            archive::pack_plan::page out;
+            if (i < run_size) {
+                out.ref = pages[run_begin + i];
+            }
+            out.is_spage = true;
+            out.type = type;
+            for (auto &&j : util::range_of(bins[i])) {
+                auto &&item = items[bins[i][j]];
+                out.pagelets.push_back(item.ref);
+                if (i >= run_size ||
+                    item.page != run_begin + i ||
+                    item.index != j) {
+                    plan.pagelets_moved++;
+                }
+            }
+            plan.pages.push_back(std::move(out));
+        }
+        for (size_t i = bins.size(); i < run_size; i++) {
+            plan.removed_pages.push_back(pages[run_begin + i]);
+        }
+
+        run_begin = run_end;
+    }
+
+    return plan;
+}
+
+// (internal func) plan_current
+// Returns a plan which keeps the given pages as they are.
+archive::pack_plan plan_current(const std::vector<res::anyref> &pages)
+{
+    archive::pack_plan plan;
+    plan.pages_before = pages.size();
+    for (auto &&page_ref : pages) {
+        archive::pack_plan::page out;
+        out.ref = page_ref;
+        spage::ref page = page_ref;
+        if (page.ok()) {
+            out.is_spage = true;
+            out.type = page->get_type();
+            out.pagelets = page->get_pagelets();
+        }
+        plan.pages.push_back(std::move(out));
+    }
+    return plan;
+}
+
+// (internal func) find_load_groups
+// Groups the EIDs of the entries in the given pages, and of the entries and
+// texture pages they refer to through `entry::get_related_eids', into sets
+// which the game loads together. Two EIDs are in the same group if one refers
+// to the other, or both are referred to by the same entry, directly or
+// through other members of the group. Returns the group of each EID which is
+// in a group of two or more, identified by one of its members.
+std::map<eid, eid> find_load_groups(const std::vector<res::anyref> &pages)
+{
+    std::map<eid, eid> parent;
+    auto find = [&](eid id) {
+        auto iter = parent.insert({ id, id }).first;
+        while (iter->second != iter->first) {
+            auto next = parent.find(iter->second);
+            iter->second = next->second;
+            iter = next;
+        }
+        return iter->first;
+    };
+
+    std::vector<eid> related;
+    for (auto &&page_ref : pages) {
+        spage::ref page = page_ref;
+        if (!page.ok())
+            continue;
+
+        for (auto &&pagelet : page->get_pagelets()) {
+            entry::ref ent = pagelet;
+            if (!ent.ok())
+                continue;
+
+            related.clear();
+            ent->get_related_eids(related);
+            for (auto &&id : related) {
+                auto a = find(ent->get_eid());
+                auto b = find(id);
+                if (a != b) {
+                    parent[b] = a;
+                }
+            }
+        }
+    }
+
+    // Discard the EIDs which are alone in their group.
+    std::map<eid, int> group_sizes;
+    for (auto &&member : parent) {
+        group_sizes[find(member.first)]++;
+    }
+    std::map<eid, eid> groups;
+    for (auto &&member : parent) {
+        auto group = find(member.first);
+        if (group_sizes[group] > 1) {
+            groups.insert({ member.first, group });
+        }
+    }
+    return groups;
+}
+
+// (internal func) read_eid
+// Reads the EID from the header of an unprocessed entry or texture page, both
+// of which hold it in bytes 4 to 7.
+eid read_eid(const util::slice &data)
+{
+    if (data.size() < 8)
+        throw res::export_error("nsf::archive: pagelet too small for EID");
+
+    return data[4] | data[5] << 8 | data[6] << 16 | uint32_t(data[7]) << 24;
+}
+
+// (internal func) decode_header
+// Sets the data of a decoded page and, for a standard page, parses its header
+// and pagelets. The entries in the pagelets are not parsed.
+void decode_header(
+    archive::decoded_page &page,
+    const util::slice &page_data,
+    bool verify_checksums)
+{
+    if (verify_checksums && !verify_page_checksum(page_data))
+        throw res::import_error("nsf::archive: bad page checksum");
+
+    page.data = page_data;
+
+    // Pages with type 1 cannot be processed as normal pages.
+    page.is_spage = (page_data[2] != 1);
+    if (page.is_spage) {
+        page.header = spage::parse(page_data);
+    }
+}
+
+// (internal func) decode_entries
+// Parses and prepares the entry in each pagelet of a standard page decoded by
+// `decode_header', except for those which are shared with another pagelet.
+void decode_entries(
+    archive::decoded_page &page,
+    game_ver ver,
+    util::progress *progress)
+{
+    auto &&pagelets = page.header.pagelets;
+    page.entries.resize(pagelets.size());
+    page.processors.resize(pagelets.size());
+    for (auto &&i : util::range_of(pagelets)) {
+        if (progress) {
+            progress->check();
+        }
+
+        if (!page.originals.empty() && page.originals[i].file != -1)
+            continue;
+
+        auto &&entry = page.entries[i];
+        entry = raw_entry::parse(pagelets[i]);
+        page.processors[i] = raw_entry::prepare_by_type(
+            ver,
+            entry.type,
+            entry.items
+        );
+    }
+}
+
+// (internal func) wait_all
+// Waits for every one of the given tasks to finish, then rethrows the error
+// from the first one which failed, if any. No task is left running, so that
+// none is left referring to data which the caller is about to release.
+void wait_all(std::vector<std::future<void>> &futures)
+{
+    std::exception_ptr error;
+    for (auto &&future : futures) {
+        try {
+            future.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}
+
+// declared in nsf.hh
+archive::archive(res::project &proj) :
+    asset(proj)
+{
+    h_asset_appear <<= [this](res::asset &asset) {
+        if (&asset == this) {
+            rebuild_indices();
+            return;
+        }
+
+        // Only entries named somewhere under this archive are indexed.
+        auto ent = dynamic_cast<entry *>(&asset);
+        if (!ent)
+            return;
+        auto &&root = get_proj().get_asset_root();
+        for (auto a = asset.get_name(); a != root; a = a.get_parent()) {
+            if (a == get_name()) {
+                index_entry(ent);
+                break;
+            }
+        }
+    };
+    h_asset_appear.bind(proj.on_asset_appear);
+    h_asset_change <<= [this](res::asset &asset) {
+        m_revision++;
+        invalidate_dependents(&asset);
+
+        if (&asset == this) {
+            rebuild_page_indices();
+            return;
+        }
+
+        auto ent = dynamic_cast<entry *>(&asset);
+        if (ent && m_indexed_eids.count(ent)) {
+            index_entry(ent);
+        }
+    };
+    h_asset_change.bind(proj.on_asset_change);
+    h_asset_disappear <<= [this](res::asset &asset) {
+        m_revision++;
+        invalidate_dependents(&asset);
+
+        if (auto ent = dynamic_cast<entry *>(&asset)) {
+            unindex_entry(ent);
+        }
+    };
+    h_asset_disappear.bind(proj.on_asset_disappear);
+}
+
+// declared in nsf.hh
+void archive::cache_page(
+    const res::asset *page,
+    util::slice data,
+    std::vector<const res::asset *> deps) const
+{
+    auto old_iter = m_page_cache.find(page);
+    if (old_iter != m_page_cache.end()) {
+        uncache_page(old_iter);
+    }
+
+    if (data.size() > m_page_cache_limit)
+        return;
+
+    for (auto &&dep : deps) {
+        m_page_dependents[dep].insert(page);
+    }
+    m_page_lru.push_front(page);
+    m_page_cache_bytes += data.size();
+    m_page_cache[page] = {
+        std::move(data),
+        std::move(deps),
+        m_page_lru.begin()
+    };
+
+    while (m_page_cache_bytes > m_page_cache_limit) {
+        uncache_page(m_page_cache.find(m_page_lru.back()));
+    }
+}
+
+// declared in nsf.hh
+util::slice archive::find_cached_page(const res::asset *page) const
+{
+    auto iter = m_page_cache.find(page);
+    if (iter == m_page_cache.end())
+        return {};
+
+    m_page_lru.splice(m_page_lru.begin(), m_page_lru, iter->second.lru_pos);
+    return iter->second.data;
+}
+
+// declared in nsf.hh
+void archive::uncache_page(
+    std::map<const res::asset *, cached_page>::iterator iter) const
+{
+    auto page = iter->first;
+
+    // Remove the page from the dependents of everything it depends on, so
+    // that the dependents map does not keep growing.
+    for (auto &&dep : iter->second.deps) {
+        auto dep_iter = m_page_dependents.find(dep);
+        if (dep_iter == m_page_dependents.end())
+            continue;
+
+        dep_iter->second.erase(page);
+        if (dep_iter->second.empty()) {
+            m_page_dependents.erase(dep_iter);
+        }
+    }
+
+    m_page_lru.erase(iter->second.lru_pos);
+    m_page_cache_bytes -= iter->second.data.size();
+    m_page_cache.erase(iter);
+}
+
+// declared in nsf.hh
+void archive::invalidate_dependents(const res::asset *dep) const
+{
+    auto iter = m_page_dependents.find(dep);
+    if (iter == m_page_dependents.end())
+        return;
+
+    auto pages = std::move(iter->second);
+    m_page_dependents.erase(iter);
+
+    for (auto &&page : pages) {
+        auto cache_iter = m_page_cache.find(page);
+        if (cache_iter != m_page_cache.end()) {
+            uncache_page(cache_iter);
+        }
+    }
+}
+
+// declared in nsf.hh
+void archive::set_export_cache_limit(size_t limit)
+{
+    m_page_cache_limit = limit;
+    while (m_page_cache_bytes > m_page_cache_limit) {
+        uncache_page(m_page_cache.find(m_page_lru.back()));
+    }
+}
+
+// declared in nsf.hh
+void archive::clear_export_cache()
+{
+    m_page_cache.clear();
+    m_page_lru.clear();
+    m_page_cache_bytes = 0;
+    m_page_dependents.clear();
+}
+
+// declared in nsf.hh
+void archive::index_entry(entry *ent)
+{
+    unindex_entry(ent);
+
+    uint32_t id = ent->get_eid();
+    m_eid_index.insert({ id, ent });
+    m_indexed_eids[ent] = id;
+}
+
+// declared in nsf.hh
+void archive::unindex_entry(const entry *ent)
+{
+    auto iter = m_indexed_eids.find(ent);
+    if (iter == m_indexed_eids.end())
+        return;
+
+    auto range = m_eid_index.equal_range(iter->second);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == ent) {
+            m_eid_index.erase(it);
+            break;
+        }
+    }
+    m_indexed_eids.erase(iter);
+}
+
+// declared in nsf.hh
+void archive::rebuild_indices()
+{
+    m_eid_index.clear();
+    m_indexed_eids.clear();
+
+    for (auto &&a : get_name().get_children_recursive()) {
+        entry::ref ent = a;
+        if (ent.ok()) {
+            index_entry(&*ent);
+        }
+    }
+
+    rebuild_page_indices();
+}
+
+// declared in nsf.hh
+void archive::rebuild_page_indices()
+{
+    m_page_indices.clear();
+
+    auto &&pages = get_pages();
+    for (auto &&i : util::range_of(pages)) {
+        if (pages[i]) {
+            m_page_indices.insert({ pages[i], i });
+        }
+    }
+}
+
+// declared in nsf.hh
+res::ref<entry> archive::find_entry(eid id) const
+{
+    auto iter = m_eid_index.find(id);
+    if (iter == m_eid_index.end())
+        return nullptr;
+
+    return iter->second->get_name();
+}
+
+// declared in nsf.hh
+int archive::find_page_index(eid id) const
+{
+    auto iter = m_eid_index.find(id);
+    if (iter == m_eid_index.end())
+        return -1;
+
+    auto page_iter = m_page_indices.find(
+        iter->second->get_name().get_parent()
+    );
+    if (page_iter == m_page_indices.end())
+        return -1;
+
+    return page_iter->second;
+}
+
 // declared in nsf.hh
-void archive::import_file(TRANSACT, const util::blob &data)
+lookup_table archive::build_lookup_table() const
 {
     assert_alive();
 
-    // Ensure the NSF size is a multiple of the page size (64K).
-    if (data.size() % page_size != 0)
-        throw res::import_error("nsf::archive: size not multiple of 64K");
+    auto &&pages = get_pages();
+
+    std::vector<lookup_table::link> links;
+    for (auto &&i : util::range_of(pages)) {
+        auto &&ref = pages[i];
+
+        // The game finds each page by its position in the file.
+        uint32_t cid = (uint32_t(i) << 1) | 1;
+
+        if (!ref)
+            throw res::export_error("nsf::archive: null page ref");
+
+        // Texture pages are entries themselves.
+        tpage::ref tpage_ref = ref;
+        if (tpage_ref.ok()) {
+            links.push_back({ cid, tpage_ref->get_eid() });
+            continue;
+        }
+
+        spage::ref spage_ref = ref;
+        if (spage_ref.ok()) {
+            for (auto &&pagelet : spage_ref->get_pagelets()) {
+                entry::ref entry_ref = pagelet;
+                if (entry_ref.ok()) {
+                    links.push_back({ cid, entry_ref->get_eid() });
+                    continue;
+                }
+
+                misc::raw_data::ref raw_ref = pagelet;
+                if (raw_ref.ok()) {
+                    links.push_back({ cid, read_eid(raw_ref->get_data()) });
+                    continue;
+                }
+
+                throw res::export_error(
+                    "nsf::archive: pagelet has incompatible type"
+                );
+            }
+            continue;
+        }
+
+        // Pages which have not been processed are parsed for their EIDs.
+        misc::raw_data::ref raw_ref = ref;
+        if (raw_ref.ok()) {
+            auto &&data = raw_ref->get_data();
+            if (data.size() != page_size)
+                throw res::export_error("nsf::archive: raw page not 64K");
+
+            if (data[2] == 1) {
+                links.push_back({ cid, read_eid(data) });
+                continue;
+            }
+
+            for (auto &&pagelet : spage::parse(data).pagelets) {
+                links.push_back({ cid, read_eid(pagelet) });
+            }
+            continue;
+        }
+
+        throw res::export_error("nsf::archive: page has incompatible type");
+    }
+
+    return lookup_table(links);
+}
+
+// declared in nsf.hh
+std::vector<util::slice> archive::split_pages(const util::slice &data)
+{
+    std::vector<util::slice> pages;
+    pages.reserve(data.size() / page_size);
+
+    // The pages must be found in order, as the size of each compressed page
+    // is only known once it has been decompressed.
+    size_t offset = 0;
+    while (offset < data.size()) {
+        auto rest = data.sub(offset, data.size() - offset);
+        if (is_compressed_page(rest)) {
+            size_t size;
+            pages.emplace_back(decompress_page(rest, size));
+            offset += size;
+            continue;
+        }
+
+        // Ensure the NSF size is a multiple of the page size (64K).
+        if (rest.size() < page_size)
+            throw res::import_error("nsf::archive: size not multiple of 64K");
+
+        pages.push_back(rest.sub(0, page_size));
+        offset += page_size;
+    }
+
+    return pages;
+}
+
+// declared in nsf.hh
+void archive::import_file(TRANSACT, const util::slice &data)
+{
+    assert_alive();
 
-    int page_count = data.size() / page_size;
+    auto page_data = split_pages(data);
 
-    // Copy the data for each page as a new raw_data asset. The caller can
-    // later process these into standard or texture pages if desired.
-    std::vector<misc::raw_data::ref> pages(page_count);
+    // Create a new raw_data asset for each page. The page data is a slice of
+    // the NSF data, not a copy, unless the page was compressed. The caller
+    // can later process these into standard or texture pages if desired.
+    std::vector<misc::raw_data::ref> pages(page_data.size());
     for (auto &&i : util::range_of(pages)) {
         auto &&page = pages[i];
 
@@ -46,11 +686,8 @@ void archive::import_file(TRANSACT, const util::blob &data)
         page = get_name() / "page-$"_fmt(i);
         page.create(TS, get_proj());
 
-        // Copy the page data into the asset.
-        page->set_data(TS, {
-            data.data() + page_size * i,
-            data.data() + page_size * (i + 1)
-        });
+        // Point the asset at the page's data.
+        page->set_data(TS, page_data[i]);
     }
 
     // Finish importing.
@@ -58,35 +695,1339 @@ void archive::import_file(TRANSACT, const util::blob &data)
 }
 
 // declared in nsf.hh
-util::blob archive::export_file() const
+page_export_error::page_export_error(std::vector<page_error> errors) :
+    export_error(
+        "nsf::archive: failed to export $ page(s)"_fmt(errors.size())
+    ),
+    m_errors(std::move(errors))
 {
-    util::blob data;
+}
 
-    for (auto &&i : util::range_of(get_pages())) {
-        auto ref = get_pages()[i];
+// declared in nsf.hh
+std::vector<archive::decoded_page> archive::decode_pages(
+    const util::slice &data,
+    game_ver ver,
+    util::thread_pool &pool,
+    bool verify_checksums,
+    util::progress *progress)
+{
+    auto page_slices = split_pages(data);
 
-        if (!ref)
-            throw res::export_error("nsf::archive: null page ref");
+    int page_count = page_slices.size();
+    if (progress) {
+        progress->set_total(page_count);
+    }
 
-        misc::raw_data::ref raw_ref = ref;
-        if (raw_ref.ok()) {
-            auto raw_data = raw_ref->get_data();
-            data.insert(data.end(), raw_data.begin(), raw_data.end());
-            continue;
+    // Decode each page on the thread pool. Each task only reads from its own
+    // page of the NSF data and writes to its own decoded page, so no
+    // synchronization is needed between them.
+    std::vector<decoded_page> pages(page_count);
+    std::vector<std::future<void>> futures(page_count);
+    for (auto &&i : util::range_of(futures)) {
+        auto page_data = page_slices[i];
+        auto &&page = pages[i];
+        futures[i] = pool.post([&page, page_data, ver, verify_checksums,
+            progress]{
+            if (progress) {
+                progress->check();
+            }
+
+            decode_header(page, page_data, verify_checksums);
+            if (page.is_spage) {
+                decode_entries(page, ver, progress);
+            }
+
+            if (progress) {
+                progress->add_done();
+            }
+        });
+    }
+    wait_all(futures);
+    if (progress) {
+        progress->check();
+    }
+
+    return pages;
+}
+
+// declared in nsf.hh
+std::vector<std::vector<archive::decoded_page>> archive::decode_files(
+    const std::vector<util::slice> &files,
+    game_ver ver,
+    util::thread_pool &pool,
+    bool verify_checksums,
+    util::progress *progress)
+{
+    int page_count = 0;
+    std::vector<std::vector<util::slice>> file_pages;
+    for (auto &&data : files) {
+        file_pages.push_back(split_pages(data));
+        page_count += file_pages.back().size();
+    }
+    if (progress) {
+        progress->set_total(page_count);
+    }
+
+    // Parse the header of every page in every file and hash each pagelet, on
+    // the thread pool.
+    std::vector<std::vector<decoded_page>> results(files.size());
+    std::vector<std::vector<std::vector<uint64_t>>> hashes(files.size());
+    std::vector<std::future<void>> futures;
+    for (auto &&f : util::range_of(files)) {
+        results[f].resize(file_pages[f].size());
+        hashes[f].resize(file_pages[f].size());
+        for (auto &&p : util::range_of(results[f])) {
+            auto page_data = file_pages[f][p];
+            auto &&page = results[f][p];
+            auto &&page_hashes = hashes[f][p];
+            futures.push_back(pool.post([&page, &page_hashes, page_data,
+                verify_checksums, progress]{
+                if (progress) {
+                    progress->check();
+                }
+
+                decode_header(page, page_data, verify_checksums);
+                for (auto &&pagelet : page.header.pagelets) {
+                    page_hashes.push_back(
+                        util::hash64(pagelet.data(), pagelet.size())
+                    );
+                }
+            }));
         }
+    }
+    wait_all(futures);
+    futures.clear();
 
-        spage::ref spage_ref = ref;
-        if (spage_ref.ok()) {
-            auto spage_data = spage_ref->export_file();
-            data.insert(data.end(), spage_data.begin(), spage_data.end());
-            continue;
+    // Find the pagelets which are identical to an earlier one, in file, page,
+    // and pagelet order. This is cheap compared to parsing, so it is done
+    // here rather than on the pool. A hash match is confirmed by comparing
+    // the data, and a pagelet whose hash matches but whose data does not is
+    // simply not shared.
+    std::unordered_map<uint64_t, pagelet_loc> firsts;
+    for (auto &&f : util::range_of(results)) {
+        for (auto &&p : util::range_of(results[f])) {
+            auto &&page = results[f][p];
+            if (!page.is_spage)
+                continue;
+
+            auto &&pagelets = page.header.pagelets;
+            page.originals.assign(pagelets.size(), { -1, 0, 0 });
+            for (auto &&i : util::range_of(pagelets)) {
+                pagelet_loc loc = { int(f), int(p), int(i) };
+                auto it = firsts.insert({ hashes[f][p][i], loc }).first;
+                auto &&orig = it->second;
+                if (orig.file == loc.file && orig.page == loc.page &&
+                    orig.pagelet == loc.pagelet)
+                    continue;
+
+                auto &&orig_page = results[orig.file][orig.page];
+                if (orig_page.header.pagelets[orig.pagelet] == pagelets[i]) {
+                    page.originals[i] = orig;
+                }
+            }
         }
+    }
+    hashes.clear();
 
-        throw res::export_error("nsf::archive: page has incompatible type");
+    // Parse and prepare the entries which are not shared, on the pool.
+    for (auto &&file_pages : results) {
+        for (auto &&page : file_pages) {
+            futures.push_back(pool.post([&page, ver, progress]{
+                if (page.is_spage) {
+                    decode_entries(page, ver, progress);
+                }
+
+                if (progress) {
+                    progress->add_done();
+                }
+            }));
+        }
+    }
+    wait_all(futures);
+    if (progress) {
+        progress->check();
     }
 
-    return data;
+    return results;
+}
+
+// declared in nsf.hh
+void archive::import_decoded(
+    TRANSACT,
+    std::vector<decoded_page> pages,
+    const std::vector<res::atom> &batch)
+{
+    assert_alive();
+
+    std::vector<res::anyref> page_refs(pages.size());
+    for (auto &&i : util::range_of(pages)) {
+        auto &&page = pages[i];
+        auto page_name = get_name() / "page-$"_fmt(i);
+        page_refs[i] = page_name;
+
+        // Pages which are not standard pages are texture pages.
+        if (!page.is_spage) {
+            tpage::ref tpage = page_name;
+            tpage.create(TS, get_proj());
+            tpage->import_file(TS, page.data);
+            continue;
+        }
+
+        nsf::spage::ref spage = page_name;
+        spage.create(TS, get_proj());
+
+        // Create and process each of the entries in the page.
+        std::vector<res::anyref> pagelets(page.entries.size());
+        for (auto &&j : util::range_of(pagelets)) {
+            auto pagelet_name = page_name / "pagelet-$"_fmt(j);
+
+            // Pagelets which are shared with an earlier one in the batch
+            // share its entry's contents instead of being imported again.
+            if (!page.originals.empty() && page.originals[j].file != -1) {
+                auto &&orig = page.originals[j];
+                if (size_t(orig.file) >= batch.size())
+                    throw std::logic_error(
+                        "nsf::archive::import_decoded: missing batch name"
+                    );
+
+                entry::ref orig_entry = batch[orig.file]
+                    / "page-$"_fmt(orig.page)
+                    / "pagelet-$"_fmt(orig.pagelet);
+                if (!orig_entry.ok())
+                    throw std::logic_error(
+                        "nsf::archive::import_decoded: original not imported"
+                    );
+
+                orig_entry->share_to(TS, pagelet_name);
+                pagelets[j] = pagelet_name;
+                continue;
+            }
+
+            raw_entry::ref entry = pagelet_name;
+            entry.create(TS, get_proj());
+            entry->import_parsed(TS, std::move(page.entries[j]));
+            pagelets[j] = entry;
+
+            if (page.processors[j]) {
+                page.processors[j](TS, *entry);
+            }
+        }
+
+        spage->set_type(TS, page.header.type);
+        spage->set_cid(TS, page.header.cid);
+        spage->set_checksum(TS, page.header.checksum);
+        spage->set_pagelets(TS, std::move(pagelets));
+    }
+
+    // Finish importing.
+    set_pages(TS, std::move(page_refs));
+}
+
+// declared in nsf.hh
+void archive::import_and_process(
+    TRANSACT,
+    const util::slice &data,
+    game_ver ver,
+    bool verify_checksums)
+{
+    assert_alive();
+
+    util::thread_pool pool;
+    import_decoded(TS, decode_pages(data, ver, pool, verify_checksums));
+}
+
+// declared in nsf.hh
+void archive::export_to(const sink &out) const
+{
+    assert_alive();
+
+    // Standard pages are exported into this buffer, which is reused for each
+    // page once it has been passed to the sink.
+    util::blob page_buf;
+    page_buf.reserve(page_size);
+    std::vector<const res::asset *> deps;
+
+    for (auto &&i : util::range_of(get_pages())) {
+        auto ref = get_pages()[i];
+
+        if (!ref)
+            throw res::export_error("nsf::archive: null page ref");
+
+        util::slice verbatim_data;
+        if (get_verbatim_page(ref, verbatim_data)) {
+            out(verbatim_data.data(), verbatim_data.size());
+            continue;
+        }
+
+        spage::ref spage_ref = ref;
+        if (spage_ref.ok()) {
+            // Copy the page verbatim if nothing it depends on has changed
+            // since it was last exported.
+            auto cached_data = find_cached_page(spage_ref.get());
+            if (!cached_data.empty()) {
+                out(cached_data.data(), cached_data.size());
+                continue;
+            }
+
+            deps.clear();
+            spage_ref->export_page(page_buf, &deps);
+            cache_page(spage_ref.get(), page_buf, deps);
+            out(page_buf.data(), page_buf.size());
+            continue;
+        }
+
+        throw res::export_error("nsf::archive: page has incompatible type");
+    }
+}
+
+// declared in nsf.hh
+void archive::export_to(std::ostream &out) const
+{
+    export_to([&out](const util::byte *data, size_t size) {
+        out.write(reinterpret_cast<const char *>(data), size);
+    });
+}
+
+// declared in nsf.hh
+void archive::export_to(const sink &out, util::thread_pool &pool) const
+{
+    assert_alive();
+
+    auto &&pages = get_pages();
+
+    // Each page being exported is gathered into one of these buffers, chosen
+    // by its index, along with the assets it depends on, and then assembled
+    // into its data. A buffer is only reused once the page before it in that
+    // slot has been written out, which bounds the memory used by the export.
+    // Cached pages are held in `page' from when they are queued, so that they
+    // are still written even if the cache discards them to make room for
+    // pages encoded in the meantime.
+    struct page_buf {
+        spage::contents contents;
+        util::blob data;
+        std::vector<const res::asset *> deps;
+        bool encoded = false;
+        util::slice page;
+    };
+    std::vector<page_buf> page_bufs(pool.get_thread_count() * 2);
+
+    std::deque<std::future<void>> pending;
+    std::vector<page_export_error::page_error> errors;
+    std::exception_ptr fatal_error;
+    int next_write = 0;
+
+    // Leave no task running with references to the buffers or this archive,
+    // even if writing to the sink throws.
+    DRNSF_ON_EXIT {
+        for (auto &&future : pending) {
+            future.wait();
+        }
+    };
+
+    // Waits for the oldest pending page and writes it to the sink, unless a
+    // page before it has failed.
+    auto write_next = [&]{
+        auto i = next_write++;
+        auto future = std::move(pending.front());
+        pending.pop_front();
+
+        try {
+            future.get();
+        } catch (res::export_error &ex) {
+            errors.push_back({ i, ex.what() });
+            return;
+        } catch (...) {
+            if (!fatal_error) {
+                fatal_error = std::current_exception();
+            }
+            return;
+        }
+
+        util::slice verbatim_data;
+        const util::byte *data;
+        size_t size;
+        if (get_verbatim_page(pages[i], verbatim_data)) {
+            data = verbatim_data.data();
+            size = verbatim_data.size();
+        } else {
+            // Pages which were newly encoded are cached even if they will not
+            // be written, so that a later export need not encode them again.
+            auto &&buf = page_bufs[i % page_bufs.size()];
+            if (buf.encoded) {
+                buf.page = util::slice(std::move(buf.data));
+                buf.data = util::blob();
+                cache_page(pages[i].get(), buf.page, std::move(buf.deps));
+                buf.deps.clear();
+                buf.encoded = false;
+            }
+            data = buf.page.data();
+            size = buf.page.size();
+        }
+
+        if (!errors.empty() || fatal_error)
+            return;
+
+        out(data, size);
+    };
+
+    for (auto &&i : util::range_of(pages)) {
+        if (pending.size() == page_bufs.size()) {
+            write_next();
+        }
+
+        auto ref = pages[i];
+        auto &&buf = page_bufs[i % page_bufs.size()];
+
+        // Raw, texture, and cached pages need no encoding, but are queued
+        // like the others so that they are written in order.
+        util::slice verbatim_data;
+        spage::ref spage_ref = ref;
+        buf.page = spage_ref.ok() ? find_cached_page(ref.get()) : util::slice();
+        if (get_verbatim_page(ref, verbatim_data) || !buf.page.empty()) {
+            std::promise<void> done;
+            done.set_value();
+            pending.push_back(done.get_future());
+            continue;
+        }
+
+        // The page's entries are exported here, as the assets may only be
+        // read from this thread. The pool only assembles the gathered page
+        // and calculates its checksum.
+        try {
+            if (!ref)
+                throw res::export_error("nsf::archive: null page ref");
+
+            if (!spage_ref.ok())
+                throw res::export_error(
+                    "nsf::archive: page has incompatible type"
+                );
+
+            buf.deps.clear();
+            buf.contents = spage_ref->gather(&buf.deps);
+        } catch (res::export_error &) {
+            std::promise<void> failed;
+            failed.set_exception(std::current_exception());
+            pending.push_back(failed.get_future());
+            continue;
+        }
+
+        pending.push_back(pool.post([&buf]{
+            spage::assemble(buf.contents, buf.data);
+            buf.contents = {};
+            buf.encoded = true;
+        }));
+    }
+
+    while (!pending.empty()) {
+        write_next();
+    }
+
+    if (fatal_error) {
+        std::rethrow_exception(fatal_error);
+    }
+
+    if (!errors.empty())
+        throw page_export_error(std::move(errors));
+}
+
+// declared in nsf.hh
+void archive::export_to(std::ostream &out, util::thread_pool &pool) const
+{
+    export_to([&out](const util::byte *data, size_t size) {
+        out.write(reinterpret_cast<const char *>(data), size);
+    }, pool);
+}
+
+// declared in nsf.hh
+util::blob archive::export_file() const
+{
+    util::blob data;
+    data.reserve(get_pages().size() * page_size);
+
+    export_to([&data](const util::byte *page_data, size_t size) {
+        data.insert(data.end(), page_data, page_data + size);
+    });
+
+    return data;
+}
+
+// declared in nsf.hh
+archive::snapshot archive::take_snapshot() const
+{
+    assert_alive();
+
+    auto &&pages = get_pages();
+
+    snapshot snap;
+    snap.m_revision = m_revision;
+    snap.m_pages.resize(pages.size());
+
+    std::vector<page_export_error::page_error> errors;
+    for (auto &&i : util::range_of(pages)) {
+        auto &&out = snap.m_pages[i];
+
+        if (get_verbatim_page(pages[i], out.data)) {
+            out.ready = true;
+            continue;
+        }
+
+        out.data = find_cached_page(pages[i].get());
+        if (!out.data.empty()) {
+            out.ready = true;
+            continue;
+        }
+
+        try {
+            if (!pages[i])
+                throw res::export_error("nsf::archive: null page ref");
+
+            spage::ref spage_ref = pages[i];
+            if (!spage_ref.ok())
+                throw res::export_error(
+                    "nsf::archive: page has incompatible type"
+                );
+
+            out.contents = spage_ref->gather(&out.deps);
+            out.asset = spage_ref.get();
+        } catch (res::export_error &ex) {
+            errors.push_back({ int(i), ex.what() });
+        }
+    }
+
+    if (!errors.empty())
+        throw page_export_error(std::move(errors));
+
+    return snap;
+}
+
+// declared in nsf.hh
+void archive::cache_snapshot(const snapshot &snap) const
+{
+    assert_alive();
+
+    if (snap.m_revision != m_revision)
+        return;
+
+    for (auto &&page : snap.m_pages) {
+        if (page.ready || !page.asset || page.data.empty())
+            continue;
+
+        cache_page(page.asset, page.data, page.deps);
+    }
+}
+
+// declared in nsf.hh
+void archive::snapshot::export_to(const sink &out, util::progress *progress)
+{
+    if (progress) {
+        progress->set_total(m_pages.size());
+    }
+
+    util::blob buf;
+    for (auto &&page : m_pages) {
+        if (progress) {
+            progress->check();
+        }
+
+        if (!page.ready && page.data.empty()) {
+            spage::assemble(page.contents, buf);
+            page.data = std::move(buf);
+            page.contents = {};
+            buf = util::blob();
+        }
+
+        out(page.data.data(), page.data.size());
+
+        if (progress) {
+            progress->add_done();
+        }
+    }
+}
+
+// declared in nsf.hh
+archive::pack_plan archive::plan_packing() const
+{
+    assert_alive();
+
+    return plan_runs(get_pages(), [](
+        const std::vector<run_item> &items,
+        size_t run_size,
+        bool overflow) {
+        // Place each pagelet, largest first, into the first page with room.
+        std::vector<size_t> order(items.size());
+        for (auto &&i : util::range_of(order)) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return items[a].weight > items[b].weight;
+        });
+        std::vector<size_t> bin_free;
+        std::vector<std::vector<size_t>> bins;
+        for (auto &&i : order) {
+            size_t bin = 0;
+            while (bin < bins.size() && bin_free[bin] < items[i].weight) {
+                bin++;
+            }
+            if (bin == bins.size()) {
+                bins.emplace_back();
+                bin_free.push_back(pack_capacity);
+            }
+            bins[bin].push_back(i);
+            bin_free[bin] -= items[i].weight;
+        }
+
+        // Packing would not help this run, so leave it as it is.
+        if (!overflow && bins.size() >= run_size)
+            return std::vector<std::vector<size_t>>();
+
+        // Restore the original order of the pagelets within each page, and
+        // of the pages by their first pagelet. The items are already in their
+        // original order, so comparing item indices is enough.
+        for (auto &&bin : bins) {
+            std::sort(bin.begin(), bin.end());
+        }
+        std::sort(bins.begin(), bins.end());
+        return bins;
+    });
+}
+
+// declared in nsf.hh
+archive::pack_plan archive::plan_locality() const
+{
+    assert_alive();
+
+    auto &&pages = get_pages();
+    auto groups = find_load_groups(pages);
+
+    // Give each pagelet a rank: the position of the first pagelet of its load
+    // group, or its own position if it is in none. Sorting by rank gathers
+    // each group at the place its first member was, and leaves everything
+    // else in its original order.
+    std::map<eid, size_t> group_rank;
+    std::map<res::atom, size_t> ranks;
+    size_t position = 0;
+    for (auto &&page_ref : pages) {
+        spage::ref page = page_ref;
+        if (!page.ok())
+            continue;
+
+        for (auto &&pagelet : page->get_pagelets()) {
+            size_t rank = position++;
+            entry::ref ent = pagelet;
+            if (ent.ok()) {
+                auto group = groups.find(ent->get_eid());
+                if (group != groups.end()) {
+                    rank = group_rank.insert({ group->second, rank })
+                        .first->second;
+                }
+            }
+            ranks.insert({ pagelet, rank });
+        }
+    }
+
+    auto plan = plan_runs(pages, [&](
+        const std::vector<run_item> &items,
+        size_t run_size,
+        bool overflow) {
+        std::vector<size_t> order(items.size());
+        for (auto &&i : util::range_of(order)) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return ranks[items[a].ref] < ranks[items[b].ref];
+        });
+
+        // Fill the pages in order. A group which does not fit in the space
+        // left in the current page, but would fit in a page of its own, is
+        // started on a new page rather than being split.
+        std::vector<std::vector<size_t>> bins;
+        size_t bin_free = 0;
+        for (size_t i = 0; i < order.size();) {
+            size_t rank = ranks[items[order[i]].ref];
+            size_t group_end = i;
+            size_t group_weight = 0;
+            while (group_end < order.size() &&
+                ranks[items[order[group_end]].ref] == rank) {
+                group_weight += items[order[group_end]].weight;
+                group_end++;
+            }
+
+            if (group_weight > bin_free && group_weight <= pack_capacity) {
+                bin_free = 0;
+            }
+            for (; i < group_end; i++) {
+                auto weight = items[order[i]].weight;
+                if (weight > bin_free) {
+                    bins.emplace_back();
+                    bin_free = pack_capacity;
+                }
+                bins.back().push_back(order[i]);
+                bin_free -= weight;
+            }
+        }
+        return bins;
+    });
+
+    // Keep the current layout unless this is an improvement.
+    if (plan.changes_nothing())
+        return plan;
+    auto current = plan_current(pages);
+    if (estimate_page_loads(plan) >= estimate_page_loads(current))
+        return current;
+    return plan;
+}
+
+// declared in nsf.hh
+int archive::estimate_page_loads() const
+{
+    assert_alive();
+
+    return estimate_page_loads(plan_current(get_pages()));
+}
+
+// declared in nsf.hh
+int archive::estimate_page_loads(const pack_plan &plan) const
+{
+    assert_alive();
+
+    // Find which page each EID would be in after the plan is applied.
+    std::map<eid, int> page_of;
+    for (auto &&i : util::range_of(plan.pages)) {
+        auto &&page = plan.pages[i];
+        tpage::ref tpage_ref = page.ref;
+        if (tpage_ref.ok()) {
+            page_of.insert({ tpage_ref->get_eid(), i });
+        }
+        for (auto &&pagelet : page.pagelets) {
+            entry::ref ent = pagelet;
+            if (ent.ok()) {
+                page_of.insert({ ent->get_eid(), i });
+            }
+        }
+    }
+
+    // Count the distinct pages holding each group's members.
+    std::map<eid, std::set<int>> group_pages;
+    for (auto &&member : find_load_groups(get_pages())) {
+        auto page = page_of.find(member.first);
+        if (page != page_of.end()) {
+            group_pages[member.second].insert(page->second);
+        }
+    }
+
+    int loads = 0;
+    for (auto &&group : group_pages) {
+        loads += group.second.size();
+    }
+    return loads;
+}
+
+// declared in nsf.hh
+void archive::apply_packing(TRANSACT, const pack_plan &plan)
+{
+    assert_alive();
+
+    auto &&old_pages = get_pages();
+    if (plan.pages_before != int(old_pages.size()))
+        throw std::logic_error("nsf::archive::apply_packing: stale plan");
+
+    std::map<res::atom, int> old_indices;
+    for (auto &&i : util::range_of(old_pages)) {
+        old_indices.insert({ old_pages[i], i });
+    }
+
+    // Create any new pages, under names not already in use.
+    std::vector<res::anyref> page_refs(plan.pages.size());
+    int next_name = old_pages.size();
+    for (auto &&i : util::range_of(plan.pages)) {
+        auto &&page = plan.pages[i];
+        if (page.ref) {
+            page_refs[i] = page.ref;
+            continue;
+        }
+
+        res::atom name;
+        do {
+            name = get_name() / "page-$"_fmt(next_name++);
+        } while (name.get());
+
+        spage::ref spage = name;
+        spage.create(TS, get_proj());
+        spage->set_type(TS, page.type);
+        page_refs[i] = spage;
+    }
+
+    // Move each pagelet which is not already at its new name. This is done in
+    // two steps, through a temporary name, so that a pagelet is never renamed
+    // onto one which has not been moved out of the way yet.
+    std::vector<std::pair<res::asset *, res::atom>> moves;
+    for (auto &&i : util::range_of(plan.pages)) {
+        auto &&page = plan.pages[i];
+        if (!page.is_spage)
+            continue;
+
+        for (auto &&j : util::range_of(page.pagelets)) {
+            auto target = page_refs[i] / "pagelet-$"_fmt(j);
+            if (page.pagelets[j] == target)
+                continue;
+
+            auto asset = page.pagelets[j].get();
+            if (!asset) {
+                throw std::logic_error(
+                    "nsf::archive::apply_packing: pagelet does not exist"
+                );
+            }
+            asset->rename(TS, get_name() / "_PACK" / "$"_fmt(moves.size()));
+            moves.push_back({ asset, target });
+        }
+    }
+    for (auto &&move : moves) {
+        move.first->rename(TS, move.second);
+    }
+
+    // Set each standard page's pagelets, and update the CIDs which were
+    // derived from the page's index.
+    for (auto &&i : util::range_of(plan.pages)) {
+        auto &&page = plan.pages[i];
+        if (!page.is_spage)
+            continue;
+
+        spage::ref spage = page_refs[i];
+        std::vector<res::anyref> pagelets(page.pagelets.size());
+        for (auto &&j : util::range_of(pagelets)) {
+            pagelets[j] = page_refs[i] / "pagelet-$"_fmt(j);
+        }
+        if (spage->get_pagelets() != pagelets) {
+            spage->set_pagelets(TS, std::move(pagelets));
+        }
+
+        auto old_index = old_indices.find(page_refs[i]);
+        bool index_cid = old_index == old_indices.end() ||
+            spage->get_cid() == ((uint32_t(old_index->second) << 1) | 1);
+        uint32_t cid = (uint32_t(i) << 1) | 1;
+        if (index_cid && spage->get_cid() != cid) {
+            spage->set_cid(TS, cid);
+        }
+    }
+
+    // Remove the pages left empty.
+    for (auto &&page : plan.removed_pages) {
+        if (auto asset = page.get()) {
+            asset->destroy(TS);
+        }
+    }
+
+    set_pages(TS, std::move(page_refs));
+}
+
+// (s-var) g_archive_file_type
+// Allows `nsf::archive' assets to be stored in project files.
+static res::file_type_of<archive> g_archive_file_type;
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_archive, PackPages)
+{
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+
+    // Creates a standard page at the given index holding raw pagelets of the
+    // given sizes. Each pagelet is filled with its size so it can be told
+    // apart after moving.
+    auto make_spage = [&](TRANSACT, int index, std::vector<size_t> sizes) {
+        spage::ref page = nsf / "page-$"_fmt(index);
+        page.create(TS, proj);
+        std::vector<res::anyref> pagelets;
+        for (auto &&j : util::range_of(sizes)) {
+            misc::raw_data::ref pagelet = page / "pagelet-$"_fmt(j);
+            pagelet.create(TS, proj);
+            pagelet->set_data(TS, util::blob(sizes[j], sizes[j] / 1000));
+            pagelets.push_back(pagelet);
+        }
+        page->set_cid(TS, (index << 1) | 1);
+        page->set_pagelets(TS, std::move(pagelets));
+        return res::anyref(page);
+    };
+
+    // The first two pages are over 64K together and must be repacked, while
+    // the last two fit in a single page. The raw page between them keeps the
+    // runs apart.
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+        misc::raw_data::ref raw = nsf / "page-2";
+        raw.create(TS, proj);
+        raw->set_data(TS, util::blob(page_size));
+        nsf->set_pages(TS, {
+            make_spage(TS, 0, { 40000, 30000 }),
+            make_spage(TS, 1, { 10000 }),
+            raw,
+            make_spage(TS, 3, { 1000 }),
+            make_spage(TS, 4, { 2000 })
+        });
+    });
+    EXPECT_THROW(nsf->export_file(), res::export_error);
+
+    auto plan = nsf->plan_packing();
+    EXPECT_EQ(plan.pages_before, 5);
+    ASSERT_EQ(plan.pages.size(), 4u);
+    EXPECT_EQ(plan.pagelets_moved, 3);
+    ASSERT_EQ(plan.removed_pages.size(), 1u);
+    EXPECT_EQ(plan.removed_pages[0], nsf / "page-4");
+    EXPECT_TRUE(plan.overflow);
+
+    proj.get_transact().run([&](TRANSACT) {
+        nsf->apply_packing(TS, plan);
+    });
+
+    auto &&pages = nsf->get_pages();
+    ASSERT_EQ(pages.size(), 4u);
+    EXPECT_FALSE((nsf / "page-4").get());
+
+    // Returns the sizes of the pagelets in the given page, checking that
+    // each is named after its position.
+    auto sizes_of = [&](int index) {
+        spage::ref page = pages[index];
+        std::vector<size_t> sizes;
+        for (auto &&j : util::range_of(page->get_pagelets())) {
+            misc::raw_data::ref pagelet = page->get_pagelets()[j];
+            EXPECT_EQ(pagelet, page / "pagelet-$"_fmt(j));
+            sizes.push_back(pagelet->get_data().size());
+            EXPECT_EQ(pagelet->get_data()[0], sizes.back() / 1000);
+        }
+        return sizes;
+    };
+    EXPECT_EQ(sizes_of(0), (std::vector<size_t>{ 40000, 10000 }));
+    EXPECT_EQ(sizes_of(1), (std::vector<size_t>{ 30000 }));
+    EXPECT_EQ(sizes_of(3), (std::vector<size_t>{ 1000, 2000 }));
+    EXPECT_EQ(spage::ref(pages[3])->get_cid(), 7u);
+
+    EXPECT_EQ(nsf->export_file().size(), 4 * page_size);
+    EXPECT_EQ(nsf->plan_packing().pagelets_moved, 0);
+    EXPECT_FALSE(nsf->plan_packing().overflow);
+}
+
+TEST(nsf_archive, PackPagesTooLarge)
+{
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+        spage::ref page = nsf / "page-0";
+        page.create(TS, proj);
+        misc::raw_data::ref pagelet = page / "pagelet-0";
+        pagelet.create(TS, proj);
+        pagelet->set_data(TS, util::blob(page_size));
+        page->set_pagelets(TS, { pagelet });
+        nsf->set_pages(TS, { page });
+    });
+    EXPECT_THROW(nsf->plan_packing(), res::export_error);
+}
+
+TEST(nsf_archive, PlanLocality)
+{
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+
+    // Two scenery entries which use the same texture page are split across
+    // two pages by large unrelated pagelets.
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+
+        auto make_scenery = [&](res::atom name, eid id) {
+            wgeo_v2::ref scenery = name;
+            scenery.create(TS, proj);
+            scenery->set_eid(TS, id);
+            wgeo_v2::decoded d = {};
+            d.tpag_ref_count = 1;
+            d.tpag_refs[0] = 0x1234;
+            scenery->import_decoded(TS, std::move(d));
+            return res::anyref(scenery);
+        };
+        auto make_raw = [&](res::atom name, size_t size) {
+            misc::raw_data::ref raw = name;
+            raw.create(TS, proj);
+            raw->set_data(TS, util::blob(size));
+            return res::anyref(raw);
+        };
+
+        spage::ref page0 = nsf / "page-0";
+        page0.create(TS, proj);
+        page0->set_pagelets(TS, {
+            make_scenery(page0 / "pagelet-0", 0x10),
+            make_raw(page0 / "pagelet-1", 40000)
+        });
+        spage::ref page1 = nsf / "page-1";
+        page1.create(TS, proj);
+        page1->set_pagelets(TS, {
+            make_raw(page1 / "pagelet-0", 40000),
+            make_scenery(page1 / "pagelet-1", 0x20)
+        });
+        nsf->set_pages(TS, { page0, page1 });
+    });
+    EXPECT_EQ(nsf->estimate_page_loads(), 2);
+
+    // Packing alone has nothing to do, but gathering the scenery into one
+    // page halves the estimated loads.
+    EXPECT_TRUE(nsf->plan_packing().changes_nothing());
+    auto plan = nsf->plan_locality();
+    EXPECT_FALSE(plan.changes_nothing());
+    EXPECT_EQ(nsf->estimate_page_loads(plan), 1);
+
+    proj.get_transact().run([&](TRANSACT) {
+        nsf->apply_packing(TS, plan);
+    });
+    EXPECT_EQ(nsf->estimate_page_loads(), 1);
+    EXPECT_EQ(nsf->find_page_index(0x10), nsf->find_page_index(0x20));
+    EXPECT_TRUE(nsf->plan_locality().changes_nothing());
+    EXPECT_EQ(nsf->export_file().size(), 2 * page_size);
+}
+
+TEST(nsf_archive, DecodeBadChecksum)
+{
+    // A texture page, which is decoded without parsing its contents.
+    util::blob data(page_size);
+    data[2] = 1;
+    data[100] = 0xAB;
+    auto checksum = calculate_page_checksum(data.data());
+    data[12] = checksum;
+    data[13] = checksum >> 8;
+    data[14] = checksum >> 16;
+    data[15] = checksum >> 24;
+
+    util::thread_pool pool(2);
+    EXPECT_NO_THROW(archive::decode_pages(data, game_ver::crash2, pool, true));
+
+    // A page which no longer matches its checksum is only rejected when the
+    // checksums are verified.
+    data[100]++;
+    EXPECT_NO_THROW(archive::decode_pages(data, game_ver::crash2, pool));
+    EXPECT_THROW(
+        archive::decode_pages(data, game_ver::crash2, pool, true),
+        res::import_error
+    );
+}
+
+TEST(nsf_archive, ImportCrash1)
+{
+    // A Crash 1 file whose only page is compressed and holds a type 3 entry,
+    // which is not the wgeo_v2 data it would be in Crash 2.
+    res::project src_proj;
+    archive::ref src = src_proj.get_asset_root() / "nsfile";
+    src_proj.get_transact().run([&](TRANSACT) {
+        src.create(TS, src_proj);
+        spage::ref page = src / "page-0";
+        page.create(TS, src_proj);
+        raw_entry::ref entry = page / "pagelet-0";
+        entry.create(TS, src_proj);
+        entry->set_eid(TS, 0x1234567);
+        entry->set_type(TS, 3);
+        entry->set_items(TS, { util::blob(40, 1), util::blob(12, 2) });
+        page->set_cid(TS, 1);
+        page->set_pagelets(TS, { entry });
+        src->set_pages(TS, { page });
+    });
+    auto page_data = src->export_file();
+    auto data = compress_page(page_data.data());
+    EXPECT_EQ(detect_game_ver(data), game_ver::crash1);
+
+    // The entry is left unprocessed, and the file exports as it was, but
+    // uncompressed.
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+        nsf->import_and_process(TS, data, detect_game_ver(data));
+    });
+    raw_entry::ref entry = nsf->find_entry(0x1234567);
+    ASSERT_TRUE(entry.ok());
+    EXPECT_EQ(entry->get_type(), 3u);
+    EXPECT_EQ(nsf->export_file(), page_data);
+
+    // Importing it as Crash 2 would try to read the entry as wgeo_v2.
+    res::project proj2;
+    archive::ref nsf2 = proj2.get_asset_root() / "nsfile";
+    EXPECT_THROW(
+        proj2.get_transact().run([&](TRANSACT) {
+            nsf2.create(TS, proj2);
+            nsf2->import_and_process(TS, data, game_ver::crash2);
+        }),
+        res::import_error
+    );
+}
+
+TEST(nsf_archive, DecodeProgress)
+{
+    // Two texture pages, which are decoded without parsing their contents.
+    util::blob data(page_size * 2);
+    data[2] = 1;
+    data[page_size + 2] = 1;
+
+    util::thread_pool pool(2);
+    util::progress progress;
+    auto pages = archive::decode_pages(
+        data,
+        game_ver::crash2,
+        pool,
+        false,
+        &progress
+    );
+    EXPECT_EQ(pages.size(), 2u);
+    EXPECT_EQ(progress.get_total(), 2);
+    EXPECT_EQ(progress.get_done(), 2);
+
+    progress.cancel();
+    EXPECT_THROW(
+        archive::decode_pages(data, game_ver::crash2, pool, false, &progress),
+        util::cancelled_error
+    );
+}
+
+TEST(nsf_archive, LookupTable)
+{
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+
+        // A standard page holding an entry and an unprocessed pagelet.
+        spage::ref page = nsf / "page-0";
+        page.create(TS, proj);
+        raw_entry::ref entry = page / "pagelet-0";
+        entry.create(TS, proj);
+        entry->set_eid(TS, 0x00018001);
+        misc::raw_data::ref raw = page / "pagelet-1";
+        raw.create(TS, proj);
+        raw->set_data(TS, util::blob{ 0xFF, 0xFF, 0, 1, 0x01, 0xA0, 0x01, 0 });
+        page->set_pagelets(TS, { entry, raw });
+
+        // An unprocessed texture page.
+        misc::raw_data::ref tex = nsf / "page-1";
+        tex.create(TS, proj);
+        util::blob tex_data(page_size);
+        tex_data[2] = 1;
+        tex_data[4] = 0x01;
+        tex_data[6] = 0x7F;
+        tex->set_data(TS, std::move(tex_data));
+
+        nsf->set_pages(TS, { page, tex });
+    });
+
+    auto table = nsf->build_lookup_table();
+    EXPECT_EQ(table.get_links().size(), 3u);
+    ASSERT_NE(table.find(0x00018001), nullptr);
+    EXPECT_EQ(table.find(0x00018001)->cid, 1u);
+    ASSERT_NE(table.find(0x00018001 + 0x2000), nullptr);
+    EXPECT_EQ(table.find(0x00018001 + 0x2000)->cid, 1u);
+    ASSERT_NE(table.find(0x007F0001), nullptr);
+    EXPECT_EQ(table.find(0x007F0001)->cid, 3u);
+}
+
+TEST(nsf_archive, DecodeFilesShared)
+{
+    // Creates an NSF file with a single standard page holding a raw entry for
+    // each of the given EIDs. Each entry's one item is filled with its EID.
+    auto make_file = [](std::vector<uint32_t> eids) {
+        res::project proj;
+        archive::ref nsf = proj.get_asset_root() / "nsfile";
+        proj.get_transact().run([&](TRANSACT) {
+            nsf.create(TS, proj);
+            spage::ref page = nsf / "page-0";
+            page.create(TS, proj);
+            std::vector<res::anyref> pagelets;
+            for (auto &&i : util::range_of(eids)) {
+                raw_entry::ref entry = page / "pagelet-$"_fmt(i);
+                entry.create(TS, proj);
+                entry->set_eid(TS, eids[i]);
+                entry->set_type(TS, 20);
+                entry->set_items(TS, { util::blob(64, eids[i] & 0xFF) });
+                pagelets.push_back(entry);
+            }
+            page->set_cid(TS, 1);
+            page->set_pagelets(TS, std::move(pagelets));
+            nsf->set_pages(TS, { page });
+        });
+        return util::slice(nsf->export_file());
+    };
+    std::vector<util::slice> files = {
+        make_file({ 0x11, 0x21 }),
+        make_file({ 0x31, 0x21 })
+    };
+
+    util::thread_pool pool(2);
+    auto decoded = archive::decode_files(files, game_ver::crash1, pool);
+    ASSERT_EQ(decoded.size(), 2u);
+    auto &&originals = decoded[1][0].originals;
+    ASSERT_EQ(originals.size(), 2u);
+    EXPECT_EQ(originals[0].file, -1);
+    EXPECT_EQ(originals[1].file, 0);
+    EXPECT_EQ(originals[1].page, 0);
+    EXPECT_EQ(originals[1].pagelet, 1);
+
+    // The shared entry refers to the original's data, and both files still
+    // export as they were.
+    res::project proj;
+    std::vector<res::atom> names = {
+        proj.get_asset_root() / "a",
+        proj.get_asset_root() / "b"
+    };
+    proj.get_transact().run([&](TRANSACT) {
+        for (auto &&i : util::range_of(names)) {
+            archive::ref nsf = names[i];
+            nsf.create(TS, proj);
+            nsf->import_decoded(TS, std::move(decoded[i]), names);
+        }
+    });
+    raw_entry::ref orig = names[0] / "page-0" / "pagelet-1";
+    raw_entry::ref shared = names[1] / "page-0" / "pagelet-1";
+    ASSERT_TRUE(shared.ok());
+    EXPECT_EQ(shared->get_eid(), 0x21u);
+    EXPECT_EQ(
+        shared->get_items()[0].data(),
+        orig->get_items()[0].data()
+    );
+    for (auto &&i : util::range_of(names)) {
+        archive::ref nsf = names[i];
+        EXPECT_EQ(util::slice(nsf->export_file()), files[i]);
+    }
+}
+
+TEST(nsf_archive, Snapshot)
+{
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+    misc::raw_data::ref pagelet = nsf / "page-0" / "pagelet-0";
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+        std::vector<res::anyref> pages;
+        for (int i = 0; i < 2; i++) {
+            spage::ref page = nsf / "page-$"_fmt(i);
+            page.create(TS, proj);
+            misc::raw_data::ref raw = page / "pagelet-0";
+            raw.create(TS, proj);
+            raw->set_data(TS, util::blob(100 + i, i));
+            page->set_cid(TS, (i << 1) | 1);
+            page->set_pagelets(TS, { raw });
+            pages.push_back(page);
+        }
+        nsf->set_pages(TS, std::move(pages));
+    });
+
+    // Exporting a snapshot gives the same file as a direct export, and the
+    // assembled pages are cached afterwards.
+    auto snap = nsf->take_snapshot();
+    EXPECT_EQ(snap.get_page_count(), 2);
+    util::blob data;
+    util::progress progress;
+    snap.export_to([&](const util::byte *page_data, size_t size) {
+        data.insert(data.end(), page_data, page_data + size);
+    }, &progress);
+    EXPECT_EQ(progress.get_done(), 2);
+    EXPECT_EQ(nsf->get_cached_page_count(), 0);
+    nsf->cache_snapshot(snap);
+    EXPECT_EQ(nsf->get_cached_page_count(), 2);
+    EXPECT_EQ(data, nsf->export_file());
+
+    // A snapshot taken before an edit is not cached.
+    auto old_snap = nsf->take_snapshot();
+    proj.get_transact().run([&](TRANSACT) {
+        pagelet->set_data(TS, util::blob(50, 7));
+    });
+    EXPECT_EQ(nsf->get_cached_page_count(), 1);
+    old_snap.export_to([](const util::byte *, size_t) {});
+    nsf->cache_snapshot(old_snap);
+    EXPECT_EQ(nsf->get_cached_page_count(), 1);
+}
+
+TEST(nsf_archive, ExportCacheLimit)
+{
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+        std::vector<res::anyref> pages;
+        for (int i = 0; i < 4; i++) {
+            spage::ref page = nsf / "page-$"_fmt(i);
+            page.create(TS, proj);
+            misc::raw_data::ref raw = page / "pagelet-0";
+            raw.create(TS, proj);
+            raw->set_data(TS, util::blob(100 + i, i));
+            page->set_cid(TS, (i << 1) | 1);
+            page->set_pagelets(TS, { raw });
+            pages.push_back(page);
+        }
+        nsf->set_pages(TS, std::move(pages));
+    });
+    auto data = nsf->export_file();
+    EXPECT_EQ(nsf->get_cached_page_count(), 4);
+
+    // Only the most recently exported pages are kept within the limit, and
+    // the export is the same whether the pages are cached or not.
+    nsf->set_export_cache_limit(2 * page_size);
+    EXPECT_EQ(nsf->get_cached_page_count(), 2);
+    EXPECT_EQ(nsf->get_export_cache_size(), 2 * page_size);
+    EXPECT_EQ(nsf->export_file(), data);
+    EXPECT_EQ(nsf->get_cached_page_count(), 2);
+
+    nsf->set_export_cache_limit(page_size);
+    util::thread_pool pool(2);
+    util::blob parallel_data;
+    nsf->export_to([&](const util::byte *page_data, size_t size) {
+        parallel_data.insert(parallel_data.end(), page_data, page_data + size);
+    }, pool);
+    EXPECT_EQ(parallel_data, data);
+    EXPECT_EQ(nsf->get_cached_page_count(), 1);
+
+    // A limit of zero disables the cache.
+    nsf->set_export_cache_limit(0);
+    EXPECT_EQ(nsf->get_cached_page_count(), 0);
+    EXPECT_EQ(nsf->export_file(), data);
+    EXPECT_EQ(nsf->get_cached_page_count(), 0);
+}
+
+TEST(nsf_archive, ProjectFile)
+{
+    res::project proj;
+    archive::ref nsf = proj.get_asset_root() / "nsfile";
+    spage::ref page = nsf / "page-0";
+    raw_entry::ref entry = page / "pagelet-0";
+    proj.get_transact().run([&](TRANSACT) {
+        nsf.create(TS, proj);
+        page.create(TS, proj);
+        entry.create(TS, proj);
+        entry->set_eid(TS, 0x1234567);
+        entry->set_type(TS, 3);
+        entry->set_items(TS, { util::blob{ 4, 5 }, util::blob{} });
+        page->set_pagelets(TS, { entry });
+        nsf->set_pages(TS, { page });
+    });
+
+    std::ostringstream out;
+    res::save_project(proj, out);
+    auto str = out.str();
+    util::slice data = util::blob(str.begin(), str.end());
+
+    // The archive indexes the entries by their loaded EIDs, not the defaults
+    // they had when they were created.
+    res::project proj2;
+    archive::ref nsf2 = proj2.get_asset_root() / "nsfile";
+    proj2.get_transact().run([&](TRANSACT) {
+        res::load_project(TS, proj2, data);
+    });
+    ASSERT_TRUE(nsf2.ok());
+    EXPECT_EQ(nsf2->find_entry(0x1234567), nsf2 / "page-0" / "pagelet-0");
+    EXPECT_EQ(nsf2->find_page_index(0x1234567), 0);
+
+    raw_entry::ref entry2 = nsf2 / "page-0" / "pagelet-0";
+    ASSERT_TRUE(entry2.ok());
+    EXPECT_EQ(entry2->get_type(), 3u);
+    ASSERT_EQ(entry2->get_items().size(), 2u);
+    EXPECT_EQ(entry2->get_items()[0].to_blob(), (util::blob{ 4, 5 }));
+    EXPECT_TRUE(entry2->get_items()[1].empty());
+}
+
 }
+#endif
 
 }
 }
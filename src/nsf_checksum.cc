@@ -0,0 +1,137 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+// declared in nsf.hh
+uint32_t calculate_page_checksum(const util::byte *data)
+{
+    // For each byte of the page, the byte is added to the checksum and then
+    // the checksum is rotated left by three bits. The carries out of each
+    // addition depend on every byte before it, so the bytes cannot be summed
+    // in independent lanes; the best that can be done is to keep each step to
+    // one add and one rotate and unroll the loop around them.
+    uint32_t checksum = 0x12345678;
+    auto step = [&checksum](uint32_t value) {
+        checksum += value;
+        checksum = (checksum << 3) | (checksum >> 29);
+    };
+
+    for (size_t i = 0; i < 12; i++) {
+        step(data[i]);
+    }
+
+    // Bytes 12 to 15 hold the checksum itself, so they are not added, but
+    // the checksum is still rotated for each of them.
+    checksum = (checksum << 12) | (checksum >> 20);
+
+    for (size_t i = 16; i < page_size; i += 8) {
+        step(data[i + 0]);
+        step(data[i + 1]);
+        step(data[i + 2]);
+        step(data[i + 3]);
+        step(data[i + 4]);
+        step(data[i + 5]);
+        step(data[i + 6]);
+        step(data[i + 7]);
+    }
+
+    return checksum;
+}
+
+// declared in nsf.hh
+bool verify_page_checksum(const util::slice &data)
+{
+    if (data.size() != page_size)
+        return false;
+
+    uint32_t stored_checksum =
+        data[12] | data[13] << 8 | data[14] << 16 | uint32_t(data[15]) << 24;
+
+    return stored_checksum == calculate_page_checksum(data.data());
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (internal func) reference_checksum
+// A straightforward byte-at-a-time version of the page checksum, to check the
+// unrolled version against.
+uint32_t reference_checksum(const util::blob &data)
+{
+    uint32_t checksum = 0x12345678;
+    for (size_t i = 0; i < data.size(); i++) {
+        if (i < 12 || i >= 16) {
+            checksum += data[i];
+        }
+        checksum = (checksum << 3) | (checksum >> 29);
+    }
+    return checksum;
+}
+
+TEST(nsf_checksum, ZeroPage)
+{
+    // With every byte zero, the checksum is only rotated 3 bits per byte for
+    // 64K bytes, which is a whole number of full rotations.
+    util::blob data(page_size);
+    EXPECT_EQ(calculate_page_checksum(data.data()), 0x12345678u);
+}
+
+TEST(nsf_checksum, MatchesReference)
+{
+    util::blob data(page_size);
+    uint32_t seed = 1;
+    for (auto &&b : data) {
+        seed = seed * 1103515245 + 12345;
+        b = seed >> 16;
+    }
+    EXPECT_EQ(calculate_page_checksum(data.data()), reference_checksum(data));
+}
+
+TEST(nsf_checksum, Verify)
+{
+    util::blob data(page_size);
+    data[0] = 0x34;
+    data[1] = 0x12;
+    data[100] = 0xAB;
+    auto checksum = calculate_page_checksum(data.data());
+    data[12] = checksum;
+    data[13] = checksum >> 8;
+    data[14] = checksum >> 16;
+    data[15] = checksum >> 24;
+    EXPECT_EQ(calculate_page_checksum(data.data()), checksum);
+    EXPECT_TRUE(verify_page_checksum(data));
+
+    data[100]++;
+    EXPECT_FALSE(verify_page_checksum(data));
+
+    data.pop_back();
+    EXPECT_FALSE(verify_page_checksum(data));
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,359 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "common.hh"
+#include <cstring>
+#include <algorithm>
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+namespace {
+
+// (internal const) compressed_header_size
+// The size of the header of a compressed page.
+constexpr size_t compressed_header_size = 12;
+
+// (internal const) max_seek
+// The greatest distance back into the output which a back-reference can copy
+// from, being the largest 12-bit value.
+constexpr size_t max_seek = 4095;
+
+// (internal const) max_span
+// The greatest number of bytes which a single back-reference can copy.
+constexpr size_t max_span = 64;
+
+// (internal const) max_literals
+// The greatest number of literal bytes which can follow a single prefix.
+constexpr size_t max_literals = 127;
+
+// (internal const) hash_bits
+// The number of bits in the hash of three bytes used by `compress_page' to
+// find earlier occurrences of the same bytes.
+constexpr int hash_bits = 13;
+
+// (internal const) max_probes
+// The number of earlier occurrences `compress_page' tries for each position.
+// More probes find longer matches at the cost of speed.
+constexpr int max_probes = 32;
+
+// (internal func) read_u32
+// Reads a little-endian 32-bit value.
+inline uint32_t read_u32(const util::byte *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+// (internal func) write_u32
+// Writes a little-endian 32-bit value.
+inline void write_u32(util::byte *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// (internal func) hash3
+// Hashes the three bytes at `p'.
+inline uint32_t hash3(const util::byte *p)
+{
+    uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+}
+
+// declared in nsf.hh
+bool is_compressed_page(const util::slice &data)
+{
+    return data.size() >= 2 && data[0] == 0x35 && data[1] == 0x12;
+}
+
+// declared in nsf.hh
+game_ver detect_game_ver(const util::slice &data)
+{
+    // Uncompressed pages are always 64K, so the start of each page is known
+    // up to the first compressed one.
+    for (size_t offset = 0; offset < data.size(); offset += page_size) {
+        if (is_compressed_page(data.sub(offset, data.size() - offset)))
+            return game_ver::crash1;
+    }
+    return game_ver::crash2;
+}
+
+// declared in nsf.hh
+util::blob decompress_page(const util::slice &data, size_t &out_size)
+{
+    if (!is_compressed_page(data))
+        throw res::import_error("nsf::decompress_page: not compressed");
+
+    if (data.size() < compressed_header_size)
+        throw res::import_error("nsf::decompress_page: truncated header");
+
+    const util::byte *in = data.data();
+    size_t in_size = data.size();
+    uint32_t length = read_u32(in + 4);
+    uint32_t skip = read_u32(in + 8);
+
+    if (length > page_size)
+        throw res::import_error("nsf::decompress_page: bad length");
+
+    util::blob result(page_size);
+    util::byte *out = result.data();
+    size_t pos = compressed_header_size;
+    size_t i = 0;
+    while (i < length) {
+        if (pos >= in_size)
+            throw res::import_error("nsf::decompress_page: truncated data");
+
+        unsigned int prefix = in[pos++];
+        if (prefix & 0x80) {
+            if (pos >= in_size)
+                throw res::import_error("nsf::decompress_page: truncated data");
+
+            unsigned int next = in[pos++];
+            size_t seek = (prefix & 0x7F) << 5 | next >> 3;
+            size_t span = next & 7;
+            span = (span == 7) ? max_span : span + 3;
+
+            if (seek == 0 || seek > i)
+                throw res::import_error("nsf::decompress_page: bad seek");
+
+            if (span > page_size - i)
+                throw res::import_error("nsf::decompress_page: overrun");
+
+            // The bytes copied may overlap the bytes being written, in which
+            // case the last `seek' bytes repeat, so they must be copied one at
+            // a time.
+            const util::byte *src = out + i - seek;
+            if (seek >= span) {
+                std::memcpy(out + i, src, span);
+            } else {
+                for (size_t j = 0; j < span; j++) {
+                    out[i + j] = src[j];
+                }
+            }
+            i += span;
+        } else {
+            if (prefix > in_size - pos)
+                throw res::import_error("nsf::decompress_page: truncated data");
+
+            if (prefix > page_size - i)
+                throw res::import_error("nsf::decompress_page: overrun");
+
+            std::memcpy(out + i, in + pos, prefix);
+            pos += prefix;
+            i += prefix;
+        }
+    }
+
+    // Copy the uncompressed remainder of the page, after the skipped bytes.
+    size_t tail = page_size - length;
+    if (skip > in_size - pos || tail > in_size - pos - skip)
+        throw res::import_error("nsf::decompress_page: truncated data");
+
+    pos += skip;
+    std::memcpy(out + length, in + pos, tail);
+    out_size = pos + tail;
+    return result;
+}
+
+// declared in nsf.hh
+util::blob compress_page(const util::byte *data)
+{
+    // The most recent position of each hash of three bytes, and the previous
+    // position with the same hash as each position, or -1 if there is none.
+    std::vector<int32_t> head(1 << hash_bits, -1);
+    std::vector<int32_t> prev(page_size, -1);
+    auto insert = [&](size_t i) {
+        if (i + 3 <= page_size) {
+            auto &&h = head[hash3(data + i)];
+            prev[i] = h;
+            h = i;
+        }
+    };
+
+    util::blob out(compressed_header_size);
+    out.reserve(page_size + compressed_header_size);
+
+    // Literal bytes are held back until the next back-reference, so that the
+    // bytes after the last one can be stored as the uncompressed remainder.
+    size_t literal_start = 0;
+    auto flush_literals = [&](size_t end) {
+        while (literal_start < end) {
+            size_t count = std::min(max_literals, end - literal_start);
+            out.push_back(count);
+            out.insert(
+                out.end(),
+                data + literal_start,
+                data + literal_start + count
+            );
+            literal_start += count;
+        }
+    };
+
+    size_t i = 0;
+    while (i + 3 <= page_size) {
+        // Find the longest earlier occurrence of the bytes at this position
+        // within reach of a back-reference.
+        size_t best_len = 0;
+        size_t best_seek = 0;
+        size_t max_len = std::min(max_span, page_size - i);
+        int probes = 0;
+        for (int32_t c = head[hash3(data + i)];
+            c >= 0 && i - c <= max_seek && probes < max_probes;
+            c = prev[c], probes++) {
+            size_t len = 0;
+            while (len < max_len && data[c + len] == data[i + len]) {
+                len++;
+            }
+            if (len > best_len) {
+                best_len = len;
+                best_seek = i - c;
+                if (len == max_len)
+                    break;
+            }
+        }
+
+        // Spans of 10 to 63 bytes cannot be written, so the first 9 bytes of
+        // such a match are taken and the rest is found again from the next
+        // position.
+        size_t span = std::min<size_t>(best_len, 9);
+        if (best_len >= max_span) {
+            span = max_span;
+        }
+        if (span < 3) {
+            insert(i);
+            i++;
+            continue;
+        }
+
+        flush_literals(i);
+        unsigned int span_code = (span == max_span) ? 7 : span - 3;
+        out.push_back(0x80 | best_seek >> 5);
+        out.push_back((best_seek & 0x1F) << 3 | span_code);
+        for (size_t j = 0; j < span; j++) {
+            insert(i + j);
+        }
+        i += span;
+        literal_start = i;
+    }
+
+    // Write the header, then the rest of the page uncompressed.
+    out[0] = 0x35;
+    out[1] = 0x12;
+    out[2] = 0;
+    out[3] = 0;
+    write_u32(&out[4], literal_start);
+    write_u32(&out[8], 0);
+    out.insert(out.end(), data + literal_start, data + page_size);
+    return out;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_compress, Decompress)
+{
+    // "abc", then 5 bytes from 3 back, then a 2-byte uncompressed remainder
+    // after 1 skipped byte.
+    util::blob data = {
+        0x35, 0x12, 0, 0,
+        8, 0, 0, 0,
+        1, 0, 0, 0,
+        3, 'a', 'b', 'c',
+        0x80, (3 << 3) | 2,
+        0xEE,
+        0xFF, 0xFF
+    };
+    util::blob tail(page_size - 8 - 2, 0x55);
+    data.insert(data.end() - 2, tail.begin(), tail.end());
+    data.push_back(0x99);
+
+    size_t size;
+    auto page = decompress_page(data, size);
+    EXPECT_EQ(size, data.size() - 1);
+    ASSERT_EQ(page.size(), page_size);
+    EXPECT_EQ(std::string(page.begin(), page.begin() + 8), "abcabcab");
+    EXPECT_EQ(page[8], 0x55);
+    EXPECT_EQ(page[page_size - 1], 0xFF);
+}
+
+TEST(nsf_compress, RoundTrip)
+{
+    util::blob page(page_size);
+    for (auto &&i : util::range_of(page)) {
+        page[i] = (i % 1000 < 500) ? (i * 7) % 13 : (i * 2654435761u) >> 24;
+    }
+
+    auto compressed = compress_page(page.data());
+    EXPECT_LT(compressed.size(), page_size);
+    EXPECT_TRUE(is_compressed_page(compressed));
+
+    size_t size;
+    EXPECT_EQ(decompress_page(compressed, size), page);
+    EXPECT_EQ(size, compressed.size());
+}
+
+TEST(nsf_compress, DetectGameVer)
+{
+    util::blob page(page_size);
+    page[0] = 0x34;
+    page[1] = 0x12;
+    auto compressed = compress_page(page.data());
+
+    util::blob data = page;
+    EXPECT_EQ(detect_game_ver(data), game_ver::crash2);
+
+    // A compressed page after an uncompressed one.
+    data.insert(data.end(), compressed.begin(), compressed.end());
+    EXPECT_EQ(detect_game_ver(data), game_ver::crash1);
+    EXPECT_EQ(detect_game_ver({}), game_ver::crash2);
+}
+
+TEST(nsf_compress, DecompressErrors)
+{
+    util::blob data = { 0x35, 0x12, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0 };
+    size_t size;
+
+    // A back-reference to before the start of the page.
+    auto bad_seek = data;
+    bad_seek.insert(bad_seek.end(), { 0x80, 1 << 3 });
+    EXPECT_THROW(decompress_page(bad_seek, size), res::import_error);
+
+    // Data which ends before the page does.
+    auto truncated = data;
+    truncated.insert(truncated.end(), { 4, 1, 2, 3, 4 });
+    EXPECT_THROW(decompress_page(truncated, size), res::import_error);
+
+    EXPECT_THROW(
+        decompress_page(util::blob(page_size), size),
+        res::import_error
+    );
+}
+
+}
+#endif
+
+}
+}
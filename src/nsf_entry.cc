@@ -59,5 +59,20 @@ util::blob entry::export_file() const
     return data;
 }
 
+// declared in nsf.hh
+size_t entry::export_size() const
+{
+    assert_alive();
+
+    uint32_t type;
+    auto items = export_entry(type);
+
+    size_t item_bytes = 0;
+    for (auto &&item : items) {
+        item_bytes += item.size();
+    }
+    return calculate_size(items.size(), item_bytes);
+}
+
 }
 }
@@ -0,0 +1,125 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "common.hh"
+#include <algorithm>
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+// declared in nsf.hh
+lookup_table::lookup_table(const std::vector<link> &links) :
+    m_links(links.size())
+{
+    // Count the links in each bucket, then place each link after the links
+    // before it in its bucket. This is a counting sort, and keeps the links
+    // within each bucket in the order they were given.
+    uint32_t counts[bucket_count] = {};
+    for (auto &&link : links) {
+        counts[get_bucket(link.eid)]++;
+    }
+
+    uint32_t start = 0;
+    for (int i = 0; i < bucket_count; i++) {
+        m_bucket_starts[i] = start;
+        start += counts[i];
+    }
+
+    uint32_t next[bucket_count];
+    std::copy(m_bucket_starts, m_bucket_starts + bucket_count, next);
+    for (auto &&link : links) {
+        m_links[next[get_bucket(link.eid)]++] = link;
+    }
+}
+
+// declared in nsf.hh
+const lookup_table::link *lookup_table::find(eid id) const
+{
+    int bucket = get_bucket(id);
+    size_t begin = m_bucket_starts[bucket];
+    size_t end = bucket + 1 < bucket_count ?
+        m_bucket_starts[bucket + 1] :
+        m_links.size();
+
+    for (size_t i = begin; i < end; i++) {
+        if (m_links[i].eid == id)
+            return &m_links[i];
+    }
+    return nullptr;
+}
+
+// declared in nsf.hh
+util::blob lookup_table::export_file() const
+{
+    util::binwriter w;
+    w.begin();
+    for (auto &&start : m_bucket_starts) {
+        w.write_u32(start);
+    }
+    for (auto &&link : m_links) {
+        w.write_u32(link.cid);
+        w.write_u32(link.eid);
+    }
+    return w.end();
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_lookup_table, Find)
+{
+    // The first two EIDs share a bucket.
+    eid a = 0x00018001;
+    eid b = 0x0001A001;
+    eid c = 0x007F8001;
+    lookup_table table({ { 3, c }, { 1, a }, { 5, b } });
+
+    ASSERT_EQ(lookup_table::get_bucket(a), lookup_table::get_bucket(b));
+    ASSERT_NE(lookup_table::get_bucket(a), lookup_table::get_bucket(c));
+    ASSERT_NE(table.find(a), nullptr);
+    EXPECT_EQ(table.find(a)->cid, 1u);
+    ASSERT_NE(table.find(b), nullptr);
+    EXPECT_EQ(table.find(b)->cid, 5u);
+    ASSERT_NE(table.find(c), nullptr);
+    EXPECT_EQ(table.find(c)->cid, 3u);
+    EXPECT_EQ(table.find(0x00018003), nullptr);
+
+    // The links are sorted by bucket, keeping their order within a bucket.
+    auto &&links = table.get_links();
+    ASSERT_EQ(links.size(), 3u);
+    EXPECT_EQ(links[0].eid, a);
+    EXPECT_EQ(links[1].eid, b);
+    EXPECT_EQ(links[2].eid, c);
+    EXPECT_EQ(table.get_bucket_start(lookup_table::get_bucket(a)), 0u);
+    EXPECT_EQ(table.get_bucket_start(lookup_table::get_bucket(c)), 2u);
+    EXPECT_EQ(table.get_bucket_start(lookup_table::get_bucket(a) + 1), 2u);
+
+    auto data = table.export_file();
+    ASSERT_EQ(data.size(), lookup_table::bucket_count * 4u + 3 * 8u);
+    EXPECT_EQ(data[lookup_table::bucket_count * 4], 1);
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,142 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "common.hh"
+#include <sstream>
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+// declared in nsf.hh
+void page_reader::read_up_to(util::blob &data, size_t size)
+{
+    size_t old_size = data.size();
+    if (old_size >= size)
+        return;
+
+    data.resize(size);
+    m_in.read(
+        reinterpret_cast<char *>(data.data() + old_size),
+        size - old_size
+    );
+    if (m_in.bad())
+        throw res::import_error("nsf::page_reader: read error");
+
+    data.resize(old_size + m_in.gcount());
+}
+
+// declared in nsf.hh
+bool page_reader::next(util::slice &out)
+{
+    // Continue from any bytes read ahead for the last page. Usually there are
+    // none, and the page is read directly into its own buffer.
+    util::blob data = std::move(m_pending);
+    m_pending.clear();
+    read_up_to(data, page_size);
+
+    if (data.empty())
+        return false;
+
+    if (is_compressed_page(data)) {
+        read_up_to(data, page_size * 2);
+        util::slice compressed = std::move(data);
+        size_t size;
+        out = decompress_page(compressed, size);
+        m_pending.assign(compressed.begin() + size, compressed.end());
+    } else {
+        if (data.size() < page_size)
+            throw res::import_error(
+                "nsf::page_reader: size not multiple of 64K"
+            );
+
+        m_pending.assign(data.begin() + page_size, data.end());
+        data.resize(page_size);
+        out = std::move(data);
+    }
+
+    m_index++;
+    return true;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_page_reader, ReadPages)
+{
+    std::string data(page_size * 2, '\0');
+    data[0] = 1;
+    data[page_size] = 2;
+    std::istringstream in(data);
+
+    page_reader reader(in);
+    util::slice page;
+    EXPECT_EQ(reader.get_index(), -1);
+    ASSERT_TRUE(reader.next(page));
+    EXPECT_EQ(page.size(), page_size);
+    EXPECT_EQ(page[0], 1);
+    ASSERT_TRUE(reader.next(page));
+    EXPECT_EQ(page[0], 2);
+    EXPECT_EQ(reader.get_index(), 1);
+    EXPECT_FALSE(reader.next(page));
+}
+
+TEST(nsf_page_reader, PartialPageError)
+{
+    std::istringstream in(std::string(page_size + 100, '\0'));
+
+    page_reader reader(in);
+    util::slice page;
+    EXPECT_TRUE(reader.next(page));
+    EXPECT_THROW(reader.next(page), res::import_error);
+}
+
+TEST(nsf_page_reader, CompressedPages)
+{
+    util::blob page(page_size);
+    for (auto &&i : util::range_of(page)) {
+        page[i] = i % 10;
+    }
+    auto compressed = compress_page(page.data());
+
+    // A compressed page between two uncompressed pages.
+    std::string data(page_size, '\1');
+    data.append(compressed.begin(), compressed.end());
+    data.append(page_size, '\2');
+    std::istringstream in(data);
+
+    page_reader reader(in);
+    util::slice out;
+    ASSERT_TRUE(reader.next(out));
+    EXPECT_EQ(out[0], 1);
+    ASSERT_TRUE(reader.next(out));
+    EXPECT_EQ(out, util::slice(page));
+    ASSERT_TRUE(reader.next(out));
+    EXPECT_EQ(out.size(), page_size);
+    EXPECT_EQ(out[0], 2);
+    EXPECT_FALSE(reader.next(out));
+}
+
+}
+#endif
+
+}
+}
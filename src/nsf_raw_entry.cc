@@ -24,11 +24,9 @@
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void raw_entry::import_file(TRANSACT, const util::blob &data)
+// declared in nsf.hh
+raw_entry::parsed raw_entry::parse(const util::slice &data)
 {
-    assert_alive();
-
     util::binreader r;
     r.begin(data);
 
@@ -44,13 +42,11 @@ void raw_entry::import_file(TRANSACT, const util::blob &data)
 
     // Read the item offsets.
     std::vector<uint32_t> item_offsets(item_count + 1);
-    for (auto &&item_offset : item_offsets) {
-        item_offset = r.read_u32();
-    }
+    r.read_u32_array(item_offsets.data(), item_offsets.size());
     r.end_early();
 
-    // Copy the data for each item.
-    std::vector<util::blob> items(item_count);
+    // Slice out the data for each item.
+    std::vector<util::slice> items(item_count);
     for (auto &&i : util::range_of(items)) {
         auto &&item_start_offset = item_offsets[i];
         auto &&item_end_offset = item_offsets[i + 1];
@@ -70,20 +66,35 @@ void raw_entry::import_file(TRANSACT, const util::blob &data)
             throw res::import_error("nsf::raw_entry: negative item size");
 
         // Extract the item's data.
-        items[i] = {
-            data.data() + item_start_offset,
-            data.data() + item_end_offset
-        };
+        items[i] = data.sub(
+            item_start_offset,
+            item_end_offset - item_start_offset
+        );
     }
 
-    // Finish importing.
-    set_eid(TS, eid);
-    set_type(TS, type);
-    set_items(TS, std::move(items));
+    return { eid, type, std::move(items) };
 }
 
 // declared in nsf.hh
-std::vector<util::blob> raw_entry::export_entry(uint32_t &out_type) const
+void raw_entry::import_parsed(TRANSACT, parsed p)
+{
+    assert_alive();
+
+    set_eid(TS, p.eid);
+    set_type(TS, p.type);
+    set_items(TS, std::move(p.items));
+}
+
+// declared in res.hh
+void raw_entry::import_file(TRANSACT, const util::slice &data)
+{
+    assert_alive();
+
+    import_parsed(TS, parse(data));
+}
+
+// declared in nsf.hh
+std::vector<util::slice> raw_entry::export_entry(uint32_t &out_type) const
 {
     assert_alive();
 
@@ -91,27 +102,79 @@ std::vector<util::blob> raw_entry::export_entry(uint32_t &out_type) const
     return get_items();
 }
 
-// declared in res.hh
-bool raw_entry::process_by_type(TRANSACT, game_ver ver)
+// declared in nsf.hh
+size_t raw_entry::export_size() const
 {
     assert_alive();
 
+    auto &&items = get_items();
+
+    size_t item_bytes = 0;
+    for (auto &&item : items) {
+        item_bytes += item.size();
+    }
+    return calculate_size(items.size(), item_bytes);
+}
+
+// declared in nsf.hh
+void raw_entry::share_to(TRANSACT, res::atom name) const
+{
+    assert_alive();
+
+    raw_entry::ref result = name;
+    result.create(TS, get_proj());
+    result->set_eid(TS, get_eid());
+    result->set_type(TS, get_type());
+    result->set_items(TS, get_items());
+}
+
+// declared in nsf.hh
+raw_entry::processor raw_entry::prepare_by_type(
+    game_ver ver,
+    uint32_t type,
+    const std::vector<util::slice> &items)
+{
     switch (ver) {
     case game_ver::crash1:
         break;
     case game_ver::crash2:
-        switch (get_type()) {
+        switch (type) {
         case 3:
-            process_as<wgeo_v2>(TS);
-            return true;
+            {
+                // The processor must be copyable to fit in a std::function,
+                // so the decoded contents are held by a shared pointer.
+                auto d = std::make_shared<wgeo_v2::decoded>(
+                    wgeo_v2::decode(items)
+                );
+                return [d](TRANSACT, raw_entry &entry) {
+                    entry.process_as<wgeo_v2>(TS, std::move(*d));
+                };
+            }
         }
         break;
     case game_ver::crash3:
         break;
     }
 
-    return false;
+    return nullptr;
+}
+
+// declared in res.hh
+bool raw_entry::process_by_type(TRANSACT, game_ver ver)
+{
+    assert_alive();
+
+    auto proc = prepare_by_type(ver, get_type(), get_items());
+    if (!proc)
+        return false;
+
+    proc(TS, *this);
+    return true;
 }
 
+// (s-var) g_raw_entry_file_type
+// Allows `nsf::raw_entry' assets to be stored in project files.
+static res::file_type_of<raw_entry> g_raw_entry_file_type;
+
 }
 }
@@ -19,17 +19,16 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 #include "misc.hh"
 
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void spage::import_file(TRANSACT, const util::blob &data)
+// declared in nsf.hh
+spage::parsed spage::parse(const util::slice &data)
 {
-    assert_alive();
-
     util::binreader r;
     r.begin(data);
 
@@ -51,16 +50,13 @@ void spage::import_file(TRANSACT, const util::blob &data)
     // Read the pagelet offsets. Pagelets should be entries, but we treat
     // them as blobs instead so they can be totally unprocessed, etc.
     std::vector<uint32_t> pagelet_offsets(pagelet_count + 1);
-    for (auto &&pagelet_offset : pagelet_offsets) {
-        pagelet_offset = r.read_u32();
-    }
+    r.read_u32_array(pagelet_offsets.data(), pagelet_offsets.size());
     r.end_early();
 
-    // Copy the data for each pagelet as a new raw_data asset. The caller
-    // can later process these into entries if desired.
-    std::vector<misc::raw_data::ref> pagelets(pagelet_count);
+    // Slice out the data for each pagelet. The pagelet data is a slice of the
+    // page data, not a copy.
+    std::vector<util::slice> pagelets(pagelet_count);
     for (auto &&i : util::range_of(pagelets)) {
-        auto &&pagelet = pagelets[i];
         auto &&pagelet_start_offset = pagelet_offsets[i];
         auto &&pagelet_end_offset = pagelet_offsets[i + 1];
 
@@ -78,91 +74,275 @@ void spage::import_file(TRANSACT, const util::blob &data)
         if (pagelet_end_offset < pagelet_start_offset)
             throw res::import_error("nsf::spage: negative pagelet size");
 
+        pagelets[i] = data.sub(
+            pagelet_start_offset,
+            pagelet_end_offset - pagelet_start_offset
+        );
+    }
+
+    return { type, cid, checksum, std::move(pagelets) };
+}
+
+// declared in nsf.hh
+void spage::import_parsed(TRANSACT, const parsed &p)
+{
+    assert_alive();
+
+    // Create a new raw_data asset for each pagelet. The caller can later
+    // process these into entries if desired.
+    std::vector<misc::raw_data::ref> pagelets(p.pagelets.size());
+    for (auto &&i : util::range_of(pagelets)) {
+        auto &&pagelet = pagelets[i];
+
         // Create the pagelet asset.
         pagelet = get_name() / "pagelet-$"_fmt(i);
         pagelet.create(TS, get_proj());
 
-        // Copy the pagelet data into the asset.
-        pagelet->set_data(TS,
-            {&data[pagelet_start_offset], &data[pagelet_end_offset]}
-        );
+        // Point the asset at the pagelet's data.
+        pagelet->set_data(TS, p.pagelets[i]);
     }
 
     // Finish importing.
-    set_type(TS, type);
-    set_cid(TS, cid);
-    set_checksum(TS, checksum);
+    set_type(TS, p.type);
+    set_cid(TS, p.cid);
+    set_checksum(TS, p.checksum);
     set_pagelets(TS, {pagelets.begin(), pagelets.end()});
 }
 
+// declared in res.hh
+void spage::import_file(TRANSACT, const util::slice &data)
+{
+    assert_alive();
+
+    import_parsed(TS, parse(data));
+}
+
 // declared in nsf.hh
-util::blob spage::export_file() const
+size_t spage::measure_pagelet(const res::anyref &pagelet)
+{
+    if (!pagelet)
+        throw res::export_error("nsf::spage: null pagelet ref");
+
+    misc::raw_data::ref raw_ref = pagelet;
+    if (raw_ref.ok())
+        return raw_ref->get_data().size();
+
+    entry::ref entry_ref = pagelet;
+    if (entry_ref.ok())
+        return entry_ref->export_size();
+
+    throw res::export_error("nsf::spage: pagelet has incompatible type");
+}
+
+// declared in nsf.hh
+size_t spage::export_size() const
 {
     assert_alive();
 
-    util::binwriter w;
-    w.begin();
+    auto &&pagelets = get_pagelets();
+
+    size_t size = 20 + pagelets.size() * 4;
+    for (auto &&pagelet : pagelets) {
+        size += measure_pagelet(pagelet);
+    }
+    return size;
+}
+
+// declared in nsf.hh
+spage::contents spage::gather(std::vector<const res::asset *> *deps) const
+{
+    assert_alive();
+
+    if (deps) {
+        deps->push_back(this);
+    }
 
     auto &&pagelets = get_pagelets();
 
-    // Write the page header.
-    w.write_u16(0x1234);
-    w.write_u16(get_type());
-    w.write_u32(get_cid());
-    w.write_u32(pagelets.size());
-    w.write_u32(get_checksum());
+    contents c;
+    c.type = get_type();
+    c.cid = get_cid();
+    c.checksum = get_checksum();
 
-    // Export the pagelets if they are processed entries.
-    std::vector<util::blob> pagelets_raw(pagelets.size());
-    for (auto &&i : util::range_of(get_pagelets())) {
-        auto ref = get_pagelets()[i];
+    // Gather the pagelets if they are processed entries.
+    c.pagelets.resize(pagelets.size());
+    for (auto &&i : util::range_of(pagelets)) {
+        auto ref = pagelets[i];
+        auto &&out = c.pagelets[i];
 
         if (!ref)
             throw res::export_error("nsf::spage: null pagelet ref");
 
+        if (deps && ref.get()) {
+            deps->push_back(ref.get());
+        }
+
         misc::raw_data::ref raw_ref = ref;
         if (raw_ref.ok()) {
-            pagelets_raw[i] = raw_ref->get_data();
+            out.raw = raw_ref->get_data();
+            out.size = out.raw.size();
             continue;
         }
 
         entry::ref entry_ref = ref;
         if (entry_ref.ok()) {
-            pagelets_raw[i] = entry_ref->export_file();
+            out.is_entry = true;
+            out.eid = entry_ref->get_eid();
+            out.items = entry_ref->export_entry(out.type);
+            if (deps) {
+                entry_ref->get_export_deps(*deps);
+            }
+            size_t item_bytes = 0;
+            for (auto &&item : out.items) {
+                item_bytes += item.size();
+            }
+            out.size = entry::calculate_size(out.items.size(), item_bytes);
             continue;
         }
 
         throw res::export_error("nsf::spage: pagelet has incompatible type");
     }
 
-    // Calculate and write the pagelet offsets.
-    uint32_t pagelet_offset = 20 + pagelets.size() * 4;
-    for (auto &&pagelet : pagelets_raw) {
-        w.write_u32(pagelet_offset);
-        pagelet_offset += pagelet.size();
+    // Ensure a 64K page size.
+    size_t total_size = 20 + pagelets.size() * 4;
+    for (auto &&out : c.pagelets) {
+        total_size += out.size;
     }
-    w.write_u32(pagelet_offset);
+    if (total_size > page_size)
+        throw res::export_error("nsf::spage: over 64K page size");
 
-    auto data = w.end();
+    return c;
+}
 
-    // Write the pagelets themselves.
-    for (auto &&pagelet : pagelets_raw) {
-        data.insert(data.end(), pagelet.begin(), pagelet.end());
+// declared in nsf.hh
+void spage::assemble(const contents &c, util::blob &buf)
+{
+    buf.resize(page_size);
+    util::byte *p = buf.data();
+
+    // Writes a little-endian 16- or 32-bit value and advances `p'.
+    auto put_u16 = [&p](uint16_t value) {
+        p[0] = value;
+        p[1] = value >> 8;
+        p += 2;
+    };
+    auto put_u32 = [&p](uint32_t value) {
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+        p[3] = value >> 24;
+        p += 4;
+    };
+    auto put_data = [&p](const util::slice &data) {
+        std::copy(data.begin(), data.end(), p);
+        p += data.size();
+    };
+
+    // Write the page header.
+    put_u16(0x1234);
+    put_u16(c.type);
+    put_u32(c.cid);
+    put_u32(c.pagelets.size());
+    put_u32(c.checksum);
+
+    // Calculate and write the pagelet offsets.
+    uint32_t pagelet_offset = 20 + c.pagelets.size() * 4;
+    for (auto &&out : c.pagelets) {
+        put_u32(pagelet_offset);
+        pagelet_offset += out.size;
     }
+    put_u32(pagelet_offset);
 
-    // Ensure a 64K page size.
-    if (data.size() > page_size)
-        throw res::export_error("nsf::spage: over 64K page size");
+    // Write the pagelets themselves. The header of each entry is the same as
+    // the one written by `entry::export_file'.
+    for (auto &&out : c.pagelets) {
+        if (!out.is_entry) {
+            put_data(out.raw);
+            continue;
+        }
 
-    if (data.size() < page_size) {
-        data.resize(page_size);
+        put_u32(0x100FFFF);
+        put_u32(out.eid);
+        put_u32(out.type);
+        put_u32(out.items.size());
+
+        uint32_t item_offset = 20 + out.items.size() * 4;
+        for (auto &&item : out.items) {
+            put_u32(item_offset);
+            item_offset += item.size();
+        }
+        put_u32(item_offset);
+
+        for (auto &&item : out.items) {
+            put_data(item);
+        }
     }
 
-    // Calculate checksum, if necessary.
-    // TODO
+    // Clear the remainder of the page, which may hold data from a page
+    // previously exported into the same buffer.
+    std::fill(p, buf.data() + buf.size(), 0);
+
+    // Calculate the checksum now that the rest of the page is complete.
+    p = buf.data() + 12;
+    put_u32(calculate_page_checksum(buf.data()));
+}
+
+// declared in nsf.hh
+void spage::export_page(
+    util::blob &buf,
+    std::vector<const res::asset *> *deps) const
+{
+    assert_alive();
+
+    assemble(gather(deps), buf);
+}
 
+// declared in nsf.hh
+util::blob spage::export_file() const
+{
+    util::blob data;
+    export_page(data);
     return data;
 }
 
+// (s-var) g_spage_file_type
+// Allows `nsf::spage' assets to be stored in project files.
+static res::file_type_of<spage> g_spage_file_type;
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_spage, ExportSize)
+{
+    res::project proj;
+    spage::ref page = proj.get_asset_root() / "page";
+    misc::raw_data::ref raw = page / "pagelet-0";
+    raw_entry::ref entry = page / "pagelet-1";
+    proj.get_transact().run([&](TRANSACT) {
+        page.create(TS, proj);
+        raw.create(TS, proj);
+        raw->set_data(TS, util::blob(100));
+        entry.create(TS, proj);
+        entry->set_items(TS, { util::blob(10), util::blob(30) });
+        page->set_pagelets(TS, { raw, entry });
+    });
+    EXPECT_EQ(entry->export_size(), entry->export_file().size());
+
+    // The size counts the header and offsets but not the padding to 64K.
+    size_t size = 20 + 2 * 4 + 100 + entry->export_size();
+    EXPECT_EQ(page->export_size(), size);
+    EXPECT_NO_THROW(page->export_file());
+
+    // A page which is too large can still be measured.
+    proj.get_transact().run([&](TRANSACT) {
+        raw->set_data(TS, util::blob(page_size));
+    });
+    EXPECT_GT(page->export_size(), page_size);
+    EXPECT_THROW(page->export_file(), res::export_error);
+}
+
+}
+#endif
+
 }
 }
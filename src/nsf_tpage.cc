@@ -0,0 +1,362 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <cstring>
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+namespace {
+
+// (internal const) row_size
+// The size in bytes of one row of a texture page.
+constexpr int row_size = 512;
+
+// (internal const) row_count
+// The number of rows in a texture page.
+constexpr int row_count = page_size / row_size;
+
+// (internal func) color_to_rgba
+// Converts a 16-bit PlayStation color (5 bits each of red, green, and blue,
+// plus a semi-transparency bit) to 8-bit RGBA packed into a little-endian
+// 32-bit value. The color 0x0000 is fully transparent; all others are opaque.
+// This is written without branches so that loops over it can be vectorized.
+inline uint32_t color_to_rgba(uint32_t color)
+{
+    uint32_t r = color & 0x1F;
+    uint32_t g = (color >> 5) & 0x1F;
+    uint32_t b = (color >> 10) & 0x1F;
+    uint32_t a = -uint32_t(color != 0) & 0xFF;
+
+    // Expand each 5-bit component to 8 bits, copying the high bits into the
+    // low bits so that 0x1F becomes 0xFF.
+    r = (r << 3) | (r >> 2);
+    g = (g << 3) | (g >> 2);
+    b = (b << 3) | (b >> 2);
+
+    return r | g << 8 | b << 16 | a << 24;
+}
+
+// (internal func) decode_direct_row
+// Converts a row of 16-bit colors to RGBA.
+void decode_direct_row(const util::byte *src, uint32_t *dst, int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = color_to_rgba(src[i * 2] | src[i * 2 + 1] << 8);
+    }
+}
+
+// (internal func) decode_indexed8_row
+// Converts a row of 8-bit CLUT indices to RGBA using the already-converted
+// CLUT.
+void decode_indexed8_row(
+    const util::byte *src,
+    uint32_t *dst,
+    int count,
+    const uint32_t *clut)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = clut[src[i]];
+    }
+}
+
+// (internal func) decode_indexed4_row
+// Converts a row of 4-bit CLUT indices to RGBA using the already-converted
+// CLUT. `first_odd' is true if the row begins in the high half of its first
+// byte. Each byte holds two texels, the first in the low four bits.
+void decode_indexed4_row(
+    const util::byte *src,
+    uint32_t *dst,
+    int count,
+    bool first_odd,
+    const uint32_t *clut)
+{
+    if (first_odd && count > 0) {
+        *dst++ = clut[*src++ >> 4];
+        count--;
+    }
+
+    for (int i = 0; i < count / 2; i++) {
+        dst[i * 2] = clut[src[i] & 0xF];
+        dst[i * 2 + 1] = clut[src[i] >> 4];
+    }
+
+    if (count % 2) {
+        dst[count - 1] = clut[src[count / 2] & 0xF];
+    }
+}
+
+}
+
+// declared in nsf.hh
+eid tpage::get_eid() const
+{
+    auto &&data = get_data();
+    if (data.size() < 8)
+        return 0;
+
+    return data[4] | data[5] << 8 | data[6] << 16 | uint32_t(data[7]) << 24;
+}
+
+// declared in nsf.hh
+void tpage::import_file(TRANSACT, const util::slice &data)
+{
+    assert_alive();
+
+    // Ensure the page data is the correct size (64K).
+    if (data.size() != page_size)
+        throw res::import_error("nsf::tpage: not 64K");
+
+    // Ensure the magic number is correct.
+    if ((data[0] | data[1] << 8) != 0x1234)
+        throw res::import_error("nsf::tpage: bad magic number");
+
+    // Ensure this is a texture page.
+    if ((data[2] | data[3] << 8) != 1)
+        throw res::import_error("nsf::tpage: not a texture page");
+
+    set_data(TS, data);
+}
+
+// declared in nsf.hh
+util::slice tpage::export_file() const
+{
+    assert_alive();
+
+    return get_data();
+}
+
+// declared in nsf.hh
+std::shared_ptr<const util::blob> tpage::get_texture(const region &rgn) const
+{
+    assert_alive();
+
+    auto iter = m_texture_cache.find(rgn);
+    if (iter != m_texture_cache.end())
+        return iter->second;
+
+    auto &&data = get_data();
+    if (data.size() != page_size)
+        throw std::logic_error("nsf::tpage::get_texture: bad page data");
+
+    auto texture = std::make_shared<util::blob>(
+        size_t(rgn.width) * rgn.height * 4
+    );
+    decode_texture(data, rgn, texture->data());
+
+    m_texture_cache.insert({ rgn, texture });
+    return texture;
+}
+
+// declared in nsf.hh
+void tpage::decode_texture(
+    const util::slice &data,
+    const region &rgn,
+    util::byte *out)
+{
+    if (data.size() != page_size)
+        throw std::logic_error("nsf::tpage::decode_texture: bad page data");
+
+    if (rgn.bpp != 4 && rgn.bpp != 8 && rgn.bpp != 16)
+        throw std::logic_error("nsf::tpage::decode_texture: bad bpp");
+
+    int row_texels = row_size * 8 / rgn.bpp;
+    if (rgn.x < 0 || rgn.width < 0 || rgn.x > row_texels - rgn.width ||
+        rgn.y < 0 || rgn.height < 0 || rgn.y > row_count - rgn.height)
+        throw std::logic_error("nsf::tpage::decode_texture: out of bounds");
+
+    // Convert the CLUT to RGBA once up front, so that each texel only costs
+    // a table lookup.
+    uint32_t clut[256];
+    if (rgn.bpp != 16) {
+        int clut_size = (rgn.bpp == 4) ? 16 : 256;
+        if (rgn.clut_x < 0 || rgn.clut_x > row_size / 2 - clut_size ||
+            rgn.clut_y < 0 || rgn.clut_y >= row_count)
+            throw std::logic_error(
+                "nsf::tpage::decode_texture: CLUT out of bounds"
+            );
+
+        decode_direct_row(
+            &data[rgn.clut_y * row_size + rgn.clut_x * 2],
+            clut,
+            clut_size
+        );
+    }
+
+    // Decode each row into a temporary aligned buffer and copy it out, as the
+    // output is a byte array with no particular alignment.
+    std::vector<uint32_t> row(rgn.width);
+    for (int y = 0; y < rgn.height; y++) {
+        auto src = &data[(rgn.y + y) * row_size];
+        switch (rgn.bpp) {
+        case 4:
+            decode_indexed4_row(
+                src + rgn.x / 2,
+                row.data(),
+                rgn.width,
+                rgn.x % 2,
+                clut
+            );
+            break;
+        case 8:
+            decode_indexed8_row(src + rgn.x, row.data(), rgn.width, clut);
+            break;
+        case 16:
+            decode_direct_row(src + rgn.x * 2, row.data(), rgn.width);
+            break;
+        }
+
+        // The packed values are little-endian RGBA; write them out byte by
+        // byte so the result is the same on any host.
+        auto dst = out + size_t(y) * rgn.width * 4;
+        for (int x = 0; x < rgn.width; x++) {
+            dst[x * 4 + 0] = row[x];
+            dst[x * 4 + 1] = row[x] >> 8;
+            dst[x * 4 + 2] = row[x] >> 16;
+            dst[x * 4 + 3] = row[x] >> 24;
+        }
+    }
+}
+
+// (s-var) g_tpage_file_type
+// Allows `nsf::tpage' assets to be stored in project files.
+static res::file_type_of<tpage> g_tpage_file_type;
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (internal func) make_tpage_data
+// Returns a blank texture page with the given 16-bit colors at the start of
+// the given row.
+util::blob make_tpage_data(int y, std::vector<uint16_t> colors)
+{
+    util::blob data(page_size);
+    data[0] = 0x34;
+    data[1] = 0x12;
+    data[2] = 1;
+    for (auto &&i : util::range_of(colors)) {
+        data[y * row_size + i * 2] = colors[i];
+        data[y * row_size + i * 2 + 1] = colors[i] >> 8;
+    }
+    return data;
+}
+
+TEST(nsf_tpage, Decode16)
+{
+    auto data = make_tpage_data(5, { 0x0000, 0x001F, 0x03E0, 0xFC00, 0x8000 });
+
+    util::blob out(5 * 4);
+    tpage::decode_texture(data, { 16, 0, 5, 5, 1, 0, 0 }, out.data());
+    EXPECT_EQ(out, (util::blob{
+        0x00, 0x00, 0x00, 0x00,
+        0xFF, 0x00, 0x00, 0xFF,
+        0x00, 0xFF, 0x00, 0xFF,
+        0x00, 0x00, 0xFF, 0xFF,
+        0x00, 0x00, 0x00, 0xFF
+    }));
+}
+
+TEST(nsf_tpage, Decode8)
+{
+    auto data = make_tpage_data(100, { 0x0000, 0x001F, 0x03E0 });
+    data[10 * row_size + 7] = 2;
+    data[10 * row_size + 8] = 1;
+
+    util::blob out(2 * 4);
+    tpage::decode_texture(data, { 8, 7, 10, 2, 1, 0, 100 }, out.data());
+    EXPECT_EQ(out, (util::blob{
+        0x00, 0xFF, 0x00, 0xFF,
+        0xFF, 0x00, 0x00, 0xFF
+    }));
+}
+
+TEST(nsf_tpage, Decode4)
+{
+    auto data = make_tpage_data(100, {});
+    std::vector<uint16_t> clut(16);
+    clut[1] = 0x001F;
+    clut[2] = 0x03E0;
+    clut[3] = 0x7C00;
+    for (auto &&i : util::range_of(clut)) {
+        data[100 * row_size + 32 + i * 2] = clut[i];
+        data[100 * row_size + 32 + i * 2 + 1] = clut[i] >> 8;
+    }
+    data[0 * row_size + 1] = 0x21;
+    data[0 * row_size + 2] = 0x03;
+
+    // Texels 3 to 5, starting in the high half of byte 1.
+    util::blob out(3 * 4);
+    tpage::decode_texture(data, { 4, 3, 0, 3, 1, 16, 100 }, out.data());
+    EXPECT_EQ(out, (util::blob{
+        0x00, 0xFF, 0x00, 0xFF,
+        0x00, 0x00, 0xFF, 0xFF,
+        0x00, 0x00, 0x00, 0x00
+    }));
+}
+
+TEST(nsf_tpage, Bounds)
+{
+    auto data = make_tpage_data(0, {});
+    util::blob out(1024 * 4);
+    EXPECT_NO_THROW(
+        tpage::decode_texture(data, { 4, 0, 127, 1024, 1, 0, 0 }, out.data())
+    );
+    EXPECT_THROW(
+        tpage::decode_texture(data, { 8, 0, 127, 513, 1, 0, 0 }, out.data()),
+        std::logic_error
+    );
+    EXPECT_THROW(
+        tpage::decode_texture(data, { 16, 0, 128, 1, 1, 0, 0 }, out.data()),
+        std::logic_error
+    );
+    EXPECT_THROW(
+        tpage::decode_texture(data, { 8, 0, 0, 1, 1, 1, 0 }, out.data()),
+        std::logic_error
+    );
+}
+
+TEST(nsf_tpage, TextureCache)
+{
+    res::project proj;
+    tpage::ref page = proj.get_asset_root() / "tpage";
+    proj.get_transact().run([&](TRANSACT) {
+        page.create(TS, proj);
+        page->import_file(TS, make_tpage_data(1, { 0x001F }));
+    });
+
+    auto texture = page->get_texture({ 16, 0, 1, 1, 1, 0, 0 });
+    EXPECT_EQ(*texture, (util::blob{ 0xFF, 0x00, 0x00, 0xFF }));
+    EXPECT_EQ(page->get_texture({ 16, 0, 1, 1, 1, 0, 0 }), texture);
+
+    proj.get_transact().run([&](TRANSACT) {
+        page->set_data(TS, make_tpage_data(1, { 0x03E0 }));
+    });
+    auto new_texture = page->get_texture({ 16, 0, 1, 1, 1, 0, 0 });
+    EXPECT_EQ(*new_texture, (util::blob{ 0x00, 0xFF, 0x00, 0xFF }));
+    EXPECT_EQ(*texture, (util::blob{ 0xFF, 0x00, 0x00, 0xFF }));
+}
+
+}
+#endif
+
+}
+}
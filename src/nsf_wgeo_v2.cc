@@ -19,16 +19,419 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
+namespace {
+
+// (internal func) load_u16
+// Reads a little-endian 16-bit value.
+inline uint32_t load_u16(const util::byte *p)
 {
-    assert_alive();
+    return p[0] | p[1] << 8;
+}
+
+// (internal func) load_u32
+// Reads a little-endian 32-bit value.
+inline uint32_t load_u32(const util::byte *p)
+{
+    return uint32_t(p[0]) | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+// (internal func) sext12
+// Sign-extends the low 12 bits of the given value.
+inline int sext12(uint32_t v)
+{
+    return int32_t(v << 20) >> 20;
+}
+
+// (internal func) decode_vertices
+// Unpacks `count' vertices from the vertex item. Each vertex is split across
+// a 32-bit word in the first part of the item (stored in reverse order) and a
+// 16-bit halfword in the second part. The fields are packed least significant
+// bit first, the same order `util::binreader::read_ubits' uses:
+//
+//   word:     color_mid:4  x:s12  color_high:2  fx:2  z:s12
+//   halfword: color_low:4  y:s12
+//
+// Each word is read once and split with shifts and masks instead of going
+// through the bit reader, and the loop has no branches so the compiler is
+// free to vectorize it.
+void decode_vertices(
+    const util::byte *item,
+    gfx::vertex *out,
+    size_t count)
+{
+    if (count == 0)
+        return;
+
+    const util::byte *words = item + (count - 1) * 4;
+    const util::byte *halves = item + count * 4;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t w = load_u32(words - i * 4);
+        uint32_t h = load_u16(halves + i * 2);
+
+        out[i].x = sext12(w >> 4) * 16;
+        out[i].y = sext12(h >> 4) * 16;
+        out[i].z = sext12(w >> 20) * 16;
+        out[i].fx = (w >> 18) & 0x3;
+        out[i].color_index =
+            (h & 0xF) | (w & 0xF) << 4 | ((w >> 16) & 0x3) << 8;
+    }
+}
+
+// (internal func) decode_triangles
+// Unpacks `count' triangles from the triangle item, which is split into words
+// and halfwords the same way as the vertex item:
+//
+//   word:     unk0:8  v0:12  v1:12
+//   halfword: unk1:4  v2:12
+void decode_triangles(
+    const util::byte *item,
+    gfx::triangle *out,
+    size_t count)
+{
+    if (count == 0)
+        return;
+
+    const util::byte *words = item + (count - 1) * 4;
+    const util::byte *halves = item + count * 4;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t w = load_u32(words - i * 4);
+        uint32_t h = load_u16(halves + i * 2);
+
+        out[i].v[0].vertex_index = (w >> 8) & 0xFFF;
+        out[i].v[1].vertex_index = w >> 20;
+        out[i].v[2].vertex_index = h >> 4;
+        out[i].v[0].color_index = -1;
+        out[i].v[1].color_index = -1;
+        out[i].v[2].color_index = -1;
+        out[i].unk0 = w & 0xFF;
+        out[i].unk1 = h & 0xF;
+    }
+}
+
+// (internal func) decode_quads
+// Unpacks `count' quads from the quad item. Each quad is a pair of 32-bit
+// words stored in order:
+//
+//   word 0: unk0:8  v0:12  v1:12
+//   word 1: unk1:8  v2:12  v3:12
+void decode_quads(
+    const util::byte *item,
+    gfx::quad *out,
+    size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t w0 = load_u32(item + i * 8);
+        uint32_t w1 = load_u32(item + i * 8 + 4);
+
+        out[i].v[0].vertex_index = (w0 >> 8) & 0xFFF;
+        out[i].v[1].vertex_index = w0 >> 20;
+        out[i].v[2].vertex_index = (w1 >> 8) & 0xFFF;
+        out[i].v[3].vertex_index = w1 >> 20;
+        out[i].v[0].color_index = -1;
+        out[i].v[1].color_index = -1;
+        out[i].v[2].color_index = -1;
+        out[i].v[3].color_index = -1;
+        out[i].unk0 = w0 & 0xFF;
+        out[i].unk1 = w1 & 0xFF;
+    }
+}
+
+// (internal const) coord_min, coord_max
+// The range of vertex coordinates (after scaling down by 16) accepted for
+// export. The maximum itself is excluded.
+constexpr int coord_min = -(1 << 11);
+constexpr int coord_max = (1 << 11) - 1;
+
+// (internal func) store_u16
+// Writes a little-endian 16-bit value.
+inline void store_u16(util::byte *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+// (internal func) store_u32
+// Writes a little-endian 32-bit value.
+inline void store_u32(util::byte *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// (internal func) split_item_size
+// Returns the size of an item holding `count' word/halfword pairs, padded to
+// a multiple of four bytes.
+inline size_t split_item_size(size_t count)
+{
+    return (count * 6 + 3) & ~size_t(3);
+}
+
+// (internal func) vertices_ok
+// Checks every vertex against the limits of the vertex item format. This only
+// reports whether all of the vertices are valid; `validate_vertices' finds
+// the specific problem. The loop accumulates failures without branching so
+// that it can be vectorized.
+bool vertices_ok(const gfx::vertex *in, size_t count)
+{
+    int bad = 0;
+    for (size_t i = 0; i < count; i++) {
+        int x = in[i].x / 16.0f;
+        int y = in[i].y / 16.0f;
+        int z = in[i].z / 16.0f;
+        bad |= (x < coord_min) | (x >= coord_max);
+        bad |= (y < coord_min) | (y >= coord_max);
+        bad |= (z < coord_min) | (z >= coord_max);
+        bad |= unsigned(in[i].color_index) >= (1U << 10);
+        bad |= in[i].fx >= (1U << 2);
+    }
+    return !bad;
+}
+
+// (internal func) validate_vertices
+// Throws an export error describing the first invalid vertex, if any.
+void validate_vertices(const gfx::vertex *in, size_t count)
+{
+    for (size_t i = count; i-- > 0;) {
+        int x = in[i].x / 16.0f;
+        int z = in[i].z / 16.0f;
+
+        if (x < coord_min || x >= coord_max ||
+            z < coord_min || z >= coord_max) {
+            throw res::export_error("nsf::wgeo_v2: vertex x/z out of range");
+        }
+
+        if (in[i].color_index == -1) {
+            throw res::export_error("nsf::wgeo_v2: vertex colors required");
+        }
+        if (in[i].color_index < 0 || in[i].color_index >= (1L << 10)) {
+            throw res::export_error("nsf::wgeo_v2: vertex color out of range");
+        }
+
+        if (in[i].fx >= (1U << 2)) {
+            throw res::export_error("nsf::wgeo_v2: vertex fx out of range");
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        int y = in[i].y / 16.0f;
+
+        if (y < coord_min || y >= coord_max) {
+            throw res::export_error("nsf::wgeo_v2: vertex y out of range");
+        }
+    }
+}
+
+// (internal func) encode_vertices
+// Packs `count' already-validated vertices into the layout described at
+// `decode_vertices'. `out' must have room for `count' * 6 bytes.
+void encode_vertices(const gfx::vertex *in, util::byte *out, size_t count)
+{
+    if (count == 0)
+        return;
+
+    util::byte *words = out + (count - 1) * 4;
+    util::byte *halves = out + count * 4;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t x = int(in[i].x / 16.0f);
+        uint32_t y = int(in[i].y / 16.0f);
+        uint32_t z = int(in[i].z / 16.0f);
+        uint32_t color = in[i].color_index;
+
+        uint32_t w = ((color >> 4) & 0xF)
+            | (x & 0xFFF) << 4
+            | ((color >> 8) & 0x3) << 16
+            | (in[i].fx & 0x3) << 18
+            | (z & 0xFFF) << 20;
+        uint32_t h = (color & 0xF) | (y & 0xFFF) << 4;
+
+        store_u32(words - i * 4, w);
+        store_u16(halves + i * 2, h);
+    }
+}
+
+// (internal func) corner_bad
+// Returns nonzero if a polygon corner refers to a vertex index too large for
+// the format, or has a corner color, which the wgeo_v2 format cannot store.
+inline int corner_bad(const gfx::corner &c)
+{
+    return (unsigned(c.vertex_index) >= (1U << 12)) | (c.color_index != -1);
+}
+
+// (internal func) validate_corners
+// Throws an export error describing the problem with the given corners, if
+// any.
+void validate_corners(const gfx::corner *corners, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (corners[i].color_index != -1) {
+            throw res::export_error(
+                "nsf::wgeo_v2: corner colors not supported"
+            );
+        }
+        if (unsigned(corners[i].vertex_index) >= (1U << 12)) {
+            throw res::export_error(
+                "nsf::wgeo_v2: vertex index out of range"
+            );
+        }
+    }
+}
+
+// (internal func) triangles_ok
+// Checks every triangle against the limits of the triangle item format, in
+// the same manner as `vertices_ok'.
+bool triangles_ok(const gfx::triangle *in, size_t count)
+{
+    int bad = 0;
+    for (size_t i = 0; i < count; i++) {
+        bad |= corner_bad(in[i].v[0]);
+        bad |= corner_bad(in[i].v[1]);
+        bad |= corner_bad(in[i].v[2]);
+        bad |= in[i].unk0 >= (1U << 8);
+        bad |= in[i].unk1 >= (1U << 4);
+    }
+    return !bad;
+}
 
+// (internal func) validate_triangles
+// Throws an export error describing the first invalid triangle, if any.
+void validate_triangles(const gfx::triangle *in, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        validate_corners(in[i].v, 3);
+        if (in[i].unk0 >= (1U << 8) || in[i].unk1 >= (1U << 4)) {
+            throw res::export_error(
+                "nsf::wgeo_v2: triangle flags out of range"
+            );
+        }
+    }
+}
+
+// (internal func) encode_triangles
+// Packs `count' already-validated triangles into the layout described at
+// `decode_triangles'. `out' must have room for `count' * 6 bytes.
+void encode_triangles(const gfx::triangle *in, util::byte *out, size_t count)
+{
+    if (count == 0)
+        return;
+
+    util::byte *words = out + (count - 1) * 4;
+    util::byte *halves = out + count * 4;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t w = in[i].unk0
+            | uint32_t(in[i].v[0].vertex_index) << 8
+            | uint32_t(in[i].v[1].vertex_index) << 20;
+        uint32_t h = in[i].unk1
+            | uint32_t(in[i].v[2].vertex_index) << 4;
+
+        store_u32(words - i * 4, w);
+        store_u16(halves + i * 2, h);
+    }
+}
+
+// (internal func) quads_ok
+// Checks every quad against the limits of the quad item format, in the same
+// manner as `vertices_ok'.
+bool quads_ok(const gfx::quad *in, size_t count)
+{
+    int bad = 0;
+    for (size_t i = 0; i < count; i++) {
+        bad |= corner_bad(in[i].v[0]);
+        bad |= corner_bad(in[i].v[1]);
+        bad |= corner_bad(in[i].v[2]);
+        bad |= corner_bad(in[i].v[3]);
+        bad |= in[i].unk0 >= (1U << 8);
+        bad |= in[i].unk1 >= (1U << 8);
+    }
+    return !bad;
+}
+
+// (internal func) validate_quads
+// Throws an export error describing the first invalid quad, if any.
+void validate_quads(const gfx::quad *in, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        validate_corners(in[i].v, 4);
+        if (in[i].unk0 >= (1U << 8) || in[i].unk1 >= (1U << 8)) {
+            throw res::export_error("nsf::wgeo_v2: quad flags out of range");
+        }
+    }
+}
+
+// (internal func) encode_quads
+// Packs `count' already-validated quads into the layout described at
+// `decode_quads'. `out' must have room for `count' * 8 bytes.
+void encode_quads(const gfx::quad *in, util::byte *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t w0 = in[i].unk0
+            | uint32_t(in[i].v[0].vertex_index) << 8
+            | uint32_t(in[i].v[1].vertex_index) << 20;
+        uint32_t w1 = in[i].unk1
+            | uint32_t(in[i].v[2].vertex_index) << 8
+            | uint32_t(in[i].v[3].vertex_index) << 20;
+
+        store_u32(out + i * 8, w0);
+        store_u32(out + i * 8 + 4, w1);
+    }
+}
+
+// (internal const) info_item_size
+// The size of the info item (0), which holds 19 32-bit fields.
+constexpr size_t info_item_size = 19 * 4;
+
+// (internal struct) export_assets
+// The assets which an entry's scenery is exported from, as found by
+// `find_export_assets'.
+struct export_assets {
+    const gfx::world *world;
+    const gfx::mesh *mesh;
+    const gfx::frame *frame;
+};
+
+// (internal func) find_export_assets
+// Follows the entry's world reference to the assets which it is exported
+// from, throwing an export error if any of them are missing.
+export_assets find_export_assets(const wgeo_v2 &entry)
+{
+    auto &&world = entry.get_world();
+    if (!world.ok())
+        throw res::export_error("nsf::wgeo_v2: bad world ref");
+
+    auto &&model = world->get_model();
+    if (!model.ok())
+        throw res::export_error("nsf::wgeo_v2: bad model ref");
+
+    auto &&mesh = model->get_mesh();
+    if (!mesh.ok())
+        throw res::export_error("nsf::wgeo_v2: bad mesh ref");
+
+    auto &&anim = model->get_anim();
+    if (!anim.ok())
+        throw res::export_error("nsf::wgeo_v2: bad anim ref");
+
+    auto &&frames = anim->get_frames();
+    if (frames.size() != 1)
+        throw res::export_error("nsf::wgeo_v2: invalid frame count");
+
+    auto &&frame = frames[0];
+    if (!frame.ok())
+        throw res::export_error("nsf::wgeo_v2: bad frame ref");
+
+    return { &*world, &*mesh, &*frame };
+}
+
+}
+
+// declared in nsf.hh
+wgeo_v2::decoded wgeo_v2::decode(const std::vector<util::slice> &items)
+{
     util::binreader r;
 
     // Ensure we have the correct number of items (7).
@@ -72,32 +475,7 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the vertices.
     std::vector<gfx::vertex> vertices(vertex_count);
-    for (auto &&i : util::range_of(vertices)) {
-        auto &vertex = vertices[i];
-
-        // TODO - explain vertex format here
-
-        r.begin(&item_vertices[(vertex_count - 1 - i) * 4], 4);
-        auto color_mid  = r.read_ubits(4);
-        auto x          = r.read_sbits(12);
-        auto color_high = r.read_ubits(2);
-        auto fx         = r.read_ubits(2);
-        auto z          = r.read_sbits(12);
-        r.end();
-
-        r.begin(&item_vertices[vertex_count * 4 + i * 2], 2);
-        auto color_low = r.read_ubits(4);
-        auto y         = r.read_sbits(12);
-        r.end();
-
-        vertex.x = x * 16;
-        vertex.y = y * 16;
-        vertex.z = z * 16;
-
-        vertex.fx = fx;
-
-        vertex.color_index = color_low | color_mid << 4 | color_high << 8;
-    }
+    decode_vertices(item_vertices.data(), vertices.data(), vertex_count);
 
     // Ensure the triangle count is correct.
     if (triangle_count != item_triangles.size() / 6)
@@ -105,33 +483,7 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the triangles.
     std::vector<gfx::triangle> triangles(triangle_count);
-    for (auto &&i : util::range_of(triangles)) {
-        auto &triangle = triangles[i];
-
-        // TODO - explain triangle format here
-
-        r.begin(&item_triangles[(triangle_count - 1 - i) * 4], 4);
-        auto triangle_unk0 = r.read_ubits(8);
-        auto vertex0       = r.read_ubits(12);
-        auto vertex1       = r.read_ubits(12);
-        r.end();
-
-        r.begin(&item_triangles[triangle_count * 4 + i * 2], 2);
-        auto triangle_unk1 = r.read_ubits(4);
-        auto vertex2       = r.read_ubits(12);
-        r.end();
-
-        triangle.v[0].vertex_index = vertex0;
-        triangle.v[1].vertex_index = vertex1;
-        triangle.v[2].vertex_index = vertex2;
-
-        triangle.v[0].color_index = -1;
-        triangle.v[1].color_index = -1;
-        triangle.v[2].color_index = -1;
-
-        triangle.unk0 = triangle_unk0;
-        triangle.unk1 = triangle_unk1;
-    }
+    decode_triangles(item_triangles.data(), triangles.data(), triangle_count);
 
     // Ensure the quad count is correct.
     if (quad_count != item_quads.size() / 8)
@@ -139,31 +491,7 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the quads.
     std::vector<gfx::quad> quads(quad_count);
-    r.begin(item_quads);
-    for (auto &&quad : quads) {
-        // TODO - explain quad format here
-
-        auto quad_unk0 = r.read_ubits(8);
-        auto vertex0   = r.read_ubits(12);
-        auto vertex1   = r.read_ubits(12);
-        auto quad_unk1 = r.read_ubits(8);
-        auto vertex2   = r.read_ubits(12);
-        auto vertex3   = r.read_ubits(12);
-
-        quad.v[0].vertex_index = vertex0;
-        quad.v[1].vertex_index = vertex1;
-        quad.v[2].vertex_index = vertex2;
-        quad.v[3].vertex_index = vertex3;
-
-        quad.v[0].color_index = -1;
-        quad.v[1].color_index = -1;
-        quad.v[2].color_index = -1;
-        quad.v[3].color_index = -1;
-
-        quad.unk0 = quad_unk0;
-        quad.unk1 = quad_unk1;
-    }
-    r.end();
+    decode_quads(item_quads.data(), quads.data(), quad_count);
 
     // Ensure the item4 count is correct.
     if (item4_count != item_4.size() / 12)
@@ -206,14 +534,47 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     // Parse the tpag references.
     // TODO
 
-    res::atom atom = get_proj().get_asset_root()
-        / "scenery"
-        / "$"_fmt(get_eid());
+    decoded d;
+    d.world_x = world_x;
+    d.world_y = world_y;
+    d.world_z = world_z;
+    d.info_unk0 = info_unk0;
+    d.tpag_ref_count = tpag_ref_count;
+    d.tpag_refs[0] = tpag_ref0;
+    d.tpag_refs[1] = tpag_ref1;
+    d.tpag_refs[2] = tpag_ref2;
+    d.tpag_refs[3] = tpag_ref3;
+    d.tpag_refs[4] = tpag_ref4;
+    d.tpag_refs[5] = tpag_ref5;
+    d.tpag_refs[6] = tpag_ref6;
+    d.tpag_refs[7] = tpag_ref7;
+    d.vertices = std::move(vertices);
+    d.triangles = std::move(triangles);
+    d.quads = std::move(quads);
+    d.colors = std::move(colors);
+    d.item4 = item_4;
+    d.item6 = item_6;
+    return d;
+}
+
+// declared in nsf.hh
+void wgeo_v2::import_decoded(TRANSACT, decoded d)
+{
+    assert_alive();
+
+    res::atom scenery = get_proj().get_asset_root() / "scenery";
+    res::atom atom = scenery / "$"_fmt(get_eid());
+
+    // Another file in the same project may already have scenery with this
+    // EID, in which case a numbered name is used instead.
+    for (int n = 2; atom.get(); n++) {
+        atom = scenery / "$-$"_fmt(get_eid(), n);
+    }
 
     // Create the frame which will contain this scene's vertex positions.
     gfx::frame::ref frame = atom / "frame";
     frame.create(TS, get_proj());
-    frame->set_vertices(TS, std::move(vertices));
+    frame->set_vertices(TS, std::move(d.vertices));
 
     // Create the animation for this scene (just one frame, scenes are not
     // vertex-animated).
@@ -224,9 +585,9 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     // Create the mesh for this scene.
     gfx::mesh::ref mesh = atom / "mesh";
     mesh.create(TS, get_proj());
-    mesh->set_triangles(TS, std::move(triangles));
-    mesh->set_quads(TS, std::move(quads));
-    mesh->set_colors(TS, std::move(colors));
+    mesh->set_triangles(TS, std::move(d.triangles));
+    mesh->set_quads(TS, std::move(d.quads));
+    mesh->set_colors(TS, std::move(d.colors));
 
     // Create the model for this scene.
     gfx::model::ref model = atom / "model";
@@ -238,35 +599,66 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     gfx::world::ref world = atom;
     world.create(TS, get_proj());
     world->set_model(TS, model);
-    world->set_x(TS, world_x);
-    world->set_y(TS, world_y);
-    world->set_z(TS, world_z);
+    world->set_x(TS, d.world_x);
+    world->set_y(TS, d.world_y);
+    world->set_z(TS, d.world_z);
 
     // Finish importing.
-    set_info_unk0(TS, info_unk0);
-    set_tpag_ref_count(TS, tpag_ref_count);
-    set_tpag_ref0(TS, tpag_ref0);
-    set_tpag_ref1(TS, tpag_ref1);
-    set_tpag_ref2(TS, tpag_ref2);
-    set_tpag_ref3(TS, tpag_ref3);
-    set_tpag_ref4(TS, tpag_ref4);
-    set_tpag_ref5(TS, tpag_ref5);
-    set_tpag_ref6(TS, tpag_ref6);
-    set_tpag_ref7(TS, tpag_ref7);
-    set_item4(TS, items[4]);
-    set_item6(TS, items[6]);
+    set_info_unk0(TS, d.info_unk0);
+    set_tpag_ref_count(TS, d.tpag_ref_count);
+    set_tpag_ref0(TS, d.tpag_refs[0]);
+    set_tpag_ref1(TS, d.tpag_refs[1]);
+    set_tpag_ref2(TS, d.tpag_refs[2]);
+    set_tpag_ref3(TS, d.tpag_refs[3]);
+    set_tpag_ref4(TS, d.tpag_refs[4]);
+    set_tpag_ref5(TS, d.tpag_refs[5]);
+    set_tpag_ref6(TS, d.tpag_refs[6]);
+    set_tpag_ref7(TS, d.tpag_refs[7]);
+    set_item4(TS, std::move(d.item4));
+    set_item6(TS, std::move(d.item6));
     set_world(TS, world);
 }
 
 // declared in nsf.hh
-std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
+void wgeo_v2::share_to(TRANSACT, res::atom name) const
+{
+    assert_alive();
+
+    wgeo_v2::ref result = name;
+    result.create(TS, get_proj());
+    result->set_eid(TS, get_eid());
+    result->set_info_unk0(TS, get_info_unk0());
+    result->set_tpag_ref_count(TS, get_tpag_ref_count());
+    result->set_tpag_ref0(TS, get_tpag_ref0());
+    result->set_tpag_ref1(TS, get_tpag_ref1());
+    result->set_tpag_ref2(TS, get_tpag_ref2());
+    result->set_tpag_ref3(TS, get_tpag_ref3());
+    result->set_tpag_ref4(TS, get_tpag_ref4());
+    result->set_tpag_ref5(TS, get_tpag_ref5());
+    result->set_tpag_ref6(TS, get_tpag_ref6());
+    result->set_tpag_ref7(TS, get_tpag_ref7());
+    result->set_item4(TS, get_item4());
+    result->set_item6(TS, get_item6());
+    result->set_world(TS, get_world());
+}
+
+// declared in res.hh
+void wgeo_v2::import_entry(TRANSACT, const std::vector<util::slice> &items)
+{
+    assert_alive();
+
+    import_decoded(TS, decode(items));
+}
+
+// declared in nsf.hh
+std::vector<util::slice> wgeo_v2::export_entry(uint32_t &out_type) const
 {
     assert_alive();
 
     util::binwriter w;
 
     out_type = 3;
-    std::vector<util::blob> items(7);
+    std::vector<util::slice> items(7);
 
     auto &item_info      = items[0];
     auto &item_vertices  = items[1];
@@ -276,29 +668,10 @@ std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
     auto &item_colors    = items[5];
     auto &item_6         = items[6];
 
-    auto &&world = get_world();
-    if (!world.ok())
-        throw res::export_error("nsf::wgeo_v2: bad world ref");
-
-    auto &&model = world->get_model();
-    if (!model.ok())
-        throw res::export_error("nsf::wgeo_v2: bad model ref");
-
-    auto &&mesh = model->get_mesh();
-    if (!mesh.ok())
-        throw res::export_error("nsf::wgeo_v2: bad mesh ref");
-
-    auto &&anim = model->get_anim();
-    if (!anim.ok())
-        throw res::export_error("nsf::wgeo_v2: bad anim ref");
-
-    auto &&frames = anim->get_frames();
-    if (frames.size() != 1)
-        throw res::export_error("nsf::wgeo_v2: invalid frame count");
-
-    auto &&frame = frames[0];
-    if (!frame.ok())
-        throw res::export_error("nsf::wgeo_v2: bad frame ref");
+    auto assets = find_export_assets(*this);
+    auto world = assets.world;
+    auto mesh = assets.mesh;
+    auto frame = assets.frame;
 
     // Export the info item (0).
     w.begin();
@@ -323,112 +696,478 @@ std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
     w.write_u32(get_tpag_ref7());
     item_info = w.end();
 
+    // Check the vertices and polygons before packing any of them. The checks
+    // are a single pass over each array which only notes whether anything
+    // was wrong; the slower validation which finds the actual problem only
+    // runs if so.
+    auto &&vertices = frame->get_vertices();
+    auto &&triangles = mesh->get_triangles();
+    auto &&quads = mesh->get_quads();
+    if (!vertices_ok(vertices.data(), vertices.size())) {
+        validate_vertices(vertices.data(), vertices.size());
+    }
+    if (!triangles_ok(triangles.data(), triangles.size())) {
+        validate_triangles(triangles.data(), triangles.size());
+    }
+    if (!quads_ok(quads.data(), quads.size())) {
+        validate_quads(quads.data(), quads.size());
+    }
+
     // Export the vertices.
-    const int COORD_MIN = -(1 << 11);
-    const int COORD_MAX = (1 << 11) - 1;
-    w.begin();
-    for (auto &&vertex : util::reverse_of(frame->get_vertices())) {
-        int x = vertex.x / 16.0f;
-        int z = vertex.z / 16.0f;
+    util::blob vertex_data(split_item_size(vertices.size()));
+    encode_vertices(vertices.data(), vertex_data.data(), vertices.size());
+    item_vertices = std::move(vertex_data);
 
-        if (x < COORD_MIN || x >= COORD_MAX ||
-            z < COORD_MIN || z >= COORD_MAX) {
-            throw res::export_error("nsf::wgeo_v2: vertex x/z out of range");
-        }
+    // Export the triangles.
+    util::blob triangle_data(split_item_size(triangles.size()));
+    encode_triangles(triangles.data(), triangle_data.data(), triangles.size());
+    item_triangles = std::move(triangle_data);
 
-        if (vertex.color_index == -1) {
-            throw res::export_error("nsf::wgeo_v2: vertex colors required");
+    // Export the quads.
+    util::blob quad_data(quads.size() * 8);
+    encode_quads(quads.data(), quad_data.data(), quads.size());
+    item_quads = std::move(quad_data);
+
+    // Export item4.
+    item_4 = get_item4();
+
+    // Export the colors.
+    auto &&colors = mesh->get_colors();
+    util::blob color_data(colors.size() * 4);
+    for (auto &&i : util::range_of(colors)) {
+        color_data[i * 4 + 0] = colors[i].r;
+        color_data[i * 4 + 1] = colors[i].g;
+        color_data[i * 4 + 2] = colors[i].b;
+    }
+    item_colors = std::move(color_data);
+
+    // Export item6.
+    item_6 = get_item6();
+
+    return items;
+}
+
+// declared in nsf.hh
+size_t wgeo_v2::export_size() const
+{
+    assert_alive();
+
+    auto assets = find_export_assets(*this);
+    auto &&mesh = *assets.mesh;
+
+    // These are the sizes of the items written by `export_entry'.
+    size_t item_bytes = info_item_size
+        + split_item_size(assets.frame->get_vertices().size())
+        + split_item_size(mesh.get_triangles().size())
+        + mesh.get_quads().size() * 8
+        + get_item4().size()
+        + mesh.get_colors().size() * 4
+        + get_item6().size();
+    return calculate_size(7, item_bytes);
+}
+
+// declared in nsf.hh
+void wgeo_v2::get_export_deps(std::vector<const res::asset *> &deps) const
+{
+    assert_alive();
+
+    auto &&world = get_world();
+    if (!world.ok())
+        return;
+    deps.push_back(&*world);
+
+    auto &&model = world->get_model();
+    if (!model.ok())
+        return;
+    deps.push_back(&*model);
+
+    auto &&mesh = model->get_mesh();
+    if (mesh.ok()) {
+        deps.push_back(&*mesh);
+    }
+
+    auto &&anim = model->get_anim();
+    if (!anim.ok())
+        return;
+    deps.push_back(&*anim);
+
+    for (auto &&frame : anim->get_frames()) {
+        if (frame.ok()) {
+            deps.push_back(&*frame);
         }
-        if (vertex.color_index < 0 || vertex.color_index >= (1L << 10)) {
-            throw res::export_error("nsf::wgeo_v2: vertex color out of range");
+    }
+}
+
+// declared in nsf.hh
+void wgeo_v2::get_related_eids(std::vector<eid> &eids) const
+{
+    assert_alive();
+
+    const uint32_t refs[] = {
+        get_tpag_ref0(),
+        get_tpag_ref1(),
+        get_tpag_ref2(),
+        get_tpag_ref3(),
+        get_tpag_ref4(),
+        get_tpag_ref5(),
+        get_tpag_ref6(),
+        get_tpag_ref7()
+    };
+    auto count = std::min<uint32_t>(get_tpag_ref_count(), 8);
+    eids.insert(eids.end(), refs, refs + count);
+}
+
+// (s-var) g_wgeo_v2_file_type
+// Allows `nsf::wgeo_v2' assets to be stored in project files.
+static res::file_type_of<wgeo_v2> g_wgeo_v2_file_type;
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// Fills a buffer with pseudo-random bytes from a fixed seed so that every bit
+// pattern in every field is likely to be exercised.
+util::blob random_bytes(size_t size, uint32_t seed)
+{
+    util::blob data(size);
+    for (auto &&b : data) {
+        seed = seed * 1664525 + 1013904223;
+        b = seed >> 24;
+    }
+    return data;
+}
+
+// The per-field bit reader decoding which the bulk decoders replaced, kept
+// here as the reference they must match exactly.
+std::vector<gfx::vertex> reference_vertices(const util::blob &item)
+{
+    util::binreader r;
+    size_t count = item.size() / 6;
+    std::vector<gfx::vertex> vertices(count);
+    for (auto &&i : util::range_of(vertices)) {
+        r.begin(&item[(count - 1 - i) * 4], 4);
+        auto color_mid  = r.read_ubits(4);
+        auto x          = r.read_sbits(12);
+        auto color_high = r.read_ubits(2);
+        auto fx         = r.read_ubits(2);
+        auto z          = r.read_sbits(12);
+        r.end();
+
+        r.begin(&item[count * 4 + i * 2], 2);
+        auto color_low = r.read_ubits(4);
+        auto y         = r.read_sbits(12);
+        r.end();
+
+        vertices[i].x = x * 16;
+        vertices[i].y = y * 16;
+        vertices[i].z = z * 16;
+        vertices[i].fx = fx;
+        vertices[i].color_index = color_low | color_mid << 4 | color_high << 8;
+    }
+    return vertices;
+}
+
+std::vector<gfx::triangle> reference_triangles(const util::blob &item)
+{
+    util::binreader r;
+    size_t count = item.size() / 6;
+    std::vector<gfx::triangle> triangles(count);
+    for (auto &&i : util::range_of(triangles)) {
+        r.begin(&item[(count - 1 - i) * 4], 4);
+        triangles[i].unk0 = r.read_ubits(8);
+        triangles[i].v[0].vertex_index = r.read_ubits(12);
+        triangles[i].v[1].vertex_index = r.read_ubits(12);
+        r.end();
+
+        r.begin(&item[count * 4 + i * 2], 2);
+        triangles[i].unk1 = r.read_ubits(4);
+        triangles[i].v[2].vertex_index = r.read_ubits(12);
+        r.end();
+
+        for (auto &&corner : triangles[i].v) {
+            corner.color_index = -1;
         }
+    }
+    return triangles;
+}
 
-        unsigned int color_high = (vertex.color_index >> 8) & 0x3;
-        unsigned int color_mid  = (vertex.color_index >> 4) & 0xF;
+std::vector<gfx::quad> reference_quads(const util::blob &item)
+{
+    util::binreader r;
+    std::vector<gfx::quad> quads(item.size() / 8);
+    r.begin(item);
+    for (auto &&quad : quads) {
+        quad.unk0 = r.read_ubits(8);
+        quad.v[0].vertex_index = r.read_ubits(12);
+        quad.v[1].vertex_index = r.read_ubits(12);
+        quad.unk1 = r.read_ubits(8);
+        quad.v[2].vertex_index = r.read_ubits(12);
+        quad.v[3].vertex_index = r.read_ubits(12);
+
+        for (auto &&corner : quad.v) {
+            corner.color_index = -1;
+        }
+    }
+    r.end();
+    return quads;
+}
 
-        w.write_ubits( 4, color_mid);
-        w.write_sbits(12, x);
-        w.write_ubits( 2, color_high);
-        w.write_ubits( 2, vertex.fx);
-        w.write_sbits(12, z);
+TEST(nsf_wgeo_v2, DecodeVerticesExact)
+{
+    for (size_t count : { 0, 1, 2, 7, 64, 1000 }) {
+        auto item = random_bytes(count * 6, count + 1);
+        auto expected = reference_vertices(item);
+        std::vector<gfx::vertex> actual(count);
+        decode_vertices(item.data(), actual.data(), count);
+        for (auto &&i : util::range_of(expected)) {
+            ASSERT_EQ(actual[i].x, expected[i].x);
+            ASSERT_EQ(actual[i].y, expected[i].y);
+            ASSERT_EQ(actual[i].z, expected[i].z);
+            ASSERT_EQ(actual[i].fx, expected[i].fx);
+            ASSERT_EQ(actual[i].color_index, expected[i].color_index);
+        }
     }
-    for (auto &&vertex : frame->get_vertices()) {
-        int y = vertex.y / 16.0f;
+}
 
-        if (y < COORD_MIN || y >= COORD_MAX) {
-            throw res::export_error("nsf::wgeo_v2: vertex y out of range");
+TEST(nsf_wgeo_v2, DecodeTrianglesExact)
+{
+    for (size_t count : { 0, 1, 2, 7, 64, 1000 }) {
+        auto item = random_bytes(count * 6, count + 2);
+        auto expected = reference_triangles(item);
+        std::vector<gfx::triangle> actual(count);
+        decode_triangles(item.data(), actual.data(), count);
+        for (auto &&i : util::range_of(expected)) {
+            for (int j = 0; j < 3; j++) {
+                ASSERT_EQ(
+                    actual[i].v[j].vertex_index,
+                    expected[i].v[j].vertex_index
+                );
+                ASSERT_EQ(
+                    actual[i].v[j].color_index,
+                    expected[i].v[j].color_index
+                );
+            }
+            ASSERT_EQ(actual[i].unk0, expected[i].unk0);
+            ASSERT_EQ(actual[i].unk1, expected[i].unk1);
         }
+    }
+}
 
-        // The vertex color index has already been range checked in the loop
-        // above.
+TEST(nsf_wgeo_v2, DecodeQuadsExact)
+{
+    for (size_t count : { 0, 1, 2, 7, 64, 1000 }) {
+        auto item = random_bytes(count * 8, count + 3);
+        auto expected = reference_quads(item);
+        std::vector<gfx::quad> actual(count);
+        decode_quads(item.data(), actual.data(), count);
+        for (auto &&i : util::range_of(expected)) {
+            for (int j = 0; j < 4; j++) {
+                ASSERT_EQ(
+                    actual[i].v[j].vertex_index,
+                    expected[i].v[j].vertex_index
+                );
+                ASSERT_EQ(
+                    actual[i].v[j].color_index,
+                    expected[i].v[j].color_index
+                );
+            }
+            ASSERT_EQ(actual[i].unk0, expected[i].unk0);
+            ASSERT_EQ(actual[i].unk1, expected[i].unk1);
+        }
+    }
+}
 
-        unsigned int color_low = vertex.color_index & 0xF;
 
-        w.write_ubits( 4, color_low);
-        w.write_sbits(12, y);
+// The per-field bit writer encoding which the bulk encoders replaced, kept
+// here as the reference they must match exactly.
+util::blob reference_encode_vertices(const std::vector<gfx::vertex> &vertices)
+{
+    util::binwriter w;
+    w.begin();
+    for (auto &&vertex : util::reverse_of(vertices)) {
+        w.write_ubits( 4, (vertex.color_index >> 4) & 0xF);
+        w.write_sbits(12, int(vertex.x / 16.0f));
+        w.write_ubits( 2, (vertex.color_index >> 8) & 0x3);
+        w.write_ubits( 2, vertex.fx);
+        w.write_sbits(12, int(vertex.z / 16.0f));
+    }
+    for (auto &&vertex : vertices) {
+        w.write_ubits( 4, vertex.color_index & 0xF);
+        w.write_sbits(12, int(vertex.y / 16.0f));
     }
     w.pad(4);
-    item_vertices = w.end();
+    return w.end();
+}
 
-    // Export the triangles.
+util::blob reference_encode_triangles(
+    const std::vector<gfx::triangle> &triangles)
+{
+    util::binwriter w;
     w.begin();
-    for (auto &&triangle : util::reverse_of(mesh->get_triangles())) {
+    for (auto &&triangle : util::reverse_of(triangles)) {
         w.write_ubits(8, triangle.unk0);
         w.write_ubits(12, triangle.v[0].vertex_index);
         w.write_ubits(12, triangle.v[1].vertex_index);
     }
-    for (auto &&triangle : mesh->get_triangles()) {
+    for (auto &&triangle : triangles) {
         w.write_ubits(4, triangle.unk1);
         w.write_ubits(12, triangle.v[2].vertex_index);
-
-        if (triangle.v[0].color_index != -1 ||
-            triangle.v[1].color_index != -1 ||
-            triangle.v[2].color_index != -1) {
-            throw res::export_error(
-                "nsf::wgeo_v2: corner colors not supported"
-            );
-        }
     }
     w.pad(4);
-    item_triangles = w.end();
+    return w.end();
+}
 
-    // Export the quads.
+util::blob reference_encode_quads(const std::vector<gfx::quad> &quads)
+{
+    util::binwriter w;
     w.begin();
-    for (auto &&quad : mesh->get_quads()) {
+    for (auto &&quad : quads) {
         w.write_ubits(8, quad.unk0);
         w.write_ubits(12, quad.v[0].vertex_index);
         w.write_ubits(12, quad.v[1].vertex_index);
         w.write_ubits(8, quad.unk1);
         w.write_ubits(12, quad.v[2].vertex_index);
         w.write_ubits(12, quad.v[3].vertex_index);
+    }
+    return w.end();
+}
 
-        if (quad.v[0].color_index != -1 || quad.v[1].color_index != -1 ||
-            quad.v[2].color_index != -1 || quad.v[3].color_index != -1) {
-            throw res::export_error(
-                "nsf::wgeo_v2: corner colors not supported"
-            );
+TEST(nsf_wgeo_v2, EncodeVerticesExact)
+{
+    for (size_t count : { 0, 1, 2, 7, 64, 1000 }) {
+        // Decode random data to get vertices covering the whole format, then
+        // pull any coordinates at the excluded maximum back into range.
+        auto item = random_bytes(count * 6, count + 4);
+        std::vector<gfx::vertex> vertices(count);
+        decode_vertices(item.data(), vertices.data(), count);
+        for (auto &&vertex : vertices) {
+            for (auto &&c : vertex.v) {
+                if (c == coord_max * 16) {
+                    c = 0;
+                }
+            }
         }
+        ASSERT_TRUE(vertices_ok(vertices.data(), count));
+
+        util::blob actual(split_item_size(count));
+        encode_vertices(vertices.data(), actual.data(), count);
+        ASSERT_EQ(actual, reference_encode_vertices(vertices));
     }
-    item_quads = w.end();
+}
 
-    // Export item4.
-    item_4 = get_item4();
+TEST(nsf_wgeo_v2, EncodePolygonsExact)
+{
+    for (size_t count : { 0, 1, 2, 7, 64, 1000 }) {
+        auto triangle_item = random_bytes(count * 6, count + 5);
+        std::vector<gfx::triangle> triangles(count);
+        decode_triangles(triangle_item.data(), triangles.data(), count);
+        ASSERT_TRUE(triangles_ok(triangles.data(), count));
+
+        util::blob triangle_actual(split_item_size(count));
+        encode_triangles(triangles.data(), triangle_actual.data(), count);
+        ASSERT_EQ(triangle_actual, reference_encode_triangles(triangles));
+
+        auto quad_item = random_bytes(count * 8, count + 6);
+        std::vector<gfx::quad> quads(count);
+        decode_quads(quad_item.data(), quads.data(), count);
+        ASSERT_TRUE(quads_ok(quads.data(), count));
+
+        util::blob quad_actual(count * 8);
+        encode_quads(quads.data(), quad_actual.data(), count);
+        ASSERT_EQ(quad_actual, quad_item);
+        ASSERT_EQ(quad_actual, reference_encode_quads(quads));
+    }
+}
 
-    // Export the colors.
-    w.begin();
-    for (auto &&color : mesh->get_colors()) {
-        w.write_u8(color.r);
-        w.write_u8(color.g);
-        w.write_u8(color.b);
-        w.write_u8(0);
+TEST(nsf_wgeo_v2, EncodeValidation)
+{
+    std::vector<gfx::vertex> vertices(3);
+    for (auto &&vertex : vertices) {
+        vertex.x = vertex.y = vertex.z = 0;
+        vertex.fx = 0;
+        vertex.color_index = 0;
+    }
+    EXPECT_TRUE(vertices_ok(vertices.data(), 3));
+    EXPECT_NO_THROW(validate_vertices(vertices.data(), 3));
+
+    vertices[1].y = coord_max * 16;
+    EXPECT_FALSE(vertices_ok(vertices.data(), 3));
+    EXPECT_THROW(
+        validate_vertices(vertices.data(), 3),
+        res::export_error
+    );
+    vertices[1].y = coord_min * 16;
+    EXPECT_TRUE(vertices_ok(vertices.data(), 3));
+
+    vertices[2].color_index = -1;
+    EXPECT_FALSE(vertices_ok(vertices.data(), 3));
+    vertices[2].color_index = 1 << 10;
+    EXPECT_FALSE(vertices_ok(vertices.data(), 3));
+    vertices[2].color_index = 0;
+    vertices[0].fx = 4;
+    EXPECT_FALSE(vertices_ok(vertices.data(), 3));
+
+    gfx::triangle triangle;
+    for (auto &&corner : triangle.v) {
+        corner.vertex_index = 4095;
+        corner.color_index = -1;
+    }
+    triangle.unk0 = 255;
+    triangle.unk1 = 15;
+    EXPECT_TRUE(triangles_ok(&triangle, 1));
+    triangle.unk1 = 16;
+    EXPECT_FALSE(triangles_ok(&triangle, 1));
+    EXPECT_THROW(validate_triangles(&triangle, 1), res::export_error);
+    triangle.unk1 = 0;
+    triangle.v[2].color_index = 0;
+    EXPECT_FALSE(triangles_ok(&triangle, 1));
+    EXPECT_THROW(validate_triangles(&triangle, 1), res::export_error);
+}
+
+TEST(nsf_wgeo_v2, ExportSize)
+{
+    // Odd counts of vertices and triangles exercise the padding of the split
+    // items.
+    wgeo_v2::decoded d{};
+    d.vertices.resize(3);
+    d.triangles.resize(5);
+    d.quads.resize(2);
+    d.colors.resize(4);
+    d.item4 = util::blob(24);
+    d.item6 = util::blob(8);
+    for (auto &&vertex : d.vertices) {
+        vertex.x = vertex.y = vertex.z = 0;
+        vertex.fx = 0;
+        vertex.color_index = 0;
+    }
+    for (auto &&triangle : d.triangles) {
+        for (auto &&corner : triangle.v) {
+            corner.vertex_index = 0;
+            corner.color_index = -1;
+        }
+    }
+    for (auto &&quad : d.quads) {
+        for (auto &&corner : quad.v) {
+            corner.vertex_index = 0;
+            corner.color_index = -1;
+        }
     }
-    item_colors = w.end();
 
-    // Export item6.
-    item_6 = get_item6();
+    res::project proj;
+    wgeo_v2::ref entry = proj.get_asset_root() / "entry";
+    proj.get_transact().run([&](TRANSACT) {
+        entry.create(TS, proj);
+        entry->import_decoded(TS, std::move(d));
+    });
+    EXPECT_EQ(entry->export_size(), entry->export_file().size());
+
+    proj.get_transact().run([&](TRANSACT) {
+        entry->set_world(TS, nullptr);
+    });
+    EXPECT_THROW(entry->export_size(), res::export_error);
+}
 
-    return items;
 }
+#endif
 
 }
 }
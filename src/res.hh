@@ -28,6 +28,7 @@
 
 #include <map>
 #include <vector>
+#include <typeinfo>
 #include "transact.hh"
 
 /*
@@ -253,6 +254,13 @@ public:
     // (event) on_asset_disappear
     // FIXME explain
     util::event<asset &> on_asset_disappear;
+
+    // (event) on_asset_change
+    // This event is raised after the value of any property on an asset in the
+    // project is changed, after the asset's own `on_prop_change' and the
+    // property's `on_change' event. This includes changes which occur due to
+    // undo, redo, or rollback.
+    util::event<asset &> on_asset_change;
 };
 
 /*
@@ -319,6 +327,26 @@ public:
         (new T(proj))->create_impl(TS, name);
     }
 
+    // (s-func) create<T>
+    // Like `create' above, but first calls `init' on the new asset, before it
+    // is added to the project and `project::on_asset_appear' is raised. This
+    // lets the asset be filled in, such as with `prop::set_loader', so that
+    // handlers for that event see it complete. `init' must not use the asset's
+    // name or change it as part of a transaction.
+    template <typename T, typename F>
+    static void create(TRANSACT, atom name, project &proj, F &&init)
+    {
+        if (!name)
+            throw std::logic_error("res::asset::create: name is null");
+
+        if (name.get())
+            throw std::logic_error("res::asset::create: name in use");
+
+        std::unique_ptr<T> p(new T(proj));
+        init(*p);
+        p.release()->create_impl(TS, name);
+    }
+
     // (func) rename
     // FIXME explain
     void rename(TRANSACT, atom name);
@@ -377,6 +405,7 @@ private:
             if (m_after) {
                 m_prop.m_owner.on_prop_change(&m_prop);
                 m_prop.on_change();
+                m_prop.m_owner.m_proj.on_asset_change(m_prop.m_owner);
             }
             m_after = !m_after;
         }
@@ -388,7 +417,24 @@ private:
 
     // (var) m_value
     // FIXME explain
-    T m_value;
+    mutable T m_value;
+
+    // (var) m_loader
+    // The function which will produce the property's value the first time it
+    // is accessed, or null if the value is already loaded. See `set_loader'.
+    mutable std::unique_ptr<std::function<T()>> m_loader;
+
+    // (func) load
+    // Runs and releases the pending loader, if any. If the loader throws, the
+    // error is propagated and the loader is kept, so the next access fails the
+    // same way instead of quietly reading a default value.
+    void load() const
+    {
+        if (m_loader) {
+            m_value = (*m_loader)();
+            m_loader = nullptr;
+        }
+    }
 
 public:
     // (ctor)
@@ -402,6 +448,7 @@ public:
     const T &get() const
     {
         m_owner.assert_alive();
+        load();
         return m_value;
     }
 
@@ -410,11 +457,24 @@ public:
     void set(TRANSACT, T value)
     {
         m_owner.assert_alive();
+        load();
         TS.push_op(std::make_unique<change_op>(*this, false));
         TS.set(m_value, std::move(value));
         TS.push_op(std::make_unique<change_op>(*this, true));
     }
 
+    // (func) set_loader
+    // Defers the property's value to the given function, which is run on the
+    // first `get' or `set'. This is not part of any transaction and raises no
+    // change events, so it is only meant for filling in assets which have
+    // just been created, such as when loading a project file (see
+    // `res::load_project'). The property must not be accessed concurrently
+    // while its value is pending.
+    void set_loader(std::function<T()> loader)
+    {
+        m_loader = std::make_unique<std::function<T()>>(std::move(loader));
+    }
+
     // (event) on_change
     // This event is raised after the value of the property is changed. This
     // includes changes which occur due to undo or redo.
@@ -603,6 +663,38 @@ public:
     using runtime_error::runtime_error;
 };
 
+/*
+ * res::save_project, res::save_assets, res::load_project
+ *
+ * These functions write and read DRNSF's own project file format, which holds
+ * every asset in a project with all of the properties exposed by its type's
+ * `reflect' function.
+ *
+ * The file begins with a table of the asset names, the asset types and the
+ * labels of their fields, and the offset and size of each asset's field data.
+ * The header also holds a hash of the field data, which is checked when the
+ * file is loaded so that a damaged file is rejected up front rather than by
+ * whichever property read first comes across the damage.
+ * Loading a project only reads these tables and creates the assets; each
+ * property is given a loader which decodes its data from the file when it is
+ * first accessed. Byte data such as entry items is not copied at all, but
+ * left pointing into the file, so the file data should be memory-mapped (see
+ * `util::mapped_file').
+ *
+ * `save_assets' writes only the given assets, such as those created by one
+ * import. Refs to other assets are still saved by name.
+ *
+ * Only the asset types registered with `res::file_type' are supported. Saving
+ * a project holding any other type of asset throws `res::export_error'.
+ * Loading a file with unknown asset types or which is otherwise malformed
+ * throws `res::import_error'. Fields which are missing from the file keep
+ * their default values, and fields in the file which the asset type no
+ * longer has are ignored.
+ */
+void save_project(project &proj, std::ostream &out);
+void save_assets(const std::vector<asset *> &assets, std::ostream &out);
+void load_project(TRANSACT, project &proj, const util::slice &data);
+
 }
 
 namespace reflect {
@@ -637,5 +729,358 @@ struct asset_type_info<res::asset> {
     static constexpr const char *name = "res::asset";
 };
 
+}
+
+namespace res {
+
+/*
+ * res::file_encoder, res::file_decoder
+ *
+ * These classes write and read the field data of a project file (see
+ * `res::save_project'). Values are stored little-endian, and names are stored
+ * as indices into the file's name table. Byte data read by `file_decoder' is
+ * returned as slices sharing the file's storage rather than copies.
+ *
+ * Each type of value held by a saved asset property needs a pair of `encode'
+ * and `decode' functions. The ones for integers, floating-point values,
+ * slices, refs and vectors are declared below; other modules declare theirs
+ * next to their own value types, where they are found by argument-dependent
+ * lookup.
+ */
+class file_name_table;
+
+class file_encoder : private util::nocopy {
+private:
+    util::blob &m_buf;
+    file_name_table *m_names;
+
+public:
+    explicit file_encoder(util::blob &buf, file_name_table *names = nullptr) :
+        m_buf(buf),
+        m_names(names) {}
+
+    // (func) size
+    // Gets the number of bytes in the buffer.
+    size_t size() const
+    {
+        return m_buf.size();
+    }
+
+    // (func) put_uint
+    // Appends the low `bytes' bytes of the given value.
+    void put_uint(uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++) {
+            m_buf.push_back(value >> (i * 8));
+        }
+    }
+
+    // (func) put_bytes
+    // Appends the given bytes.
+    void put_bytes(const util::byte *data, size_t size)
+    {
+        m_buf.insert(m_buf.end(), data, data + size);
+    }
+
+    // (func) put_string
+    // Appends a string with a 16-bit length.
+    void put_string(const std::string &s);
+
+    // (func) put_name
+    // Appends the index of the given name, adding it to the name table.
+    void put_name(const atom &name);
+};
+
+class file_decoder : private util::nocopy {
+private:
+    util::slice m_data;
+    size_t m_pos = 0;
+    const std::vector<atom> *m_names;
+
+    // (func) need
+    // Ensures there are at least `size' bytes remaining.
+    void need(size_t size) const;
+
+public:
+    explicit file_decoder(
+        util::slice data,
+        const std::vector<atom> *names = nullptr) :
+        m_data(std::move(data)),
+        m_names(names) {}
+
+    // (func) get_pos, get_remaining
+    // Gets the number of bytes read so far, and the number left to read.
+    size_t get_pos() const
+    {
+        return m_pos;
+    }
+    size_t get_remaining() const
+    {
+        return m_data.size() - m_pos;
+    }
+
+    // (func) get_uint
+    // Reads a little-endian unsigned value of `bytes' bytes.
+    uint64_t get_uint(int bytes)
+    {
+        need(bytes);
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value |= uint64_t(m_data[m_pos + i]) << (i * 8);
+        }
+        m_pos += bytes;
+        return value;
+    }
+
+    // (func) get_bytes
+    // Reads `size' bytes as a slice sharing the file's storage.
+    util::slice get_bytes(size_t size);
+
+    // (func) get_string
+    // Reads a string with a 16-bit length.
+    std::string get_string();
+
+    // (func) get_count
+    // Reads a 32-bit element count, ensuring that there are at least that
+    // many bytes left so a corrupt count cannot cause a huge allocation.
+    size_t get_count();
+
+    // (func) get_name
+    // Reads a name index and returns the name it stands for.
+    atom get_name();
+
+    // (func) finish
+    // Ensures all of the data has been read.
+    void finish() const;
+};
+
+template <typename T>
+std::enable_if_t<std::is_integral<T>::value> encode(
+    file_encoder &enc,
+    T value)
+{
+    enc.put_uint(std::make_unsigned_t<T>(value), sizeof(T));
+}
+template <typename T>
+std::enable_if_t<std::is_integral<T>::value> decode(
+    file_decoder &dec,
+    T &value)
+{
+    value = T(dec.get_uint(sizeof(T)));
+}
+
+void encode(file_encoder &enc, double value);
+void decode(file_decoder &dec, double &value);
+
+void encode(file_encoder &enc, float value);
+void decode(file_decoder &dec, float &value);
+
+void encode(file_encoder &enc, const util::slice &value);
+void decode(file_decoder &dec, util::slice &value);
+
+template <typename T>
+void encode(file_encoder &enc, const ref<T> &value)
+{
+    enc.put_name(value);
+}
+template <typename T>
+void decode(file_decoder &dec, ref<T> &value)
+{
+    value = dec.get_name();
+}
+
+template <typename T>
+void encode(file_encoder &enc, const std::vector<T> &value)
+{
+    if (value.size() > UINT32_MAX)
+        throw export_error("res::save_project: list too long");
+
+    enc.put_uint(value.size(), 4);
+    for (auto &&element : value) {
+        encode(enc, element);
+    }
+}
+template <typename T>
+void decode(file_decoder &dec, std::vector<T> &value)
+{
+    value.resize(dec.get_count());
+    for (auto &&element : value) {
+        decode(dec, element);
+    }
+}
+
+/*
+ * res::file_field_loc
+ *
+ * The location of one field's data in the payload section of a project file.
+ */
+struct file_field_loc {
+    uint64_t offset;
+    uint32_t size;
+};
+
+/*
+ * res::file_label_reflector, res::file_save_reflector,
+ * res::file_load_reflector
+ *
+ * These are passed to an asset's `reflect' function to collect the labels of
+ * its fields, to encode each field into the payload, and to give each field a
+ * loader which decodes its data from the file on first access.
+ *
+ * For `file_load_reflector', `field_map' gives the index of each of the asset
+ * type's fields within the file's fields for that type, or -1 if the file does
+ * not have the field.
+ */
+class file_label_reflector {
+public:
+    std::vector<std::string> labels;
+
+    template <typename T>
+    void field(prop<T> &prop, const std::string &label)
+    {
+        labels.push_back(label);
+    }
+};
+
+class file_save_reflector {
+private:
+    file_encoder &m_enc;
+
+public:
+    std::vector<file_field_loc> locs;
+
+    explicit file_save_reflector(file_encoder &enc) :
+        m_enc(enc) {}
+
+    template <typename T>
+    void field(prop<T> &prop, const std::string &label)
+    {
+        auto start = m_enc.size();
+        encode(m_enc, prop.get());
+        locs.push_back({ start, uint32_t(m_enc.size() - start) });
+    }
+};
+
+class file_load_reflector {
+private:
+    const util::slice &m_payload;
+    std::shared_ptr<const std::vector<atom>> m_names;
+    const std::vector<int> &m_field_map;
+    const file_field_loc *m_locs;
+    size_t m_index = 0;
+
+public:
+    explicit file_load_reflector(
+        const util::slice &payload,
+        std::shared_ptr<const std::vector<atom>> names,
+        const std::vector<int> &field_map,
+        const file_field_loc *locs) :
+        m_payload(payload),
+        m_names(std::move(names)),
+        m_field_map(field_map),
+        m_locs(locs) {}
+
+    template <typename T>
+    void field(prop<T> &prop, const std::string &label)
+    {
+        auto file_index = m_field_map[m_index++];
+        if (file_index < 0)
+            return;
+
+        auto &&loc = m_locs[file_index];
+        auto data = m_payload.sub(loc.offset, loc.size);
+        prop.set_loader([data, names = m_names] {
+            file_decoder dec(data, names.get());
+            T value{};
+            decode(dec, value);
+            dec.finish();
+            return value;
+        });
+    }
+};
+
+/*
+ * res::file_type, res::file_type_of
+ *
+ * An asset type which may be stored in a project file. Each module defines a
+ * static `file_type_of<T>' object for each of its concrete asset types, in
+ * the same way as `edit::modedef_of'. Saving an asset of a type with no such
+ * object throws `res::export_error', and loading a file which lists one
+ * throws `res::import_error'.
+ *
+ * The type is stored in the file under its `reflect::asset_type_info' name.
+ */
+class file_type : private util::nocopy {
+private:
+    const char *m_name;
+    const std::type_info &m_type;
+
+protected:
+    explicit file_type(const char *name, const std::type_info &type);
+    ~file_type();
+
+public:
+    // (s_func) get_list
+    // Gets every file type which currently exists.
+    static const std::vector<const file_type *> &get_list();
+
+    // (func) get_name, get_type
+    // Gets the name the type is stored under, and the C++ type itself.
+    const char *get_name() const
+    {
+        return m_name;
+    }
+    const std::type_info &get_type() const
+    {
+        return m_type;
+    }
+
+    // (pure func) create
+    // Creates an asset of this type, running `init' on it before it appears
+    // in the project (see `asset::create').
+    virtual void create(
+        TRANSACT,
+        const atom &name,
+        project &proj,
+        const std::function<void(asset &)> &init) const = 0;
+
+    // (pure func) get_labels, save, load
+    // Reflects the given asset, which must be of this type.
+    virtual void get_labels(asset &asset, file_label_reflector &rfl) const = 0;
+    virtual void save(asset &asset, file_save_reflector &rfl) const = 0;
+    virtual void load(asset &asset, file_load_reflector &rfl) const = 0;
+};
+
+template <typename T>
+class file_type_of : private file_type {
+public:
+    void create(
+        TRANSACT,
+        const atom &name,
+        project &proj,
+        const std::function<void(asset &)> &init) const override
+    {
+        asset::create<T>(TS, name, proj, init);
+    }
+
+    void get_labels(asset &asset, file_label_reflector &rfl) const override
+    {
+        static_cast<T &>(asset).reflect(rfl);
+    }
+
+    void save(asset &asset, file_save_reflector &rfl) const override
+    {
+        static_cast<T &>(asset).reflect(rfl);
+    }
+
+    void load(asset &asset, file_load_reflector &rfl) const override
+    {
+        static_cast<T &>(asset).reflect(rfl);
+    }
+
+    file_type_of() :
+        file_type(reflect::asset_type_info<T>::name, typeid(T)) {}
+};
+
 }
 }
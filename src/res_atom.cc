@@ -20,6 +20,7 @@
 
 #include "common.hh"
 #include <cstring>
+#include <atomic>
 #include "res.hh"
 
 namespace drnsf {
@@ -38,8 +39,12 @@ struct nucleus_name_comparator {
 // FIXME explain
 struct atom::nucleus {
     // (var) m_refcount
-    // FIXME explain
-    int m_refcount;
+    // The number of atoms referring to this nucleus, plus one for each child
+    // nucleus. This is atomic so that existing atoms may be copied and
+    // destroyed from several threads at once, such as while exporting pages
+    // in parallel. Creating or releasing the last reference to a nucleus
+    // modifies the tree and is still only safe from one thread.
+    std::atomic<int> m_refcount;
 
     // (var) m_name
     // FIXME explain
@@ -92,7 +97,7 @@ atom atom::make_root(project *proj)
     nuc->m_name = "_ROOT";
     nuc->m_parent = nullptr;
     nuc->m_asset = nullptr;
-    std::memcpy(nuc + 1, &proj, sizeof(project *));
+    std::memcpy(static_cast<void *>(nuc + 1), &proj, sizeof(project *));
     return atom(nuc);
 }
 
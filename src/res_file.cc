@@ -0,0 +1,699 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "common.hh"
+#include <cstring>
+#include <algorithm>
+#include <typeinfo>
+#include "res.hh"
+
+namespace drnsf {
+namespace res {
+
+namespace {
+
+// (internal const) file_magic, file_version
+// The magic number ("DRPJ") and format version at the start of a project file.
+constexpr uint32_t file_magic = 0x4A505244;
+constexpr uint32_t file_version = 2;
+
+// (internal const) null_name, root_name
+// The indices in the name table which stand for a null atom and for the root
+// of the project. The names stored in the file follow these.
+constexpr uint32_t null_name = 0;
+constexpr uint32_t root_name = 1;
+
+// (internal func) get_file_types
+// Gets the list of registered file types. This is a function-local static so
+// that it exists before the first `file_type' object in any other translation
+// unit is constructed.
+std::vector<const file_type *> &get_file_types()
+{
+    static std::vector<const file_type *> s_file_types;
+    return s_file_types;
+}
+
+}
+
+// (class) file_name_table
+// The asset names written to a project file, each stored once as its parent's
+// index and its own last path component. A parent is always added before its
+// children.
+class file_name_table : private util::nocopy {
+private:
+    std::map<atom, uint32_t> m_indices;
+    uint32_t m_next = root_name + 1;
+    util::blob m_data;
+
+public:
+    // (func) add
+    // Returns the index of the given name, adding it and any of its parents
+    // which are not in the table yet.
+    uint32_t add(const atom &name);
+
+    // (func) get_count, get_data
+    // Gets the number of names in the table (not including the null and root
+    // names), and the encoded table.
+    uint32_t get_count() const
+    {
+        return m_next - root_name - 1;
+    }
+    const util::blob &get_data() const
+    {
+        return m_data;
+    }
+};
+
+// declared above
+uint32_t file_name_table::add(const atom &name)
+{
+    if (!name)
+        return null_name;
+
+    if (name == name.get_proj()->get_asset_root())
+        return root_name;
+
+    auto iter = m_indices.find(name);
+    if (iter != m_indices.end())
+        return iter->second;
+
+    auto parent = add(name.get_parent());
+    file_encoder enc(m_data);
+    enc.put_uint(parent, 4);
+    enc.put_string(name.name());
+
+    auto index = m_next++;
+    m_indices.insert({ name, index });
+    return index;
+}
+
+// declared in res.hh
+void file_encoder::put_string(const std::string &s)
+{
+    if (s.size() > UINT16_MAX)
+        throw export_error("res::save_project: string too long");
+
+    put_uint(s.size(), 2);
+    put_bytes(reinterpret_cast<const util::byte *>(s.data()), s.size());
+}
+
+// declared in res.hh
+void file_encoder::put_name(const atom &name)
+{
+    put_uint(m_names->add(name), 4);
+}
+
+// declared in res.hh
+void file_decoder::need(size_t size) const
+{
+    if (size > m_data.size() - m_pos)
+        throw import_error("res::load_project: unexpected end of data");
+}
+
+// declared in res.hh
+util::slice file_decoder::get_bytes(size_t size)
+{
+    need(size);
+    auto result = m_data.sub(m_pos, size);
+    m_pos += size;
+    return result;
+}
+
+// declared in res.hh
+std::string file_decoder::get_string()
+{
+    auto size = get_uint(2);
+    need(size);
+    std::string result(
+        reinterpret_cast<const char *>(m_data.data() + m_pos),
+        size
+    );
+    m_pos += size;
+    return result;
+}
+
+// declared in res.hh
+size_t file_decoder::get_count()
+{
+    auto count = get_uint(4);
+    need(count);
+    return count;
+}
+
+// declared in res.hh
+atom file_decoder::get_name()
+{
+    auto index = get_uint(4);
+    if (index >= m_names->size())
+        throw import_error("res::load_project: bad name index");
+    return (*m_names)[index];
+}
+
+// declared in res.hh
+void file_decoder::finish() const
+{
+    if (m_pos != m_data.size())
+        throw import_error("res::load_project: extra data in field");
+}
+
+// declared in res.hh
+void encode(file_encoder &enc, double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    enc.put_uint(bits, 8);
+}
+void decode(file_decoder &dec, double &value)
+{
+    uint64_t bits = dec.get_uint(8);
+    std::memcpy(&value, &bits, sizeof(value));
+}
+
+// declared in res.hh
+void encode(file_encoder &enc, float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    enc.put_uint(bits, 4);
+}
+void decode(file_decoder &dec, float &value)
+{
+    uint32_t bits = dec.get_uint(4);
+    std::memcpy(&value, &bits, sizeof(value));
+}
+
+// declared in res.hh
+void encode(file_encoder &enc, const util::slice &value)
+{
+    if (value.size() > UINT32_MAX)
+        throw export_error("res::save_project: data too large");
+
+    enc.put_uint(value.size(), 4);
+    enc.put_bytes(value.data(), value.size());
+}
+void decode(file_decoder &dec, util::slice &value)
+{
+    value = dec.get_bytes(dec.get_uint(4));
+}
+
+// declared in res.hh
+file_type::file_type(const char *name, const std::type_info &type) :
+    m_name(name),
+    m_type(type)
+{
+    get_file_types().push_back(this);
+}
+
+// declared in res.hh
+file_type::~file_type()
+{
+    auto &&types = get_file_types();
+    types.erase(std::find(types.begin(), types.end(), this));
+}
+
+// declared in res.hh
+const std::vector<const file_type *> &file_type::get_list()
+{
+    return get_file_types();
+}
+
+namespace {
+
+// (internal struct) listed_type
+// An asset type as listed in a project file being loaded.
+struct listed_type {
+    const file_type *type = nullptr;
+    std::vector<std::string> labels;
+
+    // (var) field_map
+    // See `file_load_reflector'. This is filled in when the first asset of this
+    // type is created.
+    std::vector<int> field_map;
+    bool field_map_ready = false;
+};
+
+// (internal struct) file_asset
+// An asset as listed in a project file being loaded.
+struct file_asset {
+    uint32_t name;
+    uint16_t type;
+    size_t first_loc;
+};
+
+}
+
+// declared in res.hh
+void save_project(project &proj, std::ostream &out)
+{
+    std::vector<asset *> assets;
+    assets.reserve(proj.get_asset_list().size());
+    for (auto &&asset : proj.get_asset_list()) {
+        assets.push_back(asset.get());
+    }
+    save_assets(assets, out);
+}
+
+// declared in res.hh
+void save_assets(const std::vector<asset *> &assets, std::ostream &out)
+{
+    file_name_table names;
+    util::blob payload;
+    file_encoder payload_enc(payload, &names);
+
+    // The index in the file's type table of each type used, and the labels
+    // of their fields, taken from the first asset of each type.
+    std::map<const file_type *, uint16_t> type_indices;
+    std::vector<const file_type *> types;
+    std::vector<std::vector<std::string>> type_labels;
+
+    util::blob asset_table;
+    file_encoder asset_enc(asset_table, &names);
+    for (auto &&asset : assets) {
+        const file_type *type = nullptr;
+        for (auto &&known_type : get_file_types()) {
+            if (typeid(*asset) == known_type->get_type()) {
+                type = known_type;
+                break;
+            }
+        }
+        if (!type)
+            throw export_error("res::save_project: unsupported asset type");
+
+        auto type_iter = type_indices.find(type);
+        if (type_iter == type_indices.end()) {
+            file_label_reflector rfl;
+            type->get_labels(*asset, rfl);
+            type_iter = type_indices.insert({ type, types.size() }).first;
+            types.push_back(type);
+            type_labels.push_back(std::move(rfl.labels));
+        }
+
+        file_save_reflector rfl(payload_enc);
+        type->save(*asset, rfl);
+
+        asset_enc.put_name(asset->get_name());
+        asset_enc.put_uint(type_iter->second, 2);
+        for (auto &&loc : rfl.locs) {
+            asset_enc.put_uint(loc.offset, 8);
+            asset_enc.put_uint(loc.size, 4);
+        }
+    }
+
+    util::blob head;
+    file_encoder head_enc(head);
+    head_enc.put_uint(file_magic, 4);
+    head_enc.put_uint(file_version, 4);
+    head_enc.put_uint(names.get_count(), 4);
+    head_enc.put_uint(types.size(), 4);
+    head_enc.put_uint(assets.size(), 4);
+    head_enc.put_uint(util::hash64(payload.data(), payload.size()), 8);
+    head_enc.put_bytes(names.get_data().data(), names.get_data().size());
+    for (auto &&i : util::range_of(types)) {
+        head_enc.put_string(types[i]->get_name());
+        head_enc.put_uint(type_labels[i].size(), 2);
+        for (auto &&label : type_labels[i]) {
+            head_enc.put_string(label);
+        }
+    }
+
+    for (auto &&part : { &head, &asset_table, &payload }) {
+        out.write(reinterpret_cast<const char *>(part->data()), part->size());
+    }
+}
+
+// declared in res.hh
+void load_project(TRANSACT, project &proj, const util::slice &data)
+{
+    file_decoder dec(data);
+    if (dec.get_uint(4) != file_magic)
+        throw import_error("res::load_project: bad magic number");
+    if (dec.get_uint(4) != file_version)
+        throw import_error("res::load_project: unsupported version");
+
+    auto name_count = dec.get_uint(4);
+    auto type_count = dec.get_uint(4);
+    auto asset_count = dec.get_uint(4);
+    auto payload_hash = dec.get_uint(8);
+
+    // Read the names. Each name's parent has a lower index, so the atom for
+    // the parent is always available.
+    auto names = std::make_shared<std::vector<atom>>();
+    names->reserve(root_name + 1 + std::min<uint64_t>(name_count, 1 << 20));
+    names->push_back(nullptr);
+    names->push_back(proj.get_asset_root());
+    for (uint64_t i = 0; i < name_count; i++) {
+        auto parent = dec.get_uint(4);
+        auto name = dec.get_string();
+        if (parent < root_name || parent >= names->size())
+            throw import_error("res::load_project: bad name parent");
+        if (name.empty() || name.find('/') != std::string::npos)
+            throw import_error("res::load_project: bad name");
+        names->push_back((*names)[parent] / name);
+    }
+
+    // Read the types, matching them up with the types known here.
+    std::vector<listed_type> types(type_count);
+    for (auto &&type : types) {
+        auto name = dec.get_string();
+        for (auto &&known_type : get_file_types()) {
+            if (name == known_type->get_name()) {
+                type.type = known_type;
+                break;
+            }
+        }
+        if (!type.type)
+            throw import_error("res::load_project: unknown asset type");
+
+        type.labels.resize(dec.get_uint(2));
+        for (auto &&label : type.labels) {
+            label = dec.get_string();
+        }
+    }
+
+    // Read the asset table.
+    std::vector<file_asset> assets;
+    std::vector<file_field_loc> locs;
+    for (uint64_t i = 0; i < asset_count; i++) {
+        file_asset asset;
+        asset.name = dec.get_uint(4);
+        asset.type = dec.get_uint(2);
+        asset.first_loc = locs.size();
+        if (asset.name <= root_name || asset.name >= names->size())
+            throw import_error("res::load_project: bad asset name");
+        if (asset.type >= types.size())
+            throw import_error("res::load_project: bad asset type");
+
+        auto field_count = types[asset.type].labels.size();
+        for (size_t j = 0; j < field_count; j++) {
+            file_field_loc loc;
+            loc.offset = dec.get_uint(8);
+            loc.size = dec.get_uint(4);
+            locs.push_back(loc);
+        }
+        assets.push_back(asset);
+    }
+
+    // The rest of the file holds the field data.
+    auto payload = data.sub(dec.get_pos(), dec.get_remaining());
+    if (util::hash64(payload.data(), payload.size()) != payload_hash)
+        throw import_error("res::load_project: payload is corrupt");
+    for (auto &&loc : locs) {
+        if (loc.offset > payload.size() ||
+            loc.size > payload.size() - loc.offset)
+            throw import_error("res::load_project: field out of bounds");
+    }
+
+    // Create the assets, leaving each of their properties to be loaded on
+    // first access. The loaders are given to each asset before it appears in
+    // the project, so that handlers of `project::on_asset_appear' (such as
+    // the EID index of `nsf::archive') see the loaded values.
+    for (auto &&asset : assets) {
+        auto &&name = (*names)[asset.name];
+        auto &&type = types[asset.type];
+        if (name.get())
+            throw import_error("res::load_project: asset name in use");
+
+        type.type->create(TS, name, proj, [&](res::asset &new_asset) {
+            if (!type.field_map_ready) {
+                file_label_reflector rfl;
+                type.type->get_labels(new_asset, rfl);
+                for (auto &&label : rfl.labels) {
+                    auto iter = std::find(
+                        type.labels.begin(),
+                        type.labels.end(),
+                        label
+                    );
+                    if (iter == type.labels.end()) {
+                        type.field_map.push_back(-1);
+                    } else {
+                        type.field_map.push_back(iter - type.labels.begin());
+                    }
+                }
+                type.field_map_ready = true;
+            }
+
+            file_load_reflector rfl(
+                payload,
+                names,
+                type.field_map,
+                locs.data() + asset.first_loc
+            );
+            type.type->load(new_asset, rfl);
+        });
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (internal class) test_asset
+// An asset type with one field of each kind of value supported by res itself,
+// for the tests below.
+class test_asset : public asset {
+    friend class asset;
+
+private:
+    explicit test_asset(project &proj) :
+        asset(proj) {}
+
+public:
+    using ref = res::ref<test_asset>;
+
+    DEFINE_APROP(number, int32_t);
+    DEFINE_APROP(real, double);
+    DEFINE_APROP(data, util::slice);
+    DEFINE_APROP(other, res::ref<asset>);
+    DEFINE_APROP(list, std::vector<float>);
+
+    template <typename Reflector>
+    void reflect(Reflector &rfl)
+    {
+        asset::reflect(rfl);
+        rfl.field(p_number, "Number");
+        rfl.field(p_real, "Real");
+        rfl.field(p_data, "Data");
+        rfl.field(p_other, "Other");
+        rfl.field(p_list, "List");
+    }
+};
+
+}
+}
+
+namespace reflect {
+
+template <>
+struct asset_type_info<res::test_asset> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "res::test_asset";
+};
+
+}
+
+namespace res {
+namespace {
+
+file_type_of<test_asset> g_test_asset_file_type;
+
+// (internal func) save_and_load
+// Saves the given assets, or the whole project if none are given, and loads
+// the file into `proj2'. Returns the file data.
+util::slice save_and_load(
+    project &proj,
+    project &proj2,
+    const std::vector<asset *> &assets = {})
+{
+    std::ostringstream out;
+    if (assets.empty()) {
+        save_project(proj, out);
+    } else {
+        save_assets(assets, out);
+    }
+    auto str = out.str();
+    util::slice data = util::blob(str.begin(), str.end());
+
+    proj2.get_transact().run([&](TRANSACT) {
+        load_project(TS, proj2, data);
+    });
+    return data;
+}
+
+TEST(res_file, RoundTrip)
+{
+    project proj;
+    auto root = proj.get_asset_root();
+    test_asset::ref a = root / "dir" / "a";
+    test_asset::ref b = root / "b";
+    proj.get_transact().run([&](TRANSACT) {
+        a.create(TS, proj);
+        a->set_number(TS, -5);
+        a->set_real(TS, 0.25);
+        a->set_data(TS, util::blob{ 1, 2, 3 });
+        a->set_list(TS, { 1.5f, -2.0f });
+
+        b.create(TS, proj);
+    });
+
+    project proj2;
+    auto root2 = proj2.get_asset_root();
+    auto data = save_and_load(proj, proj2);
+    EXPECT_EQ(proj2.get_asset_list().size(), 2u);
+
+    test_asset::ref a2 = root2 / "dir" / "a";
+    ASSERT_TRUE(a2.ok());
+    EXPECT_EQ(a2->get_number(), -5);
+    EXPECT_EQ(a2->get_real(), 0.25);
+    EXPECT_EQ(a2->get_data().to_blob(), (util::blob{ 1, 2, 3 }));
+    EXPECT_EQ(a2->get_list(), (std::vector<float>{ 1.5f, -2.0f }));
+    EXPECT_FALSE(a2->get_other());
+
+    // Byte data is left pointing into the file data.
+    auto a2_data = a2->get_data().data();
+    EXPECT_GE(a2_data, data.data());
+    EXPECT_LT(a2_data, data.data() + data.size());
+
+    test_asset::ref b2 = root2 / "b";
+    ASSERT_TRUE(b2.ok());
+    EXPECT_EQ(b2->get_number(), 0);
+    EXPECT_TRUE(b2->get_data().empty());
+}
+
+TEST(res_file, Refs)
+{
+    project proj;
+    auto root = proj.get_asset_root();
+    test_asset::ref a = root / "a" / "x";
+    test_asset::ref b = root / "b" / "y";
+    proj.get_transact().run([&](TRANSACT) {
+        a.create(TS, proj);
+        a->set_other(TS, b);
+        b.create(TS, proj);
+        b->set_other(TS, root / "missing");
+    });
+
+    project proj2;
+    auto root2 = proj2.get_asset_root();
+    save_and_load(proj, proj2);
+
+    test_asset::ref a2 = root2 / "a" / "x";
+    test_asset::ref b2 = root2 / "b" / "y";
+    ASSERT_TRUE(a2.ok());
+    ASSERT_TRUE(b2.ok());
+    EXPECT_EQ(a2->get_other(), b2);
+    EXPECT_EQ(b2->get_other(), root2 / "missing");
+}
+
+TEST(res_file, SaveAssets)
+{
+    project proj;
+    auto root = proj.get_asset_root();
+    test_asset::ref a = root / "a";
+    test_asset::ref b = root / "b";
+    proj.get_transact().run([&](TRANSACT) {
+        a.create(TS, proj);
+        b.create(TS, proj);
+        a->set_other(TS, b);
+    });
+
+    project proj2;
+    auto root2 = proj2.get_asset_root();
+    save_and_load(proj, proj2, { a.get() });
+    EXPECT_EQ(proj2.get_asset_list().size(), 1u);
+
+    test_asset::ref a2 = root2 / "a";
+    ASSERT_TRUE(a2.ok());
+    EXPECT_EQ(a2->get_other(), root2 / "b");
+    EXPECT_FALSE(a2->get_other().ok());
+}
+
+TEST(res_file, SetBeforeLoad)
+{
+    project proj;
+    test_asset::ref a = proj.get_asset_root() / "a";
+    proj.get_transact().run([&](TRANSACT) {
+        a.create(TS, proj);
+        a->set_data(TS, util::blob{ 1 });
+    });
+
+    // Setting a property which has not been loaded yet and then undoing the
+    // change restores the value from the file.
+    project proj2;
+    test_asset::ref a2 = proj2.get_asset_root() / "a";
+    save_and_load(proj, proj2);
+    proj2.get_transact().run([&](TRANSACT) {
+        a2->set_data(TS, util::blob{ 2 });
+    });
+    EXPECT_EQ(a2->get_data().to_blob(), (util::blob{ 2 }));
+    proj2.get_transact().undo();
+    EXPECT_EQ(a2->get_data().to_blob(), (util::blob{ 1 }));
+}
+
+TEST(res_file, BadFile)
+{
+    auto load = [](util::blob data) {
+        project proj;
+        proj.get_transact().run([&](TRANSACT) {
+            load_project(TS, proj, data);
+        });
+    };
+
+    EXPECT_THROW(load({}), import_error);
+    EXPECT_THROW(load({ 1, 2, 3, 4, 1, 0, 0, 0 }), import_error);
+
+    // A name whose parent comes after it.
+    EXPECT_THROW(load({
+        0x44, 0x52, 0x50, 0x4A, 2, 0, 0, 0,
+        1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        3, 0, 0, 0, 1, 0, 'a'
+    }), import_error);
+}
+
+TEST(res_file, CorruptPayload)
+{
+    project proj;
+    test_asset::ref a = proj.get_asset_root() / "a";
+    proj.get_transact().run([&](TRANSACT) {
+        a.create(TS, proj);
+        a->set_data(TS, util::blob{ 1, 2, 3 });
+    });
+
+    std::ostringstream out;
+    save_project(proj, out);
+    auto str = out.str();
+    util::blob data(str.begin(), str.end());
+
+    // Damage to the field data is caught when the file is opened, rather than
+    // when the damaged property is first read.
+    data.back() ^= 0xFF;
+    project proj2;
+    EXPECT_THROW(proj2.get_transact().run([&](TRANSACT) {
+        load_project(TS, proj2, data);
+    }), import_error);
+    EXPECT_TRUE(proj2.get_asset_list().empty());
+}
+
+}
+#endif
+
+}
+}
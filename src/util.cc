@@ -21,9 +21,13 @@
 #include "common.hh"
 #include <sstream>
 #include "util.hh"
+#include "fs.hh"
 
 #if _WIN32
 #include <windows.h> // for wchar_t conversions
+#else
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 namespace drnsf {
@@ -131,5 +135,116 @@ std::fstream fstream_open_bin(
 #endif
 }
 
+// (s-func) sync_file
+// Flushes the contents of the given file from the system's cache to the disk,
+// so that it is complete on disk before it is renamed over another file.
+static void sync_file(const std::string &filename)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileW(
+        u8str_to_wstr(filename).c_str(),
+        GENERIC_WRITE,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr
+    );
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("util::replace_file: failed to sync");
+    DRNSF_ON_EXIT { CloseHandle(file); };
+
+    if (!FlushFileBuffers(file))
+        throw std::runtime_error("util::replace_file: failed to sync");
+#else
+    int fd = open(filename.c_str(), O_WRONLY);
+    if (fd == -1)
+        throw std::runtime_error("util::replace_file: failed to sync");
+    DRNSF_ON_EXIT { close(fd); };
+
+    if (fsync(fd) == -1)
+        throw std::runtime_error("util::replace_file: failed to sync");
+#endif
+}
+
+// declared in util.hh
+void replace_file(
+    const std::string &filename,
+    const std::function<void(std::ostream &)> &write
+) {
+    auto path = fs::u8path(filename);
+    auto temp_path = path;
+    temp_path += ".tmp";
+
+    try {
+        auto file = fstream_open_bin(
+            temp_path.u8string(),
+            std::fstream::out | std::fstream::trunc
+        );
+        if (!file.is_open())
+            throw std::runtime_error("util::replace_file: failed to open");
+        file.exceptions(std::fstream::failbit | std::fstream::badbit);
+        write(file);
+        file.close();
+
+        sync_file(temp_path.u8string());
+        fs::rename(temp_path, path);
+    } catch (...) {
+        std::error_code ec;
+        fs::remove(temp_path, ec);
+        throw;
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_replace_file, Replace)
+{
+    auto filename = (fs::temp_directory_path() / "drnsf_replace_file_test")
+        .u8string();
+    DRNSF_ON_EXIT { fs::remove(fs::u8path(filename)); };
+
+    replace_file(filename, [](std::ostream &out) {
+        out << "old";
+    });
+    replace_file(filename, [](std::ostream &out) {
+        out << "new";
+    });
+
+    auto file = fstream_open_bin(filename, std::fstream::in);
+    std::string contents;
+    file >> contents;
+    EXPECT_EQ(contents, "new");
+    EXPECT_FALSE(fs::exists(fs::u8path(filename + ".tmp")));
+}
+
+TEST(util_replace_file, FailureKeepsOriginal)
+{
+    auto filename = (fs::temp_directory_path() / "drnsf_replace_file_test")
+        .u8string();
+    DRNSF_ON_EXIT { fs::remove(fs::u8path(filename)); };
+
+    replace_file(filename, [](std::ostream &out) {
+        out << "old";
+    });
+    EXPECT_THROW(
+        replace_file(filename, [](std::ostream &out) {
+            out << "partial";
+            throw std::runtime_error("failed");
+        }),
+        std::runtime_error
+    );
+
+    auto file = fstream_open_bin(filename, std::fstream::in);
+    std::string contents;
+    file >> contents;
+    EXPECT_EQ(contents, "old");
+    EXPECT_FALSE(fs::exists(fs::u8path(filename + ".tmp")));
+}
+
+}
+#endif
+
 }
 }
@@ -32,7 +32,13 @@
 #include <vector>
 #include <string>
 #include <list>
+#include <deque>
 #include <fstream>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
 
 namespace drnsf {
 namespace util {
@@ -219,6 +225,21 @@ private:
     std::function<void(Args...)> m_direct_handler;
 
 public:
+    // (default ctor)
+    // Constructs an event with no watches and no direct handler.
+    event() = default;
+
+    // (dtor)
+    // Destroys the event, unbinding any watches which are still bound to it.
+    // This allows a watch to outlive the event it was bound to, such as when
+    // an asset is destroyed after the events of its project.
+    ~event()
+    {
+        while (!m_watchers.empty()) {
+            m_watchers.front()->unbind();
+        }
+    }
+
     // (feed operator)
     // Sets the direct handler function for this event. This may be done only
     // once for the lifetime of the event. The given function must be valid.
@@ -515,6 +536,8 @@ inline auto reverse_of(T &container)
     return reverse_type(container);
 }
 
+class slice;
+
 /*
  * util::binreader
  *
@@ -562,6 +585,27 @@ private:
     // FIXME explain
     int m_bitbuf_len;
 
+    // (func) take
+    // Range-checks a read of `count' values of `width' bytes each and advances
+    // past them, returning a pointer to the first byte read. This is the single
+    // bounds check shared by every byte-aligned read; `where' names the caller
+    // in the exception message if the check fails.
+    const unsigned char *take(size_t count, size_t width, const char *where);
+
+    // (func) load_le
+    // Assembles a little-endian unsigned integer from the given bytes. The
+    // shifts are recognized by the compiler and lowered to a single unaligned
+    // load on little-endian targets.
+    template <typename T>
+    static T load_le(const unsigned char *p)
+    {
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            value |= T(p[i]) << (i * 8);
+        }
+        return value;
+    }
+
 public:
     // (default ctor)
     // FIXME explain
@@ -575,6 +619,11 @@ public:
     // FIXME explain
     void begin(const util::blob &data);
 
+    // (func) begin
+    // Begins reading from the bytes viewed by the given slice. The slice's
+    // storage must remain alive until reading has ended.
+    void begin(const util::slice &data);
+
     // (func) end
     // FIXME explain
     void end();
@@ -595,6 +644,30 @@ public:
     // FIXME explain
     uint32_t read_u32();
 
+    // (func) read_u32_array
+    // Reads `count' consecutive little-endian 32-bit values into `out'. The
+    // whole array is range-checked once up front rather than once per value.
+    void read_u32_array(uint32_t *out, size_t count);
+
+    // (func) read_span
+    // Reads `count' consecutive little-endian values of type T into `out' with
+    // a single range check for the entire span. T must be an unsigned integer
+    // type. If there is not enough data, nothing is read and an exception is
+    // thrown.
+    template <typename T>
+    void read_span(T *out, size_t count)
+    {
+        static_assert(
+            std::is_integral<T>::value && std::is_unsigned<T>::value,
+            "util::binreader::read_span: T must be an unsigned integer"
+        );
+
+        auto p = take(count, sizeof(T), "util::binreader::read_span");
+        for (size_t i = 0; i < count; i++) {
+            out[i] = load_le<T>(p + i * sizeof(T));
+        }
+    }
+
     // (func) read_ubits
     // FIXME explain
     int64_t read_ubits(int bits);
@@ -701,6 +774,178 @@ public:
     void pad(int alignment);
 };
 
+/*
+ * util::thread_pool
+ *
+ * A fixed set of worker threads which run queued tasks in the order they were
+ * posted. This is used to spread independent, CPU-bound work (such as parsing
+ * or encoding NSF pages) across the available processor cores.
+ *
+ * Tasks are posted using `post', which returns a std::future for the task's
+ * result. Any exception thrown by a task is captured in its future and rethrown
+ * when the future's value is retrieved. Waiting on the futures in the order the
+ * tasks were posted gives results in a deterministic order regardless of the
+ * order in which the tasks actually complete.
+ *
+ * Destroying the pool waits for all of the queued tasks to finish.
+ *
+ * Tasks must not access the project, asset, or GUI systems, as these are not
+ * thread-safe.
+ */
+class thread_pool : private nocopy {
+private:
+    // (var) m_threads
+    // The worker threads owned by this pool.
+    std::vector<std::thread> m_threads;
+
+    // (var) m_mutex
+    // Protects m_queue and m_stopping.
+    std::mutex m_mutex;
+
+    // (var) m_cond
+    // Signalled when a task is queued or when the pool is stopping.
+    std::condition_variable m_cond;
+
+    // (var) m_queue
+    // The tasks which have been posted but not yet started by a worker.
+    std::deque<std::function<void()>> m_queue;
+
+    // (var) m_stopping
+    // Set by the destructor to tell the workers to exit once the queue is
+    // empty.
+    bool m_stopping;
+
+    // (func) work
+    // The body of each worker thread.
+    void work();
+
+    // (func) enqueue
+    // Adds a task to the queue and wakes a worker to run it.
+    void enqueue(std::function<void()> task);
+
+public:
+    // (explicit ctor)
+    // Starts a pool with the specified number of worker threads. If the count
+    // is zero, one thread is started for each hardware thread available.
+    explicit thread_pool(int thread_count = 0);
+
+    // (dtor)
+    // Finishes all queued tasks and joins the worker threads.
+    ~thread_pool();
+
+    // (func) get_thread_count
+    // Returns the number of worker threads in the pool.
+    int get_thread_count() const
+    {
+        return m_threads.size();
+    }
+
+    // (func) post
+    // Queues a task to run on one of the worker threads. Returns a future for
+    // the value returned by the task.
+    template <typename F>
+    auto post(F f) -> std::future<decltype(f())>
+    {
+        using result_type = decltype(f());
+
+        // std::function requires a copyable functor, but packaged_task is
+        // move-only, so it is held by a shared pointer.
+        auto task = std::make_shared<std::packaged_task<result_type()>>(
+            std::move(f)
+        );
+        auto future = task->get_future();
+        enqueue([task]{ (*task)(); });
+        return future;
+    }
+};
+
+/*
+ * util::cancelled_error
+ *
+ * The error thrown by a long-running operation which stopped early because it
+ * was cancelled through its `util::progress'.
+ */
+class cancelled_error : public std::runtime_error {
+public:
+    // (ctor)
+    // Constructs the error with a generic message.
+    cancelled_error() :
+        runtime_error("operation cancelled") {}
+};
+
+/*
+ * util::progress
+ *
+ * Shared state between a long-running operation, usually on another thread,
+ * and whoever is waiting for it. The operation sets the total amount of work
+ * and adds to the amount done as it goes, and checks regularly whether it has
+ * been asked to stop. Any thread may read the progress or request
+ * cancellation at any time.
+ */
+class progress : private nocopy {
+private:
+    // (var) m_done, m_total
+    // The amount of work done so far, and the total amount of work. The units
+    // are up to the operation, such as pages or bytes.
+    std::atomic<long> m_done{0};
+    std::atomic<long> m_total{0};
+
+    // (var) m_cancelled
+    // True if `cancel' has been called.
+    std::atomic<bool> m_cancelled{false};
+
+public:
+    // (func) get_done, get_total
+    // Returns the amount of work done so far, or the total amount of work.
+    // The total is zero if the operation has not yet determined it.
+    long get_done() const
+    {
+        return m_done;
+    }
+    long get_total() const
+    {
+        return m_total;
+    }
+
+    // (func) set_total
+    // Sets the total amount of work and resets the amount done to zero.
+    void set_total(long total)
+    {
+        m_done = 0;
+        m_total = total;
+    }
+
+    // (func) add_done
+    // Adds to the amount of work done.
+    void add_done(long amount = 1)
+    {
+        m_done += amount;
+    }
+
+    // (func) cancel
+    // Asks the operation to stop as soon as it can.
+    void cancel()
+    {
+        m_cancelled = true;
+    }
+
+    // (func) is_cancelled
+    // Returns true if `cancel' has been called.
+    bool is_cancelled() const
+    {
+        return m_cancelled;
+    }
+
+    // (func) check
+    // Throws `cancelled_error' if `cancel' has been called. Operations call
+    // this between units of work.
+    void check() const
+    {
+        if (m_cancelled)
+            throw cancelled_error();
+    }
+};
+
 /*
  * util::on_exit_helper
  *
@@ -764,5 +1009,270 @@ std::fstream fstream_open_bin(
     std::fstream::openmode mode
 );
 
+/*
+ * util::replace_file
+ *
+ * Writes a file safely by calling `write' with a stream open on a temporary
+ * file beside it, and only once that has succeeded, renaming the temporary
+ * file over `filename'. If anything fails, including `write' throwing, the
+ * temporary file is removed and any existing file at `filename' is left as it
+ * was, so the file is never left partly written.
+ *
+ * The stream has `failbit' and `badbit' exceptions enabled. The temporary file
+ * is flushed to the disk before it is renamed, so a crash cannot leave a
+ * renamed but incomplete file; the rename itself may still be lost.
+ *
+ * On Windows, a file cannot be replaced while it is mapped by a
+ * `mapped_file', such as the NSF file a project was imported from. Replacing
+ * one fails and leaves it as it was.
+ */
+void replace_file(
+    const std::string &filename,
+    const std::function<void(std::ostream &)> &write
+);
+
+/*
+ * util::hash64
+ *
+ * Computes the 64-bit XXH64 hash of the given bytes with the given seed. This
+ * is fast enough to hash whole NSF files, but is not a cryptographic hash.
+ */
+uint64_t hash64(const byte *data, size_t size, uint64_t seed = 0);
+
+/*
+ * util::disk_cache
+ *
+ * A directory of files, each stored under a key, which is kept to a bounded
+ * total size. When storing a file takes the directory over its size limit,
+ * the least recently used files are removed until it is back under the limit.
+ * A file's modification time records when it was last stored or found.
+ *
+ * Keys are used as filenames, so they should be simple strings such as hex
+ * digests. Several processes may use the same directory; a file which cannot
+ * be removed because it is in use is left in place.
+ */
+class disk_cache : private nocopy {
+private:
+    // (var) m_dir
+    // The directory holding the cached files.
+    std::string m_dir;
+
+    // (var) m_max_size
+    // The total size in bytes which the cached files are kept under.
+    uint64_t m_max_size;
+
+    // (func) evict
+    // Removes the least recently used files other than `keep' until the total
+    // size is at most `m_max_size'.
+    void evict(const std::string &keep);
+
+public:
+    // (explicit ctor)
+    // Uses the given directory, which is created when the first file is
+    // stored, with the given size limit.
+    explicit disk_cache(std::string dir, uint64_t max_size) :
+        m_dir(std::move(dir)),
+        m_max_size(max_size) {}
+
+    // (s-func) get_default_dir
+    // Returns the directory for DRNSF's caches in the user's local cache
+    // directory, such as `~/.cache/drnsf' or `%LOCALAPPDATA%\drnsf\cache'.
+    static std::string get_default_dir();
+
+    // (func) find
+    // Returns the filename of the file stored under the given key and marks it
+    // as the most recently used, or returns an empty string if there is none.
+    std::string find(const std::string &key) const;
+
+    // (func) store
+    // Stores a file under the given key, written by `write' as described for
+    // `replace_file', and then removes old files as needed to stay under the
+    // size limit.
+    void store(
+        const std::string &key,
+        const std::function<void(std::ostream &)> &write);
+
+    // (func) remove
+    // Removes the file stored under the given key, if any, such as one which
+    // turned out to be unusable. A file which cannot be removed is left in
+    // place.
+    void remove(const std::string &key);
+};
+
+/*
+ * util::mapped_file
+ *
+ * Provides read-only access to the contents of a file by mapping it into the
+ * process's address space instead of reading it into a buffer. The operating
+ * system loads the file's data on demand as it is accessed, so opening even a
+ * very large file is cheap until its contents are actually used.
+ *
+ * The mapped data remains valid for the lifetime of the object. The file must
+ * not be modified by another process while it is mapped.
+ *
+ * Like `fstream_open_bin', the filename is converted as necessary on certain
+ * platforms (Windows).
+ */
+class mapped_file : private nocopy {
+private:
+    // (var) m_data
+    // A pointer to the start of the mapped file contents, or null if the file
+    // is empty (an empty file cannot be mapped).
+    const unsigned char *m_data;
+
+    // (var) m_size
+    // The size of the file, in bytes.
+    size_t m_size;
+
+public:
+    // (explicit ctor)
+    // Opens and maps the specified file. Throws std::runtime_error if the file
+    // could not be opened or mapped.
+    explicit mapped_file(const std::string &filename);
+
+    // (dtor)
+    // Unmaps the file.
+    ~mapped_file();
+
+    // (func) data
+    // Returns a pointer to the mapped file contents. This may be null if the
+    // file is empty.
+    const unsigned char *data() const
+    {
+        return m_data;
+    }
+
+    // (func) size
+    // Returns the size of the mapped file, in bytes.
+    size_t size() const
+    {
+        return m_size;
+    }
+};
+
+/*
+ * util::slice
+ *
+ * An immutable, reference-counted view of a range of bytes. A slice shares
+ * ownership of the buffer it points into, so the buffer stays alive for as long
+ * as any slice of it exists. Taking a sub-slice of a slice does not copy any
+ * data; the result simply points into the same parent buffer.
+ *
+ * This allows data to be passed down from an NSF file to its pages, from pages
+ * to their pagelets, and from pagelets to their items without duplicating the
+ * bytes at every level.
+ *
+ * A slice may be created from a blob (which is moved into shared storage) or
+ * from a shared mapped_file.
+ */
+class slice {
+private:
+    // (var) m_owner
+    // The object which owns the storage this slice points into. This may be
+    // null for an empty slice.
+    std::shared_ptr<const void> m_owner;
+
+    // (var) m_data
+    // A pointer to the first byte of the slice. This may be null if the slice
+    // is empty.
+    const byte *m_data;
+
+    // (var) m_size
+    // The number of bytes in the slice.
+    size_t m_size;
+
+public:
+    // (default ctor)
+    // Constructs an empty slice.
+    slice() noexcept :
+        m_data(nullptr),
+        m_size(0) {}
+
+    // (conversion ctor)
+    // Constructs a slice over the entire contents of the given blob. The blob
+    // is moved into newly allocated shared storage.
+    slice(blob data);
+
+    // (explicit ctor)
+    // Constructs a slice over the entire contents of the given mapped file.
+    // The slice shares ownership of the mapping.
+    explicit slice(std::shared_ptr<const mapped_file> file);
+
+    // (explicit ctor)
+    // Constructs a slice over `size' bytes at `data', which must point into
+    // storage kept alive by `owner'.
+    explicit slice(
+        std::shared_ptr<const void> owner,
+        const byte *data,
+        size_t size) :
+        m_owner(std::move(owner)),
+        m_data(data),
+        m_size(size) {}
+
+    // (func) data
+    // Returns a pointer to the first byte of the slice.
+    const byte *data() const
+    {
+        return m_data;
+    }
+
+    // (func) size
+    // Returns the number of bytes in the slice.
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    // (func) empty
+    // Returns true if the slice contains no bytes.
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    // (func) begin, end
+    // Returns pointers to the beginning and end of the slice, for use in
+    // for-range loops and standard algorithms.
+    const byte *begin() const
+    {
+        return m_data;
+    }
+    const byte *end() const
+    {
+        return m_data + m_size;
+    }
+
+    // (subscript operator)
+    // Returns the byte at the given offset. This is not range-checked.
+    const byte &operator [](size_t offset) const
+    {
+        return m_data[offset];
+    }
+
+    // (func) sub
+    // Returns a slice of `size' bytes starting at `offset' within this slice.
+    // The result shares this slice's storage. Throws std::logic_error if the
+    // requested range is not within this slice.
+    slice sub(size_t offset, size_t size) const;
+
+    // (func) to_blob
+    // Returns a copy of the bytes in this slice as a new blob.
+    blob to_blob() const
+    {
+        return blob(begin(), end());
+    }
+
+    // (equal operator)
+    // Compares the contents of two slices, byte-by-byte.
+    friend bool operator ==(const slice &lhs, const slice &rhs);
+
+    // (not-equal operator)
+    // Compares the contents of two slices, byte-by-byte.
+    friend bool operator !=(const slice &lhs, const slice &rhs)
+    {
+        return !(lhs == rhs);
+    }
+};
+
 }
 }
@@ -62,6 +62,22 @@ void binreader::begin(const util::blob &data)
     }
 }
 
+// declared in util.hh
+void binreader::begin(const util::slice &data)
+{
+    if (m_data)
+        throw std::logic_error("util::binreader::begin: already started");
+
+    if (data.empty()) {
+        static unsigned char garbage[1];
+        m_data = garbage;
+        m_size = 0;
+    } else {
+        m_data = data.data();
+        m_size = data.size();
+    }
+}
+
 // declared in util.hh
 void binreader::end()
 {
@@ -91,36 +107,50 @@ void binreader::end_early()
 }
 
 // declared in util.hh
-uint8_t binreader::read_u8()
+const unsigned char *binreader::take(
+    size_t count,
+    size_t width,
+    const char *where)
 {
-    if (m_size == 0)
-        throw std::logic_error("util::binreader::read_u8: out of data");
+    // Compare by division so that a huge `count' cannot overflow the byte
+    // total and slip past the check.
+    if (count > m_size / width)
+        throw std::logic_error(std::string(where) + ": out of data");
 
     if (m_bitbuf_len > 0)
-        throw std::logic_error("util::binreader::read_u8: bit data remaining");
+        throw std::logic_error(std::string(where) + ": bit data remaining");
 
-    uint8_t value = *m_data;
-    m_data++;
-    m_size--;
-    return value;
+    auto p = m_data;
+    m_data += count * width;
+    m_size -= count * width;
+    return p;
+}
+
+// declared in util.hh
+uint8_t binreader::read_u8()
+{
+    return *take(1, 1, "util::binreader::read_u8");
 }
 
 // declared in util.hh
 uint16_t binreader::read_u16()
 {
-    uint16_t value;
-    value  = read_u8();
-    value |= read_u8() << 8;
-    return value;
+    return load_le<uint16_t>(take(1, 2, "util::binreader::read_u16"));
 }
 
 // declared in util.hh
 uint32_t binreader::read_u32()
 {
-    uint32_t value;
-    value  = read_u16();
-    value |= read_u16() << 16;
-    return value;
+    return load_le<uint32_t>(take(1, 4, "util::binreader::read_u32"));
+}
+
+// declared in util.hh
+void binreader::read_u32_array(uint32_t *out, size_t count)
+{
+    auto p = take(count, 4, "util::binreader::read_u32_array");
+    for (size_t i = 0; i < count; i++) {
+        out[i] = load_le<uint32_t>(p + i * 4);
+    }
 }
 
 // declared in util.hh
@@ -395,6 +425,47 @@ TEST(util_binreader, OverrunError)
     EXPECT_THROW(r_8.read_u8(), std::logic_error);
 }
 
+TEST(util_binreader, ArrayRead)
+{
+    blob data = {
+        0x34, 0x12,
+        1, 0, 0, 0,
+        0xFF, 0xFF, 0xFF, 0x7F,
+        0x00, 0x00, 0x00, 0x80,
+        0xAA, 0xBB
+    };
+    binreader r;
+    r.begin(data);
+    EXPECT_EQ(r.read_u16(), 0x1234);
+    uint32_t values[3];
+    r.read_u32_array(values, 3);
+    EXPECT_EQ(values[0], 1u);
+    EXPECT_EQ(values[1], 0x7FFFFFFFu);
+    EXPECT_EQ(values[2], 0x80000000u);
+    uint8_t bytes[2];
+    r.read_span(bytes, 2);
+    EXPECT_EQ(bytes[0], 0xAA);
+    EXPECT_EQ(bytes[1], 0xBB);
+    r.read_u32_array(values, 0);
+    r.end();
+}
+
+TEST(util_binreader, ArrayOverrunError)
+{
+    blob data(11);
+    binreader r;
+    r.begin(data);
+    uint32_t values[3];
+    EXPECT_THROW(r.read_u32_array(values, 3), std::logic_error);
+    EXPECT_THROW(r.read_u32_array(values, SIZE_MAX), std::logic_error);
+
+    // A failed bulk read consumes nothing.
+    uint16_t halves[5];
+    r.read_span(halves, 5);
+    EXPECT_EQ(r.read_u8(), 0);
+    r.end();
+}
+
 }
 #endif
 
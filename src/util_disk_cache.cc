@@ -0,0 +1,186 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "common.hh"
+#include <cstdlib>
+#include <algorithm>
+#include "util.hh"
+#include "fs.hh"
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+std::string disk_cache::get_default_dir()
+{
+#ifdef _WIN32
+    auto local_app_data = _wgetenv(L"LOCALAPPDATA");
+    if (local_app_data) {
+        return (fs::path(local_app_data) / "drnsf" / "cache").u8string();
+    }
+#else
+    auto xdg_cache_home = std::getenv("XDG_CACHE_HOME");
+    if (xdg_cache_home && *xdg_cache_home) {
+        return (fs::u8path(xdg_cache_home) / "drnsf").u8string();
+    }
+
+    auto home = std::getenv("HOME");
+    if (home && *home) {
+        return (fs::u8path(home) / ".cache" / "drnsf").u8string();
+    }
+#endif
+
+    return (fs::temp_directory_path() / "drnsf-cache").u8string();
+}
+
+// declared in util.hh
+std::string disk_cache::find(const std::string &key) const
+{
+    auto path = fs::u8path(m_dir) / fs::u8path(key);
+
+    std::error_code ec;
+    if (!fs::is_regular_file(path, ec))
+        return {};
+
+    // Mark the file as used. If this fails, the file is merely more likely to
+    // be evicted.
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+
+    return path.u8string();
+}
+
+// declared in util.hh
+void disk_cache::store(
+    const std::string &key,
+    const std::function<void(std::ostream &)> &write)
+{
+    fs::create_directories(fs::u8path(m_dir));
+    replace_file((fs::u8path(m_dir) / fs::u8path(key)).u8string(), write);
+    evict(key);
+}
+
+// declared in util.hh
+void disk_cache::remove(const std::string &key)
+{
+    std::error_code ec;
+    fs::remove(fs::u8path(m_dir) / fs::u8path(key), ec);
+}
+
+// declared in util.hh
+void disk_cache::evict(const std::string &keep)
+{
+    struct file_info {
+        fs::path path;
+        fs::file_time_type time;
+        uint64_t size;
+    };
+
+    // List the cached files, skipping the temporary files of any stores which
+    // are in progress.
+    std::vector<file_info> files;
+    uint64_t total_size = 0;
+    std::error_code ec;
+    for (auto &&entry : fs::directory_iterator(fs::u8path(m_dir), ec)) {
+        auto &&path = entry.path();
+        if (path.extension() == ".tmp" || !fs::is_regular_file(path, ec))
+            continue;
+
+        file_info info;
+        info.path = path;
+        info.time = fs::last_write_time(path, ec);
+        info.size = fs::file_size(path, ec);
+        if (ec)
+            continue;
+
+        total_size += info.size;
+        if (path.filename().u8string() != keep) {
+            files.push_back(std::move(info));
+        }
+    }
+
+    // Remove the least recently used files first.
+    std::sort(
+        files.begin(),
+        files.end(),
+        [](const file_info &lhs, const file_info &rhs) {
+            return lhs.time < rhs.time;
+        }
+    );
+    for (auto &&file : files) {
+        if (total_size <= m_max_size)
+            break;
+
+        if (fs::remove(file.path, ec)) {
+            total_size -= file.size;
+        }
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_disk_cache, StoreAndEvict)
+{
+    auto dir = fs::temp_directory_path() / "drnsf_disk_cache_test";
+    fs::remove_all(dir);
+    DRNSF_ON_EXIT { fs::remove_all(dir); };
+
+    disk_cache cache(dir.u8string(), 250);
+    auto write_100 = [](std::ostream &out) {
+        out << std::string(100, 'x');
+    };
+
+    EXPECT_EQ(cache.find("a"), "");
+    cache.store("a", write_100);
+    cache.store("b", write_100);
+    EXPECT_NE(cache.find("a"), "");
+    EXPECT_NE(cache.find("b"), "");
+
+    // Make `a' the older file, then use it so that `b' is the least recently
+    // used, and is evicted when `c' is stored.
+    auto now = fs::file_time_type::clock::now();
+    fs::last_write_time(dir / "a", now - std::chrono::hours(2));
+    fs::last_write_time(dir / "b", now - std::chrono::hours(1));
+    EXPECT_NE(cache.find("a"), "");
+    cache.store("c", write_100);
+    EXPECT_NE(cache.find("a"), "");
+    EXPECT_EQ(cache.find("b"), "");
+    EXPECT_NE(cache.find("c"), "");
+
+    // A file over the limit by itself is still kept.
+    cache.store("d", [](std::ostream &out) {
+        out << std::string(300, 'x');
+    });
+    EXPECT_EQ(cache.find("a"), "");
+    EXPECT_EQ(cache.find("c"), "");
+    EXPECT_NE(cache.find("d"), "");
+
+    // Removing a file which is already gone does nothing.
+    cache.remove("d");
+    EXPECT_EQ(cache.find("d"), "");
+    cache.remove("d");
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,164 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "common.hh"
+#include <cstring>
+#include "util.hh"
+
+namespace drnsf {
+namespace util {
+
+namespace {
+
+// (internal consts) prime1 ... prime5
+// The XXH64 primes.
+constexpr uint64_t prime1 = 0x9E3779B185EBCA87;
+constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4F;
+constexpr uint64_t prime3 = 0x165667B19E3779F9;
+constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63;
+constexpr uint64_t prime5 = 0x27D4EB2F165667C5;
+
+// (internal func) rotl
+// Rotates a 64-bit value left by the given number of bits.
+inline uint64_t rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// (internal funcs) load_u32, load_u64
+// Read little-endian words from possibly unaligned data. Compilers turn these
+// into single loads on little-endian targets.
+inline uint64_t load_u32(const byte *p)
+{
+    return uint32_t(p[0]) |
+        uint32_t(p[1]) << 8 |
+        uint32_t(p[2]) << 16 |
+        uint32_t(p[3]) << 24;
+}
+inline uint64_t load_u64(const byte *p)
+{
+    return load_u32(p) | load_u32(p + 4) << 32;
+}
+
+// (internal func) hash_round
+// Mixes one 64-bit lane of input into an accumulator.
+inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+// (internal func) merge_round
+// Folds one of the four lane accumulators into the hash.
+inline uint64_t merge_round(uint64_t hash, uint64_t acc)
+{
+    hash ^= hash_round(0, acc);
+    return hash * prime1 + prime4;
+}
+
+}
+
+// declared in util.hh
+uint64_t hash64(const byte *data, size_t size, uint64_t seed)
+{
+    const byte *p = data;
+    const byte *end = data + size;
+    uint64_t hash;
+
+    // Hash the input 32 bytes at a time in four independent lanes.
+    if (size >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        for (; end - p >= 32; p += 32) {
+            v1 = hash_round(v1, load_u64(p));
+            v2 = hash_round(v2, load_u64(p + 8));
+            v3 = hash_round(v3, load_u64(p + 16));
+            v4 = hash_round(v4, load_u64(p + 24));
+        }
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = merge_round(hash, v1);
+        hash = merge_round(hash, v2);
+        hash = merge_round(hash, v3);
+        hash = merge_round(hash, v4);
+    } else {
+        hash = seed + prime5;
+    }
+    hash += size;
+
+    // Hash the remaining bytes.
+    for (; end - p >= 8; p += 8) {
+        hash ^= hash_round(0, load_u64(p));
+        hash = rotl(hash, 27) * prime1 + prime4;
+    }
+    if (end - p >= 4) {
+        hash ^= load_u32(p) * prime1;
+        hash = rotl(hash, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * prime5;
+        hash = rotl(hash, 11) * prime1;
+    }
+
+    // Mix the final hash.
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (internal func) hash_str
+// Hashes the characters of a string.
+uint64_t hash_str(const char *s, uint64_t seed = 0)
+{
+    return hash64(reinterpret_cast<const byte *>(s), std::strlen(s), seed);
+}
+
+TEST(util_hash64, KnownValues)
+{
+    EXPECT_EQ(hash_str(""), 0xEF46DB3751D8E999u);
+    EXPECT_EQ(hash_str("a"), 0xD24EC4F1A98C6E5Bu);
+    EXPECT_EQ(hash_str("abc"), 0x44BC2CF5AD770999u);
+    EXPECT_EQ(
+        hash_str("Nobody inspects the spammish repetition"),
+        0xFBCEA83C8A378BF1u
+    );
+}
+
+TEST(util_hash64, Seed)
+{
+    EXPECT_NE(hash_str("abc", 1), hash_str("abc"));
+    EXPECT_EQ(hash_str("abc", 1), hash_str("abc", 1));
+}
+
+}
+#endif
+
+}
+}
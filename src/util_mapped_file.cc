@@ -0,0 +1,165 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "util.hh"
+#include "fs.hh"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+mapped_file::mapped_file(const std::string &filename) :
+    m_data(nullptr),
+    m_size(0)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileW(
+        u8str_to_wstr(filename).c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr
+    );
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("util::mapped_file: failed to open file");
+    DRNSF_ON_EXIT { CloseHandle(file); };
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+        throw std::runtime_error("util::mapped_file: failed to get size");
+
+    if (size.QuadPart == 0)
+        return;
+
+    // The mapping object may be closed as soon as the view is created; the
+    // view keeps the mapping alive until it is unmapped.
+    HANDLE mapping = CreateFileMappingW(
+        file,
+        nullptr,
+        PAGE_READONLY,
+        0,
+        0,
+        nullptr
+    );
+    if (!mapping)
+        throw std::runtime_error("util::mapped_file: failed to map file");
+    DRNSF_ON_EXIT { CloseHandle(mapping); };
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+        throw std::runtime_error("util::mapped_file: failed to map file");
+
+    m_data = static_cast<const unsigned char *>(view);
+    m_size = size.QuadPart;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("util::mapped_file: failed to open file");
+    DRNSF_ON_EXIT { close(fd); };
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw std::runtime_error("util::mapped_file: failed to get size");
+
+    if (st.st_size == 0)
+        return;
+
+    // The file descriptor may be closed as soon as the mapping is created; the
+    // mapping keeps its own reference to the file.
+    void *view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED)
+        throw std::runtime_error("util::mapped_file: failed to map file");
+
+    m_data = static_cast<const unsigned char *>(view);
+    m_size = st.st_size;
+#endif
+}
+
+// declared in util.hh
+mapped_file::~mapped_file()
+{
+    if (!m_data)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+#else
+    munmap(const_cast<unsigned char *>(m_data), m_size);
+#endif
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_mapped_file, ReadContents)
+{
+    auto filename = (fs::temp_directory_path() / "drnsf_mapped_file_test")
+        .string();
+    blob data = { 0, 1, 0x7F, 0x80, 0xFF };
+    {
+        auto f = fstream_open_bin(filename, std::fstream::out);
+        f.write(reinterpret_cast<char *>(data.data()), data.size());
+    }
+    DRNSF_ON_EXIT { fs::remove(filename); };
+
+    mapped_file m(filename);
+    ASSERT_EQ(m.size(), data.size());
+    EXPECT_EQ(blob(m.data(), m.data() + m.size()), data);
+}
+
+TEST(util_mapped_file, EmptyFile)
+{
+    auto filename = (fs::temp_directory_path() / "drnsf_mapped_file_test")
+        .string();
+    {
+        auto f = fstream_open_bin(filename, std::fstream::out);
+    }
+    DRNSF_ON_EXIT { fs::remove(filename); };
+
+    mapped_file m(filename);
+    EXPECT_EQ(m.size(), 0u);
+    EXPECT_EQ(m.data(), nullptr);
+}
+
+TEST(util_mapped_file, MissingFileError)
+{
+    EXPECT_THROW(
+        mapped_file("drnsf_mapped_file_test_nonexistent"),
+        std::runtime_error
+    );
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,143 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <cstring>
+#include "util.hh"
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+slice::slice(blob data) :
+    slice()
+{
+    if (data.empty())
+        return;
+
+    auto owner = std::make_shared<const blob>(std::move(data));
+    m_data = owner->data();
+    m_size = owner->size();
+    m_owner = std::move(owner);
+}
+
+// declared in util.hh
+slice::slice(std::shared_ptr<const mapped_file> file) :
+    slice()
+{
+    if (!file)
+        throw std::logic_error("util::slice: null file arg");
+
+    m_data = file->data();
+    m_size = file->size();
+    m_owner = std::move(file);
+}
+
+// declared in util.hh
+slice slice::sub(size_t offset, size_t size) const
+{
+    if (offset > m_size || size > m_size - offset)
+        throw std::logic_error("util::slice::sub: out of range");
+
+    if (size == 0)
+        return slice();
+
+    return slice(m_owner, m_data + offset, size);
+}
+
+// declared in util.hh
+bool operator ==(const slice &lhs, const slice &rhs)
+{
+    if (lhs.m_size != rhs.m_size)
+        return false;
+
+    if (lhs.m_data == rhs.m_data || lhs.m_size == 0)
+        return true;
+
+    return std::memcmp(lhs.m_data, rhs.m_data, lhs.m_size) == 0;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_slice, FromBlob)
+{
+    blob data = { 0, 1, 0x7F, 0x80, 0xFF };
+    slice s = data;
+    EXPECT_EQ(s.size(), data.size());
+    EXPECT_EQ(s.to_blob(), data);
+    EXPECT_EQ(s[3], 0x80);
+}
+
+TEST(util_slice, Empty)
+{
+    slice s;
+    EXPECT_TRUE(s.empty());
+    EXPECT_EQ(s.begin(), s.end());
+    EXPECT_EQ(s, slice(blob{}));
+}
+
+TEST(util_slice, SubShareStorage)
+{
+    slice s = blob{ 0, 1, 2, 3, 4, 5, 6, 7 };
+    auto sub = s.sub(2, 4);
+    EXPECT_EQ(sub.data(), s.data() + 2);
+    EXPECT_EQ(sub.to_blob(), (blob{ 2, 3, 4, 5 }));
+
+    auto subsub = sub.sub(1, 2);
+    EXPECT_EQ(subsub.data(), s.data() + 3);
+    EXPECT_EQ(subsub.to_blob(), (blob{ 3, 4 }));
+}
+
+TEST(util_slice, SubOutlivesParent)
+{
+    slice sub;
+    {
+        slice s = blob{ 0, 1, 2, 3 };
+        sub = s.sub(1, 3);
+    }
+    EXPECT_EQ(sub.to_blob(), (blob{ 1, 2, 3 }));
+}
+
+TEST(util_slice, SubRangeError)
+{
+    slice s = blob{ 0, 1, 2, 3 };
+    EXPECT_NO_THROW(s.sub(4, 0));
+    EXPECT_THROW(s.sub(5, 0), std::logic_error);
+    EXPECT_THROW(s.sub(2, 3), std::logic_error);
+    EXPECT_THROW(s.sub(1, SIZE_MAX), std::logic_error);
+}
+
+TEST(util_slice, Compare)
+{
+    slice a = blob{ 1, 2, 3 };
+    slice b = blob{ 1, 2, 3 };
+    slice c = blob{ 1, 2, 4 };
+    slice d = blob{ 1, 2 };
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+    EXPECT_NE(a, d);
+}
+
+}
+#endif
+
+}
+}
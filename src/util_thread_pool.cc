@@ -0,0 +1,147 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <atomic>
+#include "util.hh"
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+thread_pool::thread_pool(int thread_count) :
+    m_stopping(false)
+{
+    if (thread_count < 0)
+        throw std::logic_error("util::thread_pool: bad thread count");
+
+    if (thread_count == 0) {
+        // hardware_concurrency may return zero if the count is not known.
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    try {
+        for (int i = 0; i < thread_count; i++) {
+            m_threads.emplace_back(&thread_pool::work, this);
+        }
+    } catch (...) {
+        // Stop any threads which were successfully started before the
+        // failure.
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_cond.notify_all();
+        for (auto &&thread : m_threads) {
+            thread.join();
+        }
+        throw;
+    }
+}
+
+// declared in util.hh
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cond.notify_all();
+    for (auto &&thread : m_threads) {
+        thread.join();
+    }
+}
+
+// declared in util.hh
+void thread_pool::work()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]{
+                return m_stopping || !m_queue.empty();
+            });
+
+            // Only exit once all of the queued tasks have been run.
+            if (m_queue.empty())
+                return;
+
+            task = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        task();
+    }
+}
+
+// declared in util.hh
+void thread_pool::enqueue(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(std::move(task));
+    }
+    m_cond.notify_one();
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_thread_pool, OrderedResults)
+{
+    thread_pool pool(4);
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 100; i++) {
+        results.push_back(pool.post([i]{ return i * i; }));
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(results[i].get(), i * i);
+    }
+}
+
+TEST(util_thread_pool, TaskException)
+{
+    thread_pool pool(2);
+    auto ok = pool.post([]{ return 1; });
+    auto bad = pool.post([]() -> int {
+        throw std::runtime_error("task failed");
+    });
+    EXPECT_EQ(ok.get(), 1);
+    EXPECT_THROW(bad.get(), std::runtime_error);
+}
+
+TEST(util_thread_pool, FinishOnDestroy)
+{
+    std::atomic<int> count(0);
+    {
+        thread_pool pool(3);
+        for (int i = 0; i < 50; i++) {
+            pool.post([&]{ count++; });
+        }
+    }
+    EXPECT_EQ(count, 50);
+}
+
+}
+#endif
+
+}
+}